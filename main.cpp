@@ -1,6 +1,7 @@
 #include "alphabet.hpp"
 #include "constants.hpp"
 #include "language_model.hpp"
+#include "logits_archive.hpp"
 #include "src/decoder.hpp"
 #include <Eigen/Eigen>
 #include <fstream>
@@ -70,7 +71,44 @@ static Eigen::Matrix<float, 13, 8> TEST_LOGIT{
 static std::vector<std::string> SAMPLE_LABELS{" ", "b", "g", "n",
                                               "s", "u", "y", ""};
 
-int main() {
+// Decode every utterance of a .ctcl, .npy or .npz file, printing one
+// "name<TAB>text" line each. labels_file holds one label per line, the
+// sample labels are used without it.
+int decode_file(const std::string &logits_file,
+                const std::optional<std::string> &labels_file) {
+  auto labels = SAMPLE_LABELS;
+  if (labels_file.has_value()) {
+    labels.clear();
+    std::ifstream is(labels_file.value());
+    std::string label;
+    while (std::getline(is, label)) {
+      labels.push_back(label);
+    }
+  }
+  const auto archive = pyctcdecode::LogitsArchive::open(logits_file);
+  const pyctcdecode::BeamSearchDecoderCTC decoder(
+      pyctcdecode::Alphabet::build_alphabet(labels));
+  if (archive.size() > 0) {
+    archive.prefetch(0);
+  }
+  for (size_t i = 0; i < archive.size(); i++) {
+    // read the next utterance while this one decodes
+    if (i + 1 < archive.size()) {
+      archive.prefetch(i + 1);
+    }
+    const auto output_beams = pyctcdecode::decode_entry(decoder, archive.at(i));
+    printf("%s\t%s\n", archive.at(i).name.c_str(),
+           output_beams.empty() ? "" : output_beams.at(0).text_.c_str());
+  }
+  return 0;
+}
+
+// usage: main [logits_file [labels_file]]
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    return decode_file(argv[1], argc > 2 ? std::optional<std::string>(argv[2])
+                                         : std::nullopt);
+  }
   const pyctcdecode::Beam test_beam{"hi",
                                     "hello",
                                     "world",
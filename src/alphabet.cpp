@@ -1,6 +1,7 @@
 #include "alphabet.hpp"
 #include "constants.hpp"
 #include <algorithm>
+#include <iterator>
 #include <memory>
 #include <regex>
 #include <sstream>
@@ -86,17 +87,91 @@ normalize_regular_alphabet(const pyctcdecode::Labels &labels) {
   printf("normalized labels [%s]\n", ss.str().c_str());
   return normalized_labels;
 }
+
+bool starts_with(const std::string &label, const std::string &prefix) {
+  return label.compare(0, prefix.size(), prefix) == 0;
+}
+
+bool ends_with(const std::string &label, const std::string &suffix) {
+  return label.size() >= suffix.size() &&
+         label.compare(label.size() - suffix.size(), suffix.size(), suffix) ==
+             0;
+}
+
+pyctcdecode::Labels normalize_bpe_alphabet(const pyctcdecode::Labels &labels) {
+  auto normalized_labels = labels;
+  std::smatch base_match;
+  for (auto &label : normalized_labels) {
+    if (std::regex_search(label, base_match, pyctcdecode::UNK_TOKEN_PTN)) {
+      printf("Found [%s] in vocab, replacing with [%s]\n", label.c_str(),
+             pyctcdecode::UNK_BPE_TOKEN.c_str());
+      label = pyctcdecode::UNK_BPE_TOKEN;
+    } else if (std::regex_search(label, base_match,
+                                 pyctcdecode::BLANK_TOKEN_PTN)) {
+      printf("Found [%s] in vocab, replacing with empty string\n",
+             label.c_str());
+      label = "";
+    }
+  }
+  // wordpiece marks the pieces continuing a word, turn it into sentencepiece
+  // style where the pieces starting one are marked
+  const auto is_wordpiece =
+      std::any_of(normalized_labels.cbegin(), normalized_labels.cend(),
+                  [](const std::string &label) {
+                    return starts_with(label, pyctcdecode::BPE_TOKEN_ALT);
+                  });
+  if (is_wordpiece) {
+    printf("Found [%s] word pieces, converting to [%s] pieces\n",
+           pyctcdecode::BPE_TOKEN_ALT.c_str(), pyctcdecode::BPE_TOKEN.c_str());
+    for (auto &label : normalized_labels) {
+      if (starts_with(label, pyctcdecode::BPE_TOKEN_ALT)) {
+        label.erase(0, pyctcdecode::BPE_TOKEN_ALT.size());
+      } else if (!label.empty() && label != pyctcdecode::UNK_BPE_TOKEN) {
+        label = pyctcdecode::BPE_TOKEN + label;
+      }
+    }
+  }
+  if (std::find(normalized_labels.cbegin(), normalized_labels.cend(), "") ==
+      normalized_labels.end()) {
+    printf("appending blank char\n");
+    normalized_labels.push_back("");
+  }
+  return normalized_labels;
+}
+
+pyctcdecode::BpePiece split_bpe_label(const std::string &label) {
+  pyctcdecode::BpePiece piece{label, false, false};
+  if (starts_with(piece.text, pyctcdecode::BPE_TOKEN)) {
+    piece.text.erase(0, pyctcdecode::BPE_TOKEN.size());
+    piece.starts_word = true;
+  }
+  if (ends_with(piece.text, pyctcdecode::BPE_TOKEN)) {
+    piece.text.erase(piece.text.size() - pyctcdecode::BPE_TOKEN.size());
+    piece.ends_word = true;
+  } else if (piece.starts_word && piece.text.empty()) {
+    // a lone marker both opens and closes a word
+    piece.ends_word = true;
+  }
+  return piece;
+}
 } // namespace
 
 namespace pyctcdecode {
 Alphabet::Alphabet(Labels labels, bool is_bpe)
-    : labels_(std::move(labels)), is_bpe_(is_bpe) {}
+    : is_bpe_(is_bpe), labels_(std::move(labels)) {
+  if (is_bpe_) {
+    bpe_pieces_.reserve(labels_.size());
+    std::transform(labels_.cbegin(), labels_.cend(),
+                   std::back_inserter(bpe_pieces_), split_bpe_label);
+  }
+}
 
 AlphabetPtr Alphabet::build_alphabet(const Labels &labels) {
   const auto is_bpe = check_if_bpe(labels);
   // TODO verify alphabet
   if (is_bpe) {
-    throw std::runtime_error("Normalizing bpe alphabet not implemented\n");
+    return std::make_shared<Alphabet>(
+        Alphabet(normalize_bpe_alphabet(labels), is_bpe));
   } else {
     return std::make_shared<Alphabet>(
         Alphabet(normalize_regular_alphabet(labels), is_bpe));
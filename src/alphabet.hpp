@@ -6,18 +6,32 @@
 
 namespace pyctcdecode {
 using Labels = std::vector<std::string>;
+
+// A bpe label split once into its text and the word markers around it
+struct BpePiece {
+  std::string text;
+  // label starts with the marker, the piece opens a new word
+  bool starts_word;
+  // label ends with the marker, the next piece opens a new word
+  bool ends_word;
+};
+using BpePieces = std::vector<BpePiece>;
+
 class Alphabet;
 using AlphabetPtr = std::shared_ptr<const Alphabet>;
 class Alphabet {
 private:
   bool is_bpe_;
   Labels labels_;
+  // one per label of a bpe alphabet, empty otherwise
+  BpePieces bpe_pieces_;
   Alphabet(Labels labels, bool is_bpe);
 
 public:
   Alphabet() = default;
   bool is_bpe() const { return is_bpe_; }
   Labels labels() const { return labels_; }
+  const BpePieces &bpe_pieces() const { return bpe_pieces_; }
   static AlphabetPtr build_alphabet(const Labels &);
   std::string dumps() {
     throw std::runtime_error("Alphabet::dumps not implemented");
@@ -0,0 +1,168 @@
+#include "async_decoder.hpp"
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+namespace {
+using Promise = std::promise<std::vector<pyctcdecode::OutputBeam>>;
+
+pyctcdecode::AsyncDecoder::Callback
+promise_callback(const std::shared_ptr<Promise> &promise) {
+  return [promise](std::vector<pyctcdecode::OutputBeam> &&output_beams,
+                   std::exception_ptr error) {
+    if (error) {
+      promise->set_exception(error);
+    } else {
+      promise->set_value(std::move(output_beams));
+    }
+  };
+}
+} // namespace
+
+namespace pyctcdecode {
+
+AsyncDecoder::AsyncDecoder(const BeamSearchDecoderCTC &decoder,
+                           size_t num_workers, size_t queue_capacity,
+                           int beam_width, float beam_prune_logp,
+                           float token_min_logp, bool prune_history,
+                           const std::unordered_set<std::string> &hotwords,
+                           float hotword_weight)
+    : decoder_(decoder), beam_width_(beam_width),
+      beam_prune_logp_(beam_prune_logp), token_min_logp_(token_min_logp),
+      prune_history_(prune_history),
+      hotword_scorer_(HotWordScorer::build_scorer(hotwords, hotword_weight)),
+      capacity_(std::max<size_t>(1, queue_capacity)), stop_(false),
+      stats_{0, 0, 0, 0, 0, 0.0, 0.0} {
+  if (num_workers == 0) {
+    num_workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (size_t i = 0; i < num_workers; i++) {
+    workers_.emplace_back([this]() { worker_loop(); });
+  }
+}
+
+AsyncDecoder::~AsyncDecoder() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  not_empty_cv_.notify_all();
+  not_full_cv_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+std::future<std::vector<OutputBeam>>
+AsyncDecoder::submit(Eigen::MatrixXf logits) {
+  auto promise = std::make_shared<Promise>();
+  auto future = promise->get_future();
+  enqueue(std::move(logits), promise_callback(promise), true);
+  return future;
+}
+
+void AsyncDecoder::submit(Eigen::MatrixXf logits, Callback callback) {
+  enqueue(std::move(logits), std::move(callback), true);
+}
+
+std::optional<std::future<std::vector<OutputBeam>>>
+AsyncDecoder::try_submit(Eigen::MatrixXf logits) {
+  auto promise = std::make_shared<Promise>();
+  auto future = promise->get_future();
+  if (!enqueue(std::move(logits), promise_callback(promise), false)) {
+    return std::nullopt;
+  }
+  return future;
+}
+
+bool AsyncDecoder::try_submit(Eigen::MatrixXf logits, Callback callback) {
+  return enqueue(std::move(logits), std::move(callback), false);
+}
+
+size_t AsyncDecoder::queue_depth() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queue_.size();
+}
+
+AsyncDecoderStats AsyncDecoder::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto stats = stats_;
+  stats.queue_depth = queue_.size();
+  return stats;
+}
+
+bool AsyncDecoder::enqueue(Eigen::MatrixXf &&logits, Callback &&callback,
+                           bool wait) {
+  // malformed input is reported to the caller rather than the callback
+  decoder_.check_logits_dimension(logits);
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (wait) {
+    not_full_cv_.wait(
+        lock, [this]() { return stop_ || queue_.size() < capacity_; });
+  }
+  if (stop_) {
+    throw std::runtime_error("AsyncDecoder is shutting down");
+  }
+  if (queue_.size() >= capacity_) {
+    stats_.rejected++;
+    return false;
+  }
+  queue_.push_back(Request{std::move(logits), std::move(callback),
+                           std::chrono::steady_clock::now()});
+  stats_.submitted++;
+  stats_.max_queue_depth = std::max(stats_.max_queue_depth, queue_.size());
+  lock.unlock();
+  not_empty_cv_.notify_one();
+  return true;
+}
+
+void AsyncDecoder::worker_loop() {
+  DecodeContext ctx{beam_width_, beam_prune_logp_, token_min_logp_,
+                    prune_history_, hotword_scorer_};
+  while (true) {
+    Request request;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_empty_cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      request = std::move(queue_.front());
+      queue_.pop_front();
+      const std::chrono::duration<double, std::milli> wait_time =
+          std::chrono::steady_clock::now() - request.enqueued;
+      stats_.total_wait_ms += wait_time.count();
+      stats_.max_wait_ms = std::max(stats_.max_wait_ms, wait_time.count());
+    }
+    not_full_cv_.notify_one();
+
+    std::vector<OutputBeam> output_beams;
+    std::exception_ptr error;
+    try {
+      // the context is reused so its scratch buffers survive across requests
+      ctx.processed_frames = 0;
+      const auto logits = logits_view(request.logits);
+      output_beams =
+          decoder_.decode_logits(logits, ctx, decoder_.logits_scale(logits));
+    } catch (...) {
+      error = std::current_exception();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats_.completed++;
+    }
+    try {
+      request.callback(std::move(output_beams), error);
+    } catch (...) {
+      // a throwing callback must not take the worker down
+    }
+  }
+}
+
+} // namespace pyctcdecode
@@ -0,0 +1,94 @@
+#pragma once
+#include "Eigen/Eigen"
+#include "constants.hpp"
+#include "decoder.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace pyctcdecode {
+
+struct AsyncDecoderStats {
+  size_t queue_depth;
+  size_t max_queue_depth;
+  size_t submitted;
+  size_t rejected;
+  size_t completed;
+  // time requests spent queued before a worker picked them up
+  double total_wait_ms;
+  double max_wait_ms;
+};
+
+// Non-blocking front end for an event loop. Requests go through a bounded
+// queue to a fixed set of worker threads. submit() blocks while the queue is
+// full, try_submit() refuses the request instead so the caller can shed load.
+// All requests share the search parameters and hotwords given here.
+class AsyncDecoder {
+public:
+  using Callback = std::function<void(std::vector<OutputBeam> &&output_beams,
+                                      std::exception_ptr error)>;
+
+private:
+  struct Request {
+    Eigen::MatrixXf logits;
+    Callback callback;
+    std::chrono::steady_clock::time_point enqueued;
+  };
+
+  const BeamSearchDecoderCTC &decoder_;
+  const int beam_width_;
+  const float beam_prune_logp_;
+  const float token_min_logp_;
+  const bool prune_history_;
+  const HotWordScorerPtr hotword_scorer_;
+  const size_t capacity_;
+
+  std::vector<std::thread> workers_;
+  mutable std::mutex mutex_;
+  std::condition_variable not_empty_cv_;
+  std::condition_variable not_full_cv_;
+  std::deque<Request> queue_;
+  bool stop_;
+  AsyncDecoderStats stats_;
+
+  bool enqueue(Eigen::MatrixXf &&logits, Callback &&callback, bool wait);
+  void worker_loop();
+
+public:
+  AsyncDecoder(const BeamSearchDecoderCTC &decoder, size_t num_workers = 0,
+               size_t queue_capacity = DEFAULT_ASYNC_QUEUE_CAPACITY,
+               int beam_width = DEFAULT_BEAM_WIDTH,
+               float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+               float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+               bool prune_history = DEFAULT_PRUNE_BEAMS,
+               const std::unordered_set<std::string> &hotwords = {},
+               float hotword_weight = DEFAULT_HOTWORD_WEIGHT);
+  // Finishes the queued requests before joining the workers
+  ~AsyncDecoder();
+  AsyncDecoder(const AsyncDecoder &) = delete;
+  AsyncDecoder &operator=(const AsyncDecoder &) = delete;
+
+  std::future<std::vector<OutputBeam>> submit(Eigen::MatrixXf logits);
+  // callback runs on a worker thread and must not block for long
+  void submit(Eigen::MatrixXf logits, Callback callback);
+  // nullopt / false when the queue is full
+  std::optional<std::future<std::vector<OutputBeam>>>
+  try_submit(Eigen::MatrixXf logits);
+  bool try_submit(Eigen::MatrixXf logits, Callback callback);
+
+  size_t num_workers() const { return workers_.size(); }
+  size_t queue_depth() const;
+  AsyncDecoderStats stats() const;
+};
+
+} // namespace pyctcdecode
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 #include <math.h>
 #include <regex>
 #include <string>
@@ -15,6 +16,14 @@ const float DEFAULT_HOTWORD_WEIGHT = 10.0;
 const float DEFAULT_PRUNE_LOGP = -10.0;
 const bool DEFAULT_PRUNE_BEAMS = false;
 const float DEFAULT_MIN_TOKEN_LOGP = -5.0;
+const int DEFAULT_ENDPOINT_BLANK_FRAMES = 0;
+const float DEFAULT_ENDPOINT_BLANK_LOGP = -0.05;
+const int DEFAULT_LONG_FORM_WINDOW_FRAMES = 3000;
+const int DEFAULT_LONG_FORM_OVERLAP_FRAMES = 250;
+const size_t DEFAULT_ASYNC_QUEUE_CAPACITY = 64;
+const int DEFAULT_ADAPTIVE_MIN_BEAM_WIDTH = 4;
+const float DEFAULT_ADAPTIVE_MIN_ENTROPY = 0.05;
+const float DEFAULT_ADAPTIVE_MAX_ENTROPY = 1.5;
 
 const int AVG_TOKEN_LEN = 6;
 const float MIN_TOKEN_CLIP_P = 1e-15;
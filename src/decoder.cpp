@@ -1,24 +1,30 @@
 #include "decoder.hpp"
 #include "alphabet.hpp"
 #include "constants.hpp"
+#include "kernels.hpp"
 #include "language_model.hpp"
 #include <__algorithm/remove_if.h>
 #include <algorithm>
+#include <array>
 #include <boost/algorithm/string.hpp>
 #include <boost/functional/hash.hpp>
 #include <complex>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <iterator>
 #include <limits>
+#include <mutex>
+#include <numeric>
 #include <optional>
 #include <ostream>
-#include <queue>
 #include <sstream>
 #include <string>
 #include <tuple>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -29,10 +35,12 @@ struct beam_prefix {
   std::string text;
   std::string partial_word;
   std::optional<std::string> last_char;
+  bool piece_ends_word;
 
   bool operator==(const beam_prefix &other) const {
     return text == other.text && partial_word == other.partial_word &&
-           last_char == other.last_char;
+           last_char == other.last_char &&
+           piece_ends_word == other.piece_ends_word;
   }
 };
 
@@ -54,16 +62,84 @@ struct beam_history_prefix {
   }
 };
 
-std::vector<pyctcdecode::LMBeam>
-sort_and_trim_beams(std::vector<pyctcdecode::LMBeam> &beams, int beam_width) {
-  std::vector<pyctcdecode::LMBeam> rv;
-  std::priority_queue beam_pq(beams.begin(), beams.end());
-  for (auto i = 0; i < std::min((size_t)beam_width, beams.size()); i++) {
-    auto top = beam_pq.top();
-    rv.push_back(top);
-    beam_pq.pop();
+// score bins between the lowest surviving score and the best one
+const int PRUNE_HISTOGRAM_BINS = 64;
+
+// Drop beams more than beam_prune_logp below the best one and keep at most
+// max_active of the rest, best first. Decoding passes the context's
+// beam_width as max_active. Like Kaldi's histogram pruning the
+// cutoff for the top max_active is read off a histogram of the scores in
+// linear time, so only the beams in the bin holding the cutoff need an exact
+// selection and beams are moved once instead of all going through a heap.
+void prune_beams(std::vector<pyctcdecode::LMBeam> &beams, float beam_prune_logp,
+                 int max_active) {
+  if (beams.empty()) {
+    return;
   }
-  return rv;
+  auto max_score = -std::numeric_limits<float>::infinity();
+  for (const auto &beam : beams) {
+    max_score = std::max(max_score, beam.lm_score_);
+  }
+  const auto n_active = static_cast<size_t>(std::max(max_active, 0));
+  // no histogram over scores that are all -inf, the bins would be NaN
+  if (!std::isfinite(max_score)) {
+    if (beams.size() > n_active) {
+      beams.erase(beams.begin() + n_active, beams.end());
+    }
+    return;
+  }
+  const auto cutoff = max_score + beam_prune_logp;
+  size_t n_above = 0;
+  auto min_score = max_score;
+  for (const auto &beam : beams) {
+    if (beam.lm_score_ >= cutoff) {
+      n_above++;
+      min_score = std::min(min_score, beam.lm_score_);
+    }
+  }
+  auto bin_width = (max_score - min_score) / PRUNE_HISTOGRAM_BINS;
+  if (!(bin_width > 0.0 && std::isfinite(bin_width))) {
+    bin_width = std::numeric_limits<float>::infinity();
+  }
+  const auto bin = [max_score, bin_width](float score) {
+    return std::min(static_cast<int>((max_score - score) / bin_width),
+                    PRUNE_HISTOGRAM_BINS - 1);
+  };
+  // worst bin kept, the best bins holding at least max_active beams
+  auto last_bin = PRUNE_HISTOGRAM_BINS - 1;
+  if (n_above > n_active && std::isfinite(bin_width)) {
+    std::array<size_t, PRUNE_HISTOGRAM_BINS> counts{};
+    for (const auto &beam : beams) {
+      if (beam.lm_score_ >= cutoff) {
+        counts[bin(beam.lm_score_)]++;
+      }
+    }
+    size_t n_kept = 0;
+    for (last_bin = 0; last_bin < PRUNE_HISTOGRAM_BINS - 1; last_bin++) {
+      n_kept += counts[last_bin];
+      if (n_kept >= n_active) {
+        break;
+      }
+    }
+  }
+  beams.erase(std::remove_if(beams.begin(), beams.end(),
+                             [cutoff, last_bin,
+                              &bin](const pyctcdecode::LMBeam &beam) {
+                               return beam.lm_score_ < cutoff ||
+                                      bin(beam.lm_score_) > last_bin;
+                             }),
+              beams.end());
+  const auto by_score = [](const pyctcdecode::LMBeam &left,
+                           const pyctcdecode::LMBeam &right) {
+    return left.lm_score_ > right.lm_score_;
+  };
+  // hard cap, the bin holding the cutoff can overshoot max_active
+  if (beams.size() > n_active) {
+    std::nth_element(beams.begin(), beams.begin() + n_active, beams.end(),
+                     by_score);
+    beams.erase(beams.begin() + n_active, beams.end());
+  }
+  std::sort(beams.begin(), beams.end(), by_score);
 }
 
 std::string normalize_whitespace(const std::string &text) {
@@ -75,17 +151,12 @@ std::string normalize_whitespace(const std::string &text) {
 } // namespace
 
 namespace std {
-template <> struct std::hash<pyctcdecode::LMScoreCacheKey> {
-  std::size_t operator()(const pyctcdecode::LMScoreCacheKey &key) const {
-    return std::hash<string>()(key.first) ^ std::hash<bool>()(key.second);
-  }
-};
-
 template <> struct std::hash<beam_prefix> {
   size_t operator()(const beam_prefix &key) const {
     return std::hash<string>()(key.text) ^
            std::hash<string>()(key.partial_word) ^
-           std::hash<std::optional<string>>()(key.last_char);
+           std::hash<std::optional<string>>()(key.last_char) ^
+           std::hash<bool>()(key.piece_ends_word);
   }
 };
 
@@ -115,14 +186,30 @@ std::string merge_token(const std::string &token_1,
 }
 
 float sum_log_scores(float s1, float s2) {
-  if (s1 >= s2) {
-    return s1 + log(1 + exp(s2 - s1));
+  if (s2 == -std::numeric_limits<float>::infinity()) {
+    return s1;
   }
-  return s2 + log(1 + exp(s1 - s2));
+  return pyctcdecode::log_add(s1, s2);
 }
 
 const pyctcdecode::Frames NULL_FRAMES{-1, -1};
 
+// whether the partial word of beam may end under the lexicon, an empty word
+// between two breaks included
+bool ends_word(const pyctcdecode::Lexicon &lexicon,
+               const pyctcdecode::Beam &beam) {
+  return beam.partial_word_.empty() || lexicon.is_word(beam.lexicon_node_);
+}
+
+// grammar state once the partial word of beam ends, NO_STATE when its state
+// has no arc for it
+pyctcdecode::Grammar::State end_word(const pyctcdecode::Grammar &grammar,
+                                     const pyctcdecode::Beam &beam) {
+  return beam.partial_word_.empty()
+             ? beam.grammar_state_
+             : grammar.next_state(beam.grammar_state_, beam.grammar_node_);
+}
+
 std::vector<pyctcdecode::Beam>
 merge_beams(const std::vector<pyctcdecode::Beam> &beams) {
   using BeamPrefixDict = std::unordered_map<beam_prefix, pyctcdecode::Beam>;
@@ -130,7 +217,8 @@ merge_beams(const std::vector<pyctcdecode::Beam> &beams) {
   BeamPrefixDict beam_dict;
   for (const auto &beam : beams) {
     const auto new_text = merge_token(beam.text_, beam.next_word_);
-    const beam_prefix hash_idx{new_text, beam.partial_word_, beam.last_char_};
+    const beam_prefix hash_idx{new_text, beam.partial_word_, beam.last_char_,
+                               beam.piece_ends_word_};
     // NB: if does not exist, insert beam
     // if exists, modify score
     // it is pointer to the inserted element or element that prevents inserting
@@ -149,6 +237,39 @@ merge_beams(const std::vector<pyctcdecode::Beam> &beams) {
   return rv;
 }
 
+// Prefix search counterpart of merge_beams: the blank and token ending log
+// probs of a prefix are summed separately, the frames of its most likely
+// path are kept
+void merge_prefixes(std::vector<pyctcdecode::Beam> &beams) {
+  std::unordered_map<beam_prefix, size_t> prefix_idx;
+  size_t n_prefixes = 0;
+  for (auto &beam : beams) {
+    const beam_prefix hash_idx{merge_token(beam.text_, beam.next_word_),
+                               beam.partial_word_, beam.last_char_,
+                               beam.piece_ends_word_};
+    const auto [it, inserted] = prefix_idx.emplace(hash_idx, n_prefixes);
+    if (inserted) {
+      if (&beams[n_prefixes] != &beam) {
+        beams[n_prefixes] = std::move(beam);
+      }
+      n_prefixes++;
+      continue;
+    }
+    auto &prefix = beams[it->second];
+    if (beam.logit_score_ > prefix.logit_score_) {
+      prefix.text_frames_ = std::move(beam.text_frames_);
+      prefix.partial_frames_ = beam.partial_frames_;
+    }
+    prefix.blank_logit_score_ =
+        sum_log_scores(prefix.blank_logit_score_, beam.blank_logit_score_);
+    prefix.token_logit_score_ =
+        sum_log_scores(prefix.token_logit_score_, beam.token_logit_score_);
+    prefix.logit_score_ =
+        sum_log_scores(prefix.blank_logit_score_, prefix.token_logit_score_);
+  }
+  beams.erase(beams.begin() + n_prefixes, beams.end());
+}
+
 std::vector<pyctcdecode::Beam>
 do_prune_history(const std::vector<pyctcdecode::LMBeam> &beams, int lm_order) {
   const auto min_n_history = std::max(1, lm_order - 1);
@@ -157,7 +278,9 @@ do_prune_history(const std::vector<pyctcdecode::LMBeam> &beams, int lm_order) {
   for (const auto &beam : beams) {
     std::vector<std::string> split_text;
     boost::split(split_text, beam.text_, boost::is_any_of(" "));
-    split_text.erase(split_text.end() - min_n_history, split_text.end());
+    split_text.erase(split_text.end() -
+                         std::min((size_t)min_n_history, split_text.size()),
+                     split_text.end());
     const beam_history_prefix hash_idx{split_text, beam.partial_word_,
                                        beam.last_char_};
     const auto [it, inserted] = seen_hashes.insert(hash_idx);
@@ -168,78 +291,513 @@ do_prune_history(const std::vector<pyctcdecode::LMBeam> &beams, int lm_order) {
   return filtered_beams;
 }
 
-const pyctcdecode::Beam EMPTY_START_BEAM{"", "",          "", std::nullopt,
-                                         {}, NULL_FRAMES, 0.0};
+const pyctcdecode::Beam EMPTY_START_BEAM{
+    "",  "", "", std::nullopt, {}, NULL_FRAMES, 0.0, 0.0,
+    -std::numeric_limits<float>::infinity()};
+
+// below this much work per frame the thread team costs more than it saves
+const size_t MIN_PARALLEL_WORK = 64;
+
+// Split [0, n) in at most one contiguous range per pool thread and call
+// fn(partition, begin, end) for each, inline when there is no pool.
+void for_each_partition(
+    pyctcdecode::ThreadPool *pool, size_t n,
+    const std::function<void(size_t, size_t, size_t)> &fn) {
+  if (pool == nullptr || n <= 1) {
+    fn(0, 0, n);
+    return;
+  }
+  const auto n_parts = std::min(pool->size(), n);
+  pool->parallel_for(n_parts, [&fn, n, n_parts](size_t part) {
+    fn(part, part * n / n_parts, (part + 1) * n / n_parts);
+  });
+}
+
+// sum(exp(frame - shift)), contiguous frames go through the dispatched kernel
+template <typename Frame>
+float frame_sum_exp(const pyctcdecode::Kernels &kernels, const Frame &frame,
+                    float shift) {
+  if constexpr (Frame::InnerStrideAtCompileTime == 1) {
+    return kernels.sum_exp(frame.data(), frame.size(), shift);
+  } else {
+    return (frame.array() - shift).exp().sum();
+  }
+}
+
+// Clipped log probs of one frame, the per-frame counterpart of
+// normalize_logits so a full matrix of log probs is never materialized
+template <typename Frame>
+void normalize_frame(const pyctcdecode::Kernels &kernels, const Frame &frame,
+                     pyctcdecode::LogitsScale scale, Eigen::RowVectorXf &out) {
+  switch (scale) {
+  case pyctcdecode::LogitsScale::LOG_PROBS:
+    out = frame;
+    break;
+  case pyctcdecode::LogitsScale::PROBS:
+    out = frame.cwiseMin(1)
+              .cwiseMax(pyctcdecode::MIN_TOKEN_CLIP_P)
+              .array()
+              .log();
+    break;
+  case pyctcdecode::LogitsScale::LOGITS:
+    out.resize(frame.size());
+    if constexpr (Frame::InnerStrideAtCompileTime == 1) {
+      kernels.log_softmax(frame.data(), frame.size(), out.data());
+    } else {
+      out = (frame.array() - frame.maxCoeff()).matrix();
+      out.array() -= std::log(frame_sum_exp(kernels, out, 0.0));
+    }
+    out = out.cwiseMin(0).cwiseMax(std::log(pyctcdecode::MIN_TOKEN_CLIP_P));
+    break;
+  }
+}
+
+// smallest log prob that clears token_min_logp once clipped to
+// [log(MIN_TOKEN_CLIP_P), 0]
+float candidate_logp_threshold(float token_min_logp) {
+  if (token_min_logp > 0.0) {
+    return std::numeric_limits<float>::infinity();
+  }
+  if (token_min_logp > std::log(pyctcdecode::MIN_TOKEN_CLIP_P)) {
+    return token_min_logp;
+  }
+  return -std::numeric_limits<float>::infinity();
+}
+
+// Posterior entropy of a frame in nats over its clipped log probs, offset is
+// the log-sum-exp of unnormalized logits
+template <typename Frame>
+float frame_entropy(const Frame &frame, pyctcdecode::LogitsScale scale,
+                    float offset) {
+  if (scale == pyctcdecode::LogitsScale::PROBS) {
+    const auto probs =
+        frame.array().max(pyctcdecode::MIN_TOKEN_CLIP_P).min(1.0f);
+    return -(probs * probs.log()).sum();
+  }
+  const auto log_probs = (frame.array() - offset)
+                             .max(std::log(pyctcdecode::MIN_TOKEN_CLIP_P))
+                             .min(0.0f);
+  return -(log_probs.exp() * log_probs).sum();
+}
+
+// Fused per-frame kernel: finds the tokens worth expanding and their clipped
+// log probs straight from the raw frame. The threshold is moved into the
+// input domain, so the frame is read by a max pass, a log-sum-exp pass and
+// one thresholding pass and the normalized frame is never written out.
+// Contiguous frames run all three passes through the dispatched kernels, the
+// thresholding one writes token ids to tokens.
+// Candidates are emitted in token order and always include the best token.
+// entropy, when given, receives frame_entropy at the cost of one more pass.
+template <typename Frame>
+void frame_candidates(const pyctcdecode::Kernels &kernels, const Frame &frame,
+                      pyctcdecode::LogitsScale scale, float token_min_logp,
+                      std::vector<pyctcdecode::TokenCandidate> &candidates,
+                      std::vector<uint32_t> &tokens, float *entropy = nullptr) {
+  constexpr bool contiguous = Frame::InnerStrideAtCompileTime == 1;
+  const auto min_logp = std::log(pyctcdecode::MIN_TOKEN_CLIP_P);
+  Eigen::Index max_idx;
+  float max_value;
+  if constexpr (contiguous) {
+    max_idx = kernels.argmax(frame.data(), frame.size());
+    max_value = frame[max_idx];
+  } else {
+    max_value = frame.maxCoeff(&max_idx);
+  }
+  // maps a raw value to its clipped log prob
+  float offset = 0.0;
+  if (scale == pyctcdecode::LogitsScale::LOGITS) {
+    offset = max_value + std::log(frame_sum_exp(kernels, frame, max_value));
+  }
+  const auto to_logp = [scale, offset, min_logp](float value) {
+    if (scale == pyctcdecode::LogitsScale::PROBS) {
+      return std::log(std::min(
+          std::max(value, pyctcdecode::MIN_TOKEN_CLIP_P), 1.0f));
+    }
+    return std::min(std::max(value - offset, min_logp), 0.0f);
+  };
+  // smallest raw value that clears token_min_logp after clipping
+  const auto logp_threshold = candidate_logp_threshold(token_min_logp);
+  const auto threshold = scale == pyctcdecode::LogitsScale::PROBS
+                             ? std::exp(logp_threshold)
+                             : logp_threshold + offset;
+  candidates.clear();
+  if constexpr (contiguous) {
+    tokens.resize(std::max<size_t>(tokens.size(), frame.size()));
+    const auto n_selected = kernels.select_above(frame.data(), frame.size(),
+                                                 threshold, tokens.data());
+    auto has_max = false;
+    for (size_t k = 0; k < n_selected; k++) {
+      const Eigen::Index i = tokens[k];
+      if (!has_max && i >= max_idx) {
+        if (i != max_idx) {
+          candidates.emplace_back(max_idx, to_logp(max_value));
+        }
+        has_max = true;
+      }
+      candidates.emplace_back(i, to_logp(frame[i]));
+    }
+    if (!has_max) {
+      candidates.emplace_back(max_idx, to_logp(max_value));
+    }
+  } else {
+    for (Eigen::Index i = 0; i < frame.size(); i++) {
+      const auto value = frame[i];
+      if (value >= threshold || i == max_idx) {
+        candidates.emplace_back(i, to_logp(value));
+      }
+    }
+  }
+  if (entropy != nullptr) {
+    *entropy = frame_entropy(frame, scale, offset);
+  }
+}
+
+// Candidates of one sparse frame, the counterpart of frame_candidates for
+// inputs that only store the tokens worth considering
+void sparse_frame_candidates(
+    const Eigen::Ref<const pyctcdecode::SparseLogProbs> &log_probs,
+    Eigen::Index t, float token_min_logp,
+    std::vector<pyctcdecode::TokenCandidate> &candidates,
+    float *entropy = nullptr) {
+  using InnerIterator =
+      Eigen::Ref<const pyctcdecode::SparseLogProbs>::InnerIterator;
+  const auto min_logp = std::log(pyctcdecode::MIN_TOKEN_CLIP_P);
+  Eigen::Index max_idx = -1;
+  auto max_value = -std::numeric_limits<float>::infinity();
+  for (InnerIterator it(log_probs, t); it; ++it) {
+    if (max_idx < 0 || it.value() > max_value) {
+      max_idx = it.col();
+      max_value = it.value();
+    }
+  }
+  if (max_idx < 0) {
+    std::stringstream ss;
+    ss << "Sparse log probs keep no token in frame " << t;
+    throw std::runtime_error(ss.str());
+  }
+  const auto threshold = candidate_logp_threshold(token_min_logp);
+  candidates.clear();
+  float frame_entropy = 0.0;
+  for (InnerIterator it(log_probs, t); it; ++it) {
+    const auto logp = std::min(std::max(it.value(), min_logp), 0.0f);
+    if (it.value() >= threshold || it.col() == max_idx) {
+      candidates.emplace_back(it.col(), logp);
+    }
+    // tokens left out have no mass
+    frame_entropy -= std::exp(logp) * logp;
+  }
+  if (entropy != nullptr) {
+    *entropy = frame_entropy;
+  }
+}
+
+// Beams to keep after a frame with the given entropy
+int adaptive_beam_width(const pyctcdecode::AdaptiveBeam &adaptive_beam,
+                        int beam_width, float entropy) {
+  const auto min_width = std::min(adaptive_beam.min_beam_width, beam_width);
+  const auto weight =
+      std::min(std::max((entropy - adaptive_beam.min_entropy) /
+                            (adaptive_beam.max_entropy -
+                             adaptive_beam.min_entropy),
+                        0.0f),
+               1.0f);
+  return min_width +
+         static_cast<int>(std::lround(weight * (beam_width - min_width)));
+}
+
+// Widen frame t of a reduced precision input into out. Contiguous fp16 and
+// bf16 frames go through the conversion kernels, which use F16C or avx512f
+// when the cpu has them.
+template <typename Scalar>
+void widen_frame(const pyctcdecode::Kernels &kernels,
+                 const pyctcdecode::LogitsViewT<Scalar> &logits,
+                 Eigen::Index t, Eigen::RowVectorXf &out) {
+  const auto n = logits.cols();
+  out.resize(n);
+  if (logits.outerStride() != 1) {
+    out = logits.row(t).template cast<float>();
+    return;
+  }
+  const Scalar *frame = logits.data() + t * logits.innerStride();
+  if constexpr (std::is_same_v<Scalar, Eigen::half> ||
+                std::is_same_v<Scalar, Eigen::bfloat16>) {
+    static_assert(sizeof(Scalar) == sizeof(uint16_t));
+    const auto *bits = reinterpret_cast<const uint16_t *>(frame);
+    if constexpr (std::is_same_v<Scalar, Eigen::half>) {
+      kernels.half_to_float(bits, n, out.data());
+    } else {
+      kernels.bfloat16_to_float(bits, n, out.data());
+    }
+  } else {
+    for (Eigen::Index i = 0; i < n; i++) {
+      out[i] = static_cast<float>(frame[i]);
+    }
+  }
+}
+
+// Probabilities sum to one per frame up to the rounding of the input type,
+// anything else is treated as unnormalized logits
+template <typename Scalar>
+pyctcdecode::LogitsScale
+input_scale(const pyctcdecode::Kernels &kernels,
+            const pyctcdecode::LogitsViewT<Scalar> &logits) {
+  // mean row sum, summed along whichever dimension is contiguous
+  double total = 0.0;
+  if constexpr (!std::is_same_v<Scalar, float>) {
+    Eigen::RowVectorXf frame;
+    for (Eigen::Index t = 0; t < logits.rows(); t++) {
+      widen_frame(kernels, logits, t, frame);
+      total += frame.cast<double>().sum();
+    }
+  } else if (logits.outerStride() == 1) {
+    for (Eigen::Index t = 0; t < logits.rows(); t++) {
+      total += Eigen::Map<const Eigen::RowVectorXf>(
+                   logits.data() + t * logits.innerStride(), logits.cols())
+                   .cast<double>()
+                   .sum();
+    }
+  } else {
+    total = logits.template cast<double>().sum();
+  }
+  const auto epsilon =
+      static_cast<double>(Eigen::NumTraits<Scalar>::epsilon());
+  return std::abs(total / logits.rows() - 1.0) < epsilon
+             ? pyctcdecode::LogitsScale::PROBS
+             : pyctcdecode::LogitsScale::LOGITS;
+}
+
+// frames per block when a strided input is copied into frame-contiguous
+// scratch, bounds the copy while keeping the transpose cache friendly
+const Eigen::Index CONVERT_BLOCK_FRAMES = 256;
+const Eigen::Index CONVERT_TILE_TOKENS = 16;
+
+// Copy n frames from start into frame-contiguous out, a few tokens at a time
+// so the reads walk a handful of columns and every written line is filled.
+void copy_frames(const pyctcdecode::LogitsView &logits, Eigen::Index start,
+                 Eigen::Index n, pyctcdecode::RowMajorMatrixXf &out) {
+  out.resize(n, logits.cols());
+  for (Eigen::Index v = 0; v < logits.cols(); v += CONVERT_TILE_TOKENS) {
+    const auto width = std::min(CONVERT_TILE_TOKENS, logits.cols() - v);
+    out.middleCols(v, width) = logits.block(start, v, n, width);
+  }
+}
+
+// Best token of one frame and its clipped log prob. The max is a vectorized
+// reduction and the token is the first one holding it, so ties resolve like
+// maxCoeff(&idx) without its branchy index tracking.
+template <typename Frame>
+pyctcdecode::TokenCandidate best_token(const pyctcdecode::Kernels &kernels,
+                                       const Frame &frame,
+                                       pyctcdecode::LogitsScale scale) {
+  const Eigen::Index max_idx = kernels.argmax(frame.data(), frame.size());
+  const auto max_value = frame[max_idx];
+  switch (scale) {
+  case pyctcdecode::LogitsScale::PROBS:
+    return {max_idx, std::log(std::min(
+                         std::max(max_value, pyctcdecode::MIN_TOKEN_CLIP_P),
+                         1.0f))};
+  case pyctcdecode::LogitsScale::LOGITS:
+    return {max_idx,
+            std::max(-std::log(frame_sum_exp(kernels, frame, max_value)),
+                     std::log(pyctcdecode::MIN_TOKEN_CLIP_P))};
+  default:
+    return {max_idx,
+            std::min(std::max(max_value,
+                              std::log(pyctcdecode::MIN_TOKEN_CLIP_P)),
+                     0.0f)};
+  }
+}
+
+// Collapses a best path into words, one token per frame. Follows the
+// transitions of expand_beam for a single hypothesis without building beams.
+class BestPath {
+private:
+  // empty unless the alphabet is bpe
+  const pyctcdecode::BpePieces &bpe_pieces_;
+  bool piece_ends_word_ = false;
+  std::vector<std::string> words_;
+  std::vector<pyctcdecode::Frames> word_frames_;
+  std::string partial_word_;
+  pyctcdecode::Frames partial_frames_ = NULL_FRAMES;
+  std::optional<std::string> last_char_;
+  float logit_score_ = 0.0;
+
+  void close_word() {
+    if (!partial_word_.empty()) {
+      words_.push_back(std::move(partial_word_));
+      word_frames_.push_back(partial_frames_);
+    }
+    partial_word_.clear();
+  }
+
+public:
+  explicit BestPath(const pyctcdecode::BpePieces &bpe_pieces)
+      : bpe_pieces_(bpe_pieces) {}
+
+  void push(size_t idx, const std::string &chr, float p_char, int frame_idx) {
+    const auto is_bpe = !bpe_pieces_.empty();
+    logit_score_ += p_char;
+    if (chr == "" || last_char_ == chr) {
+      if (chr != "") {
+        partial_frames_.second = frame_idx + 1;
+      }
+    } else if (is_bpe &&
+               (bpe_pieces_[idx].starts_word || piece_ends_word_)) {
+      piece_ends_word_ = bpe_pieces_[idx].ends_word;
+      close_word();
+      partial_word_ = bpe_pieces_[idx].text;
+      partial_frames_ = std::make_pair(frame_idx, frame_idx + 1);
+    } else if (!is_bpe && chr == " ") {
+      close_word();
+      partial_frames_ = NULL_FRAMES;
+    } else {
+      if (partial_frames_.first < 0) {
+        partial_frames_.first = frame_idx;
+      }
+      partial_frames_.second = frame_idx + 1;
+      if (is_bpe) {
+        piece_ends_word_ = bpe_pieces_[idx].ends_word;
+        partial_word_ += bpe_pieces_[idx].text;
+      } else {
+        partial_word_ += chr;
+      }
+    }
+    last_char_ = chr;
+  }
+
+  pyctcdecode::OutputBeam finish() {
+    close_word();
+    std::vector<pyctcdecode::WordFrames> text_frames;
+    text_frames.reserve(words_.size());
+    for (size_t i = 0; i < words_.size(); i++) {
+      text_frames.emplace_back(words_[i], word_frames_[i]);
+    }
+    return pyctcdecode::OutputBeam{boost::algorithm::join(words_, " "),
+                                   std::nullopt, text_frames, logit_score_,
+                                   logit_score_};
+  }
+};
+
+// blank log probs this close to the best one count as equally good cuts
+const float STITCH_BLANK_LOGP_MARGIN = 1.0;
+
+// Frame to cut two overlapping window hypotheses at: a frame in [begin, end)
+// that neither hypothesis spends on a word and where blank is most likely,
+// preferring the centre of the overlap where both windows have context.
+int find_stitch_frame(const std::vector<pyctcdecode::WordFrames> &left,
+                      const std::vector<pyctcdecode::WordFrames> &right,
+                      int begin, int end,
+                      const std::function<float(int)> &blank_logp) {
+  std::vector<bool> is_word(end - begin, false);
+  for (const auto *words : {&left, &right}) {
+    for (const auto &[word, frames] : *words) {
+      for (auto f = std::max(frames.first, begin);
+           f < std::min(frames.second, end); f++) {
+        is_word.at(f - begin) = true;
+      }
+    }
+  }
+  auto best_logp = -std::numeric_limits<float>::infinity();
+  for (auto f = begin; f < end; f++) {
+    if (!is_word.at(f - begin)) {
+      best_logp = std::max(best_logp, blank_logp(f));
+    }
+  }
+  const auto centre = begin + (end - begin) / 2;
+  auto cut = centre;
+  auto cut_dist = std::numeric_limits<int>::max();
+  for (auto f = begin; f < end; f++) {
+    if (!is_word.at(f - begin) &&
+        blank_logp(f) >= best_logp - STITCH_BLANK_LOGP_MARGIN &&
+        std::abs(f - centre) < cut_dist) {
+      cut = f;
+      cut_dist = std::abs(f - centre);
+    }
+  }
+  return cut;
+}
 } // namespace
 
 namespace pyctcdecode {
 
 Beam Beam::from_lm_beam(const LMBeam &lmbeam) {
-  return Beam{lmbeam.text_,       lmbeam.next_word_,   lmbeam.partial_word_,
-              lmbeam.last_char_,  lmbeam.text_frames_, lmbeam.partial_frames_,
-              lmbeam.logit_score_};
+  return Beam{lmbeam.text_,        lmbeam.next_word_,
+              lmbeam.partial_word_, lmbeam.last_char_,
+              lmbeam.text_frames_,  lmbeam.partial_frames_,
+              lmbeam.logit_score_,  lmbeam.blank_logit_score_,
+              lmbeam.token_logit_score_, lmbeam.grammar_state_,
+              lmbeam.lexicon_node_, lmbeam.grammar_node_,
+              lmbeam.piece_ends_word_};
 }
 
 template <>
 void EMatrixLogSoftmax<1>(const EigenMatrix &input, EigenMatrix &output) {
-  EigenArray wMinusMax = input.colwise() - input.rowwise().maxCoeff();
-  output = wMinusMax.colwise() - wMinusMax.exp().rowwise().sum().log();
+  RowMajorMatrixXf rows = input;
+  for (Eigen::Index r = 0; r < rows.rows(); r++) {
+    simd_kernels().log_softmax(rows.row(r).data(), rows.cols(),
+                               rows.row(r).data());
+  }
+  output = rows;
 }
 
 template <>
 void EMatrixLogSoftmax<0>(const EigenMatrix &input, EigenMatrix &output) {
-  EigenArray wMinusMax = input.rowwise() - input.colwise().maxCoeff();
-  output = wMinusMax.rowwise() - wMinusMax.exp().colwise().sum().log();
+  output.resize(input.rows(), input.cols());
+  for (Eigen::Index c = 0; c < input.cols(); c++) {
+    simd_kernels().log_softmax(input.col(c).data(), input.rows(),
+                               output.col(c).data());
+  }
 }
 
 void Beam::say_hello() const { printf("text [%s]\n", text_.c_str()); }
 
 Beam from_lm_beam(const LMBeam &lmbeam) {
-  return Beam{lmbeam.text_,       lmbeam.next_word_,   lmbeam.partial_word_,
-              lmbeam.last_char_,  lmbeam.text_frames_, lmbeam.partial_frames_,
-              lmbeam.logit_score_};
+  return Beam{lmbeam.text_,        lmbeam.next_word_,
+              lmbeam.partial_word_, lmbeam.last_char_,
+              lmbeam.text_frames_,  lmbeam.partial_frames_,
+              lmbeam.logit_score_,  lmbeam.blank_logit_score_,
+              lmbeam.token_logit_score_, lmbeam.grammar_state_,
+              lmbeam.lexicon_node_, lmbeam.grammar_node_,
+              lmbeam.piece_ends_word_};
 }
 
 BeamSearchDecoderCTC::BeamSearchDecoderCTC(
     AlphabetPtr alphabet,
-    std::optional<AbstractLanguageModelPtr> language_model)
-    : alphabet_(std::move(alphabet)), is_bpe_(alphabet_->is_bpe()),
-      model_key_(rand()) {
+    std::optional<AbstractLanguageModelPtr> language_model,
+    std::optional<SimdLevel> simd_level)
+    : language_model_(language_model.value_or(nullptr)),
+      alphabet_(std::move(alphabet)), is_bpe_(alphabet_->is_bpe()),
+      kernels_(simd_level.has_value() ? &simd_kernels(simd_level.value())
+                                      : &simd_kernels()) {
   for (auto idx = 0; idx < alphabet_->labels().size(); idx++) {
     idx2vocab_[idx] = alphabet_->labels().at(idx);
   }
-  if (language_model.has_value()) {
-    model_container_[model_key_] = language_model.value();
-  }
 }
-std::vector<OutputBeam> BeamSearchDecoderCTC::decode_logits(
-    const Eigen::MatrixXf &logits, int beam_width, float beam_prune_logp,
-    float token_min_logp, bool prune_history, HotWordScorerPtr hotword_scorer,
-    std::optional<AbstractLMStatePtr> lm_start_state) {
-  const auto language_model_it = model_container_.find(model_key_);
-  LMScoreCache cached_lm_scores;
-  if (language_model_it != model_container_.end()) {
-    AbstractLMStatePtr start_state =
-        lm_start_state.has_value()
-            ? lm_start_state.value()
-            : language_model_it->second->get_start_state();
-    cached_lm_scores.insert(
+
+void BeamSearchDecoderCTC::init_decode_state(
+    DecodeContext &ctx,
+    std::optional<AbstractLMStatePtr> lm_start_state) const {
+  ctx.cached_lm_scores.clear();
+  ctx.cached_p_lm_scores.clear();
+  if (language_model_) {
+    AbstractLMStatePtr start_state = lm_start_state.has_value()
+                                         ? lm_start_state.value()
+                                         : language_model_->get_start_state();
+    ctx.cached_lm_scores.insert(
         std::make_pair(std::make_pair(std::string(""), false),
                        std::make_tuple(0.0, 0.0, start_state)));
   }
-  std::unordered_map<std::string, float> cached_p_lm_scores;
-  std::vector<Beam> beams{EMPTY_START_BEAM};
-  beams = partial_decode_logits(logits, beams, beam_width, beam_prune_logp,
-                                token_min_logp, prune_history, hotword_scorer,
-                                cached_lm_scores, cached_p_lm_scores);
-  // printf("after decode logit\n");
-  // for (const auto &b : beams) {
-  //   std::cout << "beam: " << b << std::endl;
-  // }
-  const std::vector<LMBeam> trimmed_beams =
-      finalize_beams(beams, beam_width, beam_prune_logp, hotword_scorer,
-                     cached_lm_scores, cached_p_lm_scores, true, true);
-  // printf("after finalize beams\n");
+  ctx.beams = {EMPTY_START_BEAM};
+  ctx.active_beams = 0;
+}
+
+int BeamSearchDecoderCTC::lm_order() const {
+  return language_model_ ? language_model_->order() : 1;
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::get_output_beams(
+    const std::vector<LMBeam> &trimmed_beams,
+    const LMScoreCache &cached_lm_scores) const {
   std::vector<OutputBeam> output_beams;
   std::transform(
       trimmed_beams.cbegin(), trimmed_beams.cend(),
@@ -269,262 +827,947 @@ std::vector<OutputBeam> BeamSearchDecoderCTC::decode_logits(
   return output_beams;
 }
 
-std::vector<LMBeam> BeamSearchDecoderCTC::get_lm_beam(
-    const std::vector<Beam> &beams, const HotWordScorerPtr hotword_scorer,
-    LMScoreCache &cached_lm_scores,
-    std::unordered_map<std::string, float> &cached_partial_token_scores,
-    bool is_eos) const {
-  const auto language_model_it = model_container_.find(model_key_);
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_logits(
+    const LogitsView &logits, DecodeContext &ctx, LogitsScale scale,
+    std::optional<AbstractLMStatePtr> lm_start_state) const {
+  init_decode_state(ctx, lm_start_state);
+  if (logits.outerStride() == 1 || logits.rows() <= 1) {
+    partial_decode_logits(logits, ctx, scale);
+  } else {
+    // each frame of a strided input is converted exactly once, a block at a
+    // time, so the search only ever walks contiguous frames
+    for (Eigen::Index start = 0; start < logits.rows();
+         start += CONVERT_BLOCK_FRAMES) {
+      copy_frames(logits, start,
+                  std::min(CONVERT_BLOCK_FRAMES, logits.rows() - start),
+                  ctx.log_probs);
+      partial_decode_logits(logits_view(ctx.log_probs), ctx, scale);
+    }
+  }
+  // printf("after decode logit\n");
+  // for (const auto &b : ctx.beams) {
+  //   std::cout << "beam: " << b << std::endl;
+  // }
+  const std::vector<LMBeam> trimmed_beams = finalize_beams(ctx, true, true);
+  // printf("after finalize beams\n");
+  return get_output_beams(trimmed_beams, ctx.cached_lm_scores);
+}
+
+// Reduced precision input: every frame is widened into a float row that stays
+// in cache for the fused candidate kernel, the input is never converted as a
+// whole. frame_scales, when given, scales each widened frame.
+template <typename Scalar>
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_widened(
+    const LogitsViewT<Scalar> &logits, const float *frame_scales,
+    DecodeContext &ctx, LogitsScale scale,
+    std::optional<AbstractLMStatePtr> lm_start_state) const {
+  init_decode_state(ctx, lm_start_state);
+  for (Eigen::Index t = 0; t < logits.rows(); t++) {
+    widen_frame(*kernels_, logits, t, ctx.frame);
+    if (frame_scales != nullptr) {
+      ctx.frame *= frame_scales[t];
+    }
+    frame_candidates(*kernels_, ctx.frame, scale, ctx.token_min_logp,
+                     ctx.candidates, ctx.candidate_tokens,
+                     ctx.adaptive_beam ? &ctx.frame_entropy : nullptr);
+    decode_candidates(ctx);
+  }
+  const std::vector<LMBeam> trimmed_beams = finalize_beams(ctx, true, true);
+  return get_output_beams(trimmed_beams, ctx.cached_lm_scores);
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_sparse(
+    const Eigen::Ref<const SparseLogProbs> &log_probs, DecodeContext &ctx,
+    std::optional<AbstractLMStatePtr> lm_start_state) const {
+  check_logits_dimension(log_probs);
+  init_decode_state(ctx, lm_start_state);
+  for (Eigen::Index t = 0; t < log_probs.rows(); t++) {
+    sparse_frame_candidates(log_probs, t, ctx.token_min_logp, ctx.candidates,
+                            ctx.adaptive_beam ? &ctx.frame_entropy : nullptr);
+    decode_candidates(ctx);
+  }
+  const std::vector<LMBeam> trimmed_beams = finalize_beams(ctx, true, true);
+  return get_output_beams(trimmed_beams, ctx.cached_lm_scores);
+}
+
+std::vector<LMBeam>
+BeamSearchDecoderCTC::get_lm_beam(const std::vector<Beam> &beams,
+                                  DecodeContext &ctx, bool is_eos) const {
+  const auto &hotword_scorer = ctx.hotword_scorer;
+  auto &cached_lm_scores = ctx.cached_lm_scores;
+  auto &cached_partial_token_scores = ctx.cached_p_lm_scores;
   std::vector<LMBeam> new_beams;
-  if (language_model_it == model_container_.end()) {
+  if (!language_model_) {
     for (const auto &beam : beams) {
       const auto new_text = merge_token(beam.text_, beam.next_word_);
       const auto lm_hw_score =
           beam.logit_score_ + hotword_scorer->score(new_text) +
           hotword_scorer->score_partial_token(beam.partial_word_);
       new_beams.emplace_back(LMBeam{
-          new_text, "", beam.partial_word_, beam.last_char_, beam.text_frames_,
-          beam.partial_frames_, beam.logit_score_, lm_hw_score});
+          {new_text, "", beam.partial_word_, beam.last_char_,
+           beam.text_frames_, beam.partial_frames_, beam.logit_score_,
+           beam.blank_logit_score_, beam.token_logit_score_,
+           beam.grammar_state_, beam.lexicon_node_, beam.grammar_node_,
+           beam.piece_ends_word_},
+          lm_hw_score});
     }
     return new_beams;
   }
-  for (const auto &beam : beams) {
-    const auto new_text = merge_token(beam.text_, beam.next_word_);
-    const auto cache_key = std::make_pair(new_text, is_eos);
-    float lm_score;
-    if (cached_lm_scores.find(cache_key) == cached_lm_scores.end()) {
-      //
-      auto [_, prev_raw_lm_score, start_state] =
-          cached_lm_scores[std::make_pair(beam.text_, false)];
-      const auto [score, end_state] = language_model_it->second->score(
-          start_state, beam.next_word_, is_eos);
-      // printf("text [%s] next words [%s] score [%f]\n", beam.text_.c_str(),
-      //  beam.next_word_.c_str(), score);
-      const auto raw_lm_score = prev_raw_lm_score + score;
-      const auto lm_hw_score = raw_lm_score + hotword_scorer->score(new_text);
-      lm_score = lm_hw_score;
-      cached_lm_scores[cache_key] =
-          std::make_tuple(lm_hw_score, raw_lm_score, end_state);
+  // score the words and partial words missing from the caches first, those
+  // are independent of each other and split across the thread team
+  std::vector<size_t> missing_beams;
+  std::unordered_set<LMScoreCacheKey> missing_keys;
+  std::vector<std::string> missing_parts;
+  for (size_t i = 0; i < beams.size(); i++) {
+    const auto &beam = beams.at(i);
+    auto cache_key =
+        std::make_pair(merge_token(beam.text_, beam.next_word_), is_eos);
+    if (cached_lm_scores.count(cache_key) == 0 &&
+        missing_keys.insert(std::move(cache_key)).second) {
+      missing_beams.push_back(i);
     }
     const auto &word_part = beam.partial_word_;
-    if (!word_part.empty()) {
-      if (cached_partial_token_scores.count(word_part) == 0) {
-        if (hotword_scorer->contains(word_part)) {
-          cached_partial_token_scores[word_part] =
-              hotword_scorer->score_partial_token(word_part);
-        } else {
-          cached_partial_token_scores[word_part] =
-              language_model_it->second->score_partial_token(word_part);
+    if (!word_part.empty() &&
+        cached_partial_token_scores.count(word_part) == 0) {
+      // NB: placeholder keeps missing_parts unique
+      cached_partial_token_scores[word_part] = 0.0;
+      missing_parts.push_back(word_part);
+    }
+  }
+  std::vector<LMScoreCacheValue> missing_scores(missing_beams.size());
+  std::vector<float> missing_part_scores(missing_parts.size());
+  const auto n_missing = missing_beams.size() + missing_parts.size();
+  for_each_partition(
+      n_missing >= MIN_PARALLEL_WORK ? ctx.thread_pool.get() : nullptr,
+      n_missing,
+      [&](size_t, size_t begin, size_t end) {
+        for (auto k = begin; k < end; k++) {
+          if (k >= missing_beams.size()) {
+            const auto &word_part = missing_parts.at(k - missing_beams.size());
+            missing_part_scores.at(k - missing_beams.size()) =
+                hotword_scorer->contains(word_part)
+                    ? hotword_scorer->score_partial_token(word_part)
+                    : language_model_->score_partial_token(word_part);
+            continue;
+          }
+          const auto &beam = beams.at(missing_beams.at(k));
+          const auto new_text = merge_token(beam.text_, beam.next_word_);
+          const auto prev_it =
+              cached_lm_scores.find(std::make_pair(beam.text_, false));
+          auto [_, prev_raw_lm_score, start_state] =
+              prev_it != cached_lm_scores.end() ? prev_it->second
+                                                : LMScoreCacheValue();
+          const auto [score, end_state] =
+              language_model_->score(start_state, beam.next_word_, is_eos);
+          // printf("text [%s] next words [%s] score [%f]\n",
+          // beam.text_.c_str(), beam.next_word_.c_str(), score);
+          const auto raw_lm_score = prev_raw_lm_score + score;
+          const auto lm_hw_score =
+              raw_lm_score + hotword_scorer->score(new_text);
+          missing_scores.at(k) =
+              std::make_tuple(lm_hw_score, raw_lm_score, end_state);
         }
+      });
+  for (size_t k = 0; k < missing_beams.size(); k++) {
+    const auto &beam = beams.at(missing_beams.at(k));
+    cached_lm_scores[std::make_pair(merge_token(beam.text_, beam.next_word_),
+                                    is_eos)] = std::move(missing_scores.at(k));
+  }
+  for (size_t k = 0; k < missing_parts.size(); k++) {
+    cached_partial_token_scores[missing_parts.at(k)] =
+        missing_part_scores.at(k);
+  }
+
+  for (const auto &beam : beams) {
+    const auto new_text = merge_token(beam.text_, beam.next_word_);
+    const auto lm_score =
+        std::get<0>(cached_lm_scores.at(std::make_pair(new_text, is_eos)));
+    const auto &word_part = beam.partial_word_;
+    new_beams.emplace_back(
+        LMBeam{{new_text, "", word_part, beam.last_char_, beam.text_frames_,
+                beam.partial_frames_, beam.logit_score_,
+                beam.blank_logit_score_, beam.token_logit_score_,
+                beam.grammar_state_, beam.lexicon_node_, beam.grammar_node_,
+                beam.piece_ends_word_},
+               beam.logit_score_ + lm_score});
+  }
+  return new_beams;
+}
+
+void BeamSearchDecoderCTC::expand_beam(const Beam &beam, size_t idx_char,
+                                       const std::string &chr, float p_char,
+                                       int frame_idx, const DecodeContext &ctx,
+                                       std::vector<Beam> &new_beams) const {
+  const auto no_score = -std::numeric_limits<float>::infinity();
+  // if only blank token or same token
+  if (chr == "" || beam.last_char_ == chr) {
+    int new_end_frame;
+    if (chr == "") {
+      new_end_frame = beam.partial_frames_.first;
+    } else {
+      new_end_frame = frame_idx + 1;
+    }
+    const auto new_part_frames =
+        chr == ""
+            ? beam.partial_frames_
+            : std::make_pair(beam.partial_frames_.first, new_end_frame);
+    new_beams.push_back(Beam{beam.text_, beam.next_word_, beam.partial_word_,
+                             chr, beam.text_frames_, new_part_frames,
+                             beam.logit_score_ + p_char, no_score, no_score,
+                             beam.grammar_state_, beam.lexicon_node_,
+                             beam.grammar_node_, beam.piece_ends_word_});
+  }
+  else {
+    extend_beam(beam, idx_char, chr, beam.logit_score_ + p_char, frame_idx,
+                ctx, new_beams);
+  }
+}
+
+// Append the non-blank token chr to the prefix of beam, score is the log prob
+// of the extended prefix. With a lexicon or grammar nothing is appended when a
+// finished word is not allowed or the new partial word cannot start one.
+void BeamSearchDecoderCTC::extend_beam(const Beam &beam, size_t idx_char,
+                                       const std::string &chr, float score,
+                                       int frame_idx, const DecodeContext &ctx,
+                                       std::vector<Beam> &new_beams) const {
+  const auto blank_score = -std::numeric_limits<float>::infinity();
+  const auto *lexicon = ctx.lexicon.get();
+  const auto *grammar = ctx.grammar.get();
+  auto grammar_state = beam.grammar_state_;
+  // if bpe and leading space char
+  if (is_bpe_ && (alphabet_->bpe_pieces()[idx_char].starts_word ||
+                  beam.piece_ends_word_)) {
+    const auto &piece = alphabet_->bpe_pieces()[idx_char];
+    const auto &clean_char = piece.text;
+    auto lexicon_node = Lexicon::ROOT;
+    if (lexicon != nullptr) {
+      lexicon_node = lexicon->step(Lexicon::ROOT, clean_char);
+      if (!ends_word(*lexicon, beam) || lexicon_node == Lexicon::NO_NODE) {
+        return;
       }
     }
-    new_beams.emplace_back(LMBeam{
-        new_text, "", word_part, beam.last_char_, beam.text_frames_,
-        beam.partial_frames_, beam.logit_score_, beam.logit_score_ + lm_score});
+    auto grammar_node = Lexicon::ROOT;
+    if (grammar != nullptr) {
+      grammar_state = end_word(*grammar, beam);
+      if (grammar_state == Grammar::NO_STATE) {
+        return;
+      }
+      grammar_node =
+          grammar->words(grammar_state).step(Lexicon::ROOT, clean_char);
+      if (grammar_node == Lexicon::NO_NODE) {
+        return;
+      }
+    }
+    const auto new_frame_list =
+        beam.partial_word_ == "" ? beam.text_frames_ : [&beam]() {
+          std::vector<Frames> new_text_frame = beam.text_frames_;
+          new_text_frame.push_back(beam.partial_frames_);
+          return new_text_frame;
+        }();
+    new_beams.push_back(Beam{beam.text_, beam.partial_word_, clean_char,
+                             chr, new_frame_list,
+                             std::make_pair(frame_idx, frame_idx + 1), score,
+                             blank_score, score, grammar_state, lexicon_node,
+                             grammar_node, piece.ends_word});
+  }
+  // if not bpe and space char
+  else if (!is_bpe_ && chr == " ") {
+    if (lexicon != nullptr && !ends_word(*lexicon, beam)) {
+      return;
+    }
+    if (grammar != nullptr) {
+      grammar_state = end_word(*grammar, beam);
+      if (grammar_state == Grammar::NO_STATE) {
+        return;
+      }
+    }
+    const auto new_frame_list =
+        beam.partial_word_ == "" ? beam.text_frames_ : [&beam]() {
+          std::vector<Frames> new_text_frame = beam.text_frames_;
+          new_text_frame.push_back(beam.partial_frames_);
+          return new_text_frame;
+        }();
+    new_beams.push_back(Beam{beam.text_, beam.partial_word_, "", chr,
+                             new_frame_list, NULL_FRAMES, score, blank_score,
+                             score, grammar_state});
+  }
+  // general update of continuing token without space
+  else {
+    // a bpe piece may still close the word it continues
+    const auto &text = is_bpe_ ? alphabet_->bpe_pieces()[idx_char].text : chr;
+    const auto piece_ends_word =
+        is_bpe_ && alphabet_->bpe_pieces()[idx_char].ends_word;
+    auto lexicon_node = Lexicon::ROOT;
+    if (lexicon != nullptr) {
+      lexicon_node = lexicon->step(beam.lexicon_node_, text);
+      if (lexicon_node == Lexicon::NO_NODE) {
+        return;
+      }
+    }
+    auto grammar_node = Lexicon::ROOT;
+    if (grammar != nullptr) {
+      grammar_node =
+          grammar->words(grammar_state).step(beam.grammar_node_, text);
+      if (grammar_node == Lexicon::NO_NODE) {
+        return;
+      }
+    }
+    const auto new_part_frames =
+        (beam.partial_frames_.first < 0)
+            ? (std::make_pair(frame_idx, frame_idx + 1))
+            : (std::make_pair(beam.partial_frames_.first, frame_idx + 1));
+    new_beams.push_back(Beam{beam.text_, beam.next_word_,
+                             beam.partial_word_ + text, chr, beam.text_frames_,
+                             new_part_frames, score, blank_score, score,
+                             grammar_state, lexicon_node, grammar_node,
+                             piece_ends_word});
   }
-  return new_beams;
 }
 
-std::vector<Beam> BeamSearchDecoderCTC::partial_decode_logits(
-    const Eigen::MatrixXf &logits, std::vector<Beam> &beams, int beam_width,
-    float beam_prune_logp, float token_min_logp, bool prune_history,
-    const HotWordScorerPtr hotword_scorer, LMScoreCache &cached_lm_scores,
-    std::unordered_map<std::string, float> &cached_p_lm_scores,
-    int processed_frames) const {
-  auto force_next_break = false;
-  std::unordered_set<size_t> idx_list;
-  // printf("partial decode logit ");
-  // for (const auto &bm : beams) {
-  //   std::cout << bm;
-  // }
-  for (auto frame_idx = processed_frames;
-       frame_idx - processed_frames < logits.rows(); frame_idx++) {
-    const auto col_idx = frame_idx - processed_frames;
-    const auto &logit_col = logits.row(col_idx);
-    unsigned int max_idx;
-    logit_col.maxCoeff(&max_idx);
-    idx_list.clear();
-    idx_list.insert(max_idx);
-    // std::for_each(logit_col.begin(), logit_col.end(),
-    //               [&idx_list, &token_min_logp](const float &item) {
-    //                 if (item >= token_min_logp) {
-    //                   idx_list.insert(item);
-    //                 }
-    //               });
-    for (auto i = 0; i < logit_col.size(); i++) {
-      if (logit_col[i] >= token_min_logp) {
-        idx_list.insert(i);
+// Prefix search counterpart of expand_beam. A blank keeps the prefix and its
+// last token, a repeat of the last token collapses into the prefix when it
+// ended in that token and extends it when it ended in a blank.
+void BeamSearchDecoderCTC::expand_prefix(const Beam &beam, size_t idx_char,
+                                         const std::string &chr, float p_char,
+                                         int frame_idx,
+                                         const DecodeContext &ctx,
+                                         std::vector<Beam> &new_beams) const {
+  const auto no_score = -std::numeric_limits<float>::infinity();
+  if (chr == "") {
+    const auto score = beam.logit_score_ + p_char;
+    new_beams.push_back(Beam{beam.text_, beam.next_word_, beam.partial_word_,
+                             beam.last_char_, beam.text_frames_,
+                             beam.partial_frames_, score, score, no_score,
+                             beam.grammar_state_, beam.lexicon_node_,
+                             beam.grammar_node_, beam.piece_ends_word_});
+  } else if (beam.last_char_ == chr) {
+    if (beam.token_logit_score_ > no_score) {
+      const auto score = beam.token_logit_score_ + p_char;
+      new_beams.push_back(Beam{
+          beam.text_, beam.next_word_, beam.partial_word_, chr,
+          beam.text_frames_,
+          std::make_pair(beam.partial_frames_.first, frame_idx + 1), score,
+          no_score, score, beam.grammar_state_, beam.lexicon_node_,
+          beam.grammar_node_, beam.piece_ends_word_});
+    }
+    if (beam.blank_logit_score_ > no_score) {
+      extend_beam(beam, idx_char, chr, beam.blank_logit_score_ + p_char,
+                  frame_idx, ctx, new_beams);
+    }
+  } else {
+    extend_beam(beam, idx_char, chr, beam.logit_score_ + p_char, frame_idx,
+                ctx, new_beams);
+  }
+}
+
+void BeamSearchDecoderCTC::partial_decode_logits(const LogitsView &logits,
+                                                 DecodeContext &ctx,
+                                                 LogitsScale scale) const {
+  auto *entropy = ctx.adaptive_beam ? &ctx.frame_entropy : nullptr;
+  for (Eigen::Index t = 0; t < logits.rows(); t++) {
+    if (logits.outerStride() == 1) {
+      // a plain map hands the contiguous frame to the dispatched kernels
+      frame_candidates(
+          *kernels_,
+          Eigen::Map<const Eigen::RowVectorXf>(
+              logits.data() + t * logits.innerStride(), logits.cols()),
+          scale, ctx.token_min_logp, ctx.candidates, ctx.candidate_tokens,
+          entropy);
+    } else {
+      frame_candidates(*kernels_, logits.row(t), scale, ctx.token_min_logp,
+                       ctx.candidates, ctx.candidate_tokens, entropy);
+    }
+    decode_candidates(ctx);
+  }
+}
+
+// Advance the beams by one frame over the tokens in ctx.candidates
+void BeamSearchDecoderCTC::decode_candidates(DecodeContext &ctx) const {
+  auto &beams = ctx.beams;
+  const auto frame_idx = ctx.processed_frames;
+  const auto beam_width =
+      ctx.adaptive_beam ? adaptive_beam_width(*ctx.adaptive_beam,
+                                              ctx.beam_width, ctx.frame_entropy)
+                        : ctx.beam_width;
+  const auto beam_prune_logp = ctx.beam_prune_logp;
+  const auto &candidates = ctx.candidates;
+  auto &new_beams = ctx.new_beams;
+  new_beams.clear();
+  const auto expand = ctx.prefix_search ? &BeamSearchDecoderCTC::expand_prefix
+                                        : &BeamSearchDecoderCTC::expand_beam;
+  if (ctx.thread_pool && beams.size() > 1 &&
+      beams.size() * candidates.size() >= MIN_PARALLEL_WORK) {
+    // each partition expands a contiguous range of beams, concatenating
+    // the results char-major keeps the serial order
+    auto &partition_beams = ctx.partition_beams;
+    partition_beams.resize(ctx.thread_pool->size());
+    for (auto &char_beams : partition_beams) {
+      char_beams.resize(candidates.size());
+    }
+    for_each_partition(
+        ctx.thread_pool.get(), beams.size(),
+        [&](size_t part, size_t begin, size_t end) {
+          for (size_t c = 0; c < candidates.size(); c++) {
+            auto &out = partition_beams.at(part).at(c);
+            out.clear();
+            const auto &[idx_char, p_char] = candidates.at(c);
+            const auto &chr = idx2vocab_.at(idx_char);
+            for (auto b = begin; b < end; b++) {
+              (this->*expand)(beams.at(b), idx_char, chr, p_char, frame_idx,
+                              ctx, out);
+            }
+          }
+        });
+    for (size_t c = 0; c < candidates.size(); c++) {
+      for (auto &char_beams : partition_beams) {
+        auto &out = char_beams.at(c);
+        std::move(out.begin(), out.end(), std::back_inserter(new_beams));
+        out.clear();
       }
     }
-    std::stringstream ss;
-    for (const auto &x : idx_list) {
-      ss << x << " ";
-    }
-    // printf("idx list [%s] max idx [%d]\n", ss.str().c_str(), (int)max_idx);
-    std::vector<Beam> new_beams;
-    for (const auto &idx_char : idx_list) {
-      const auto p_char = logit_col[idx_char];
-      const auto chr = idx2vocab_.at(idx_char);
+  } else {
+    for (const auto &[idx_char, p_char] : candidates) {
+      const auto &chr = idx2vocab_.at(idx_char);
       for (const auto &beam : beams) {
-        // if only blank token or same token
-        if (chr == "" || beam.last_char_ == chr) {
-          int new_end_frame;
-          if (chr == "") {
-            new_end_frame = beam.partial_frames_.first;
-          } else {
-            new_end_frame = frame_idx + 1;
-          }
-          const auto new_part_frames =
-              chr == ""
-                  ? beam.partial_frames_
-                  : std::make_pair(beam.partial_frames_.first, new_end_frame);
-          new_beams.push_back(Beam{
-              beam.text_, beam.next_word_, beam.partial_word_, chr,
-              beam.text_frames_, new_part_frames, beam.logit_score_ + p_char});
-        }
-        // if bpe and leading space char
-        else if (is_bpe_ && (chr.find(BPE_TOKEN) != std::string::npos ||
-                             force_next_break)) {
-          force_next_break = false;
-          auto clean_char = chr;
-          const auto bpe_tok_pos = chr.find(BPE_TOKEN);
-          if (bpe_tok_pos != std::string::npos && bpe_tok_pos == 0) {
-            clean_char.erase(0);
-          }
-          if (bpe_tok_pos != std::string::npos &&
-              bpe_tok_pos == chr.size() - 1) {
-            clean_char.erase(clean_char.size() - 1);
-            force_next_break = true;
-          }
-          const auto new_frame_list =
-              beam.partial_word_ == "" ? beam.text_frames_ : [&beam]() {
-                std::vector<Frames> new_text_frame = beam.text_frames_;
-                new_text_frame.push_back(beam.partial_frames_);
-                return new_text_frame;
-              }();
-          new_beams.push_back(Beam{beam.text_, beam.partial_word_, clean_char,
-                                   chr, new_frame_list,
-                                   std::make_pair(frame_idx, frame_idx + 1),
-                                   beam.logit_score_ + p_char});
-        }
-        // if not bpe and space char
-        else if (!is_bpe_ && chr == " ") {
-          const auto new_frame_list =
-              beam.partial_word_ == "" ? beam.text_frames_ : [&beam]() {
-                std::vector<Frames> new_text_frame = beam.text_frames_;
-                new_text_frame.push_back(beam.partial_frames_);
-                return new_text_frame;
-              }();
-          new_beams.push_back(Beam{beam.text_, beam.partial_word_, "", chr,
-                                   new_frame_list, NULL_FRAMES,
-                                   beam.logit_score_ + p_char});
-        }
-        // general update of continuing token without space
-        else {
-          const auto new_part_frames =
-              (beam.partial_frames_.first < 0)
-                  ? (std::make_pair(frame_idx, frame_idx + 1))
-                  : (std::make_pair(beam.partial_frames_.first, frame_idx + 1));
-          new_beams.push_back(Beam{
-              beam.text_, beam.next_word_, beam.partial_word_ + chr, chr,
-              beam.text_frames_, new_part_frames, beam.logit_score_ + p_char});
-        }
+        (this->*expand)(beam, idx_char, chr, p_char, frame_idx, ctx,
+                        new_beams);
       }
     }
-    // std::cout << "xxx new beams ";
-    // for (const auto &bm : new_beams) {
-    //   std::cout << bm;
-    // }
-    // lm scoring and beam pruning
-    new_beams = merge_beams(new_beams);
-    // std::cout << "xxx merge beam ";
-    // for (const auto &bm : new_beams) {
-    //   std::cout << bm;
-    // }
-    auto scored_beams = get_lm_beam(new_beams, hotword_scorer, cached_lm_scores,
-                                    cached_p_lm_scores);
-    // printf("xxx lm beams ");
-    // for (const auto &lmb : scored_beams) {
-    //   std::cout << lmb;
-    // }
-    // remove beam outliers
-    const auto max_score_it = std::max_element(
-        scored_beams.cbegin(), scored_beams.cend(),
-        [](const LMBeam &left, const LMBeam &right) {
-          return static_cast<const LMBeam *>(&left)->lm_score_ <
-                 static_cast<const LMBeam *>(&right)->lm_score_;
-        });
-    const auto max_score =
-        static_cast<const LMBeam *>(&*max_score_it)->lm_score_;
-    const auto score_thresh = max_score + beam_prune_logp;
-    scored_beams.erase(
-        std::remove_if(
-            scored_beams.begin(), scored_beams.end(),
-            [&score_thresh](const Beam &item) {
-              return (static_cast<const LMBeam *>(&item)->lm_score_) <
-                     score_thresh;
-            }),
-        scored_beams.end());
-    const auto trimmed_beams = sort_and_trim_beams(scored_beams, beam_width);
-    if (prune_history) {
-      const auto language_model_it = model_container_.find(model_key_);
-      const auto lm_order = language_model_it == model_container_.end()
-                                ? 1
-                                : language_model_it->second->order();
-      beams = do_prune_history(trimmed_beams, lm_order);
-    } else {
-      beams.clear();
-      std::transform(
-          trimmed_beams.begin(), trimmed_beams.end(), std::back_inserter(beams),
-          [](const auto &lmbeam) { return Beam::from_lm_beam(lmbeam); });
+  }
+  // a lexicon or grammar can mask every candidate of the frame, the beams
+  // then read it as a blank at the cost of its best candidate instead of dying
+  if (new_beams.empty() && !candidates.empty()) {
+    const auto best_p_char =
+        std::max_element(candidates.begin(), candidates.end(),
+                         [](const auto &a, const auto &b) {
+                           return a.second < b.second;
+                         })
+            ->second;
+    const std::string blank;
+    for (const auto &beam : beams) {
+      (this->*expand)(beam, 0, blank, best_p_char, frame_idx, ctx, new_beams);
     }
   }
-  return beams;
+  // std::cout << "xxx new beams ";
+  // for (const auto &bm : new_beams) {
+  //   std::cout << bm;
+  // }
+  // lm scoring and beam pruning
+  if (ctx.prefix_search) {
+    merge_prefixes(new_beams);
+  } else {
+    new_beams = merge_beams(new_beams);
+  }
+  // std::cout << "xxx merge beam ";
+  // for (const auto &bm : new_beams) {
+  //   std::cout << bm;
+  // }
+  auto scored_beams = get_lm_beam(new_beams, ctx);
+  // printf("xxx lm beams ");
+  // for (const auto &lmb : scored_beams) {
+  //   std::cout << lmb;
+  // }
+  // remove beam outliers
+  prune_beams(scored_beams, beam_prune_logp, beam_width);
+  const auto &trimmed_beams = scored_beams;
+  if (ctx.prune_history) {
+    beams = do_prune_history(trimmed_beams, lm_order());
+  } else {
+    beams.clear();
+    std::transform(
+        trimmed_beams.begin(), trimmed_beams.end(), std::back_inserter(beams),
+        [](const auto &lmbeam) { return Beam::from_lm_beam(lmbeam); });
+  }
+  ctx.active_beams += beams.size();
+  ctx.processed_frames++;
 }
 
 std::string BeamSearchDecoderCTC::decode(
     const Eigen::MatrixXf &logits, int beam_width, float beam_prune_logp,
     float token_min_logp, bool prune_history,
     const std::unordered_set<std::string> &hotwords, float hotword_weight,
-    std::optional<AbstractLMState> lm_start_state) {
-  auto logit_copy = logits;
+    std::optional<AbstractLMStatePtr> lm_start_state) const {
+  return decode(logits_view(logits), beam_width, beam_prune_logp,
+                token_min_logp, prune_history, hotwords, hotword_weight,
+                lm_start_state);
+}
+
+std::string BeamSearchDecoderCTC::decode(
+    const LogitsView &logits, int beam_width, float beam_prune_logp,
+    float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    std::optional<AbstractLMStatePtr> lm_start_state) const {
   const auto decoded_beams = this->decode_beams(
-      logit_copy, beam_width, beam_prune_logp, token_min_logp, true, hotwords,
+      logits, beam_width, beam_prune_logp, token_min_logp, true, hotwords,
       hotword_weight, lm_start_state);
   return decoded_beams.at(0).text_;
 }
 
 std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams(
-    Eigen::MatrixXf &logits, int beam_width, float beam_prune_logp,
+    const Eigen::MatrixXf &logits, int beam_width, float beam_prune_logp,
     float token_min_logp, bool prune_history,
     const std::unordered_set<std::string> &hotwords, float hotword_weight,
-    std::optional<AbstractLMState> lm_start_state) {
+    std::optional<AbstractLMStatePtr> lm_start_state,
+    size_t num_threads) const {
+  return decode_beams(logits_view(logits), beam_width, beam_prune_logp,
+                      token_min_logp, prune_history, hotwords, hotword_weight,
+                      lm_start_state, num_threads);
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams(
+    const LogitsView &logits, int beam_width, float beam_prune_logp,
+    float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    std::optional<AbstractLMStatePtr> lm_start_state,
+    size_t num_threads) const {
   check_logits_dimension(logits);
-  const auto hotword_scorer =
-      HotWordScorer::build_scorer(hotwords, hotword_weight);
+  DecodeContext ctx{beam_width, beam_prune_logp, token_min_logp, prune_history,
+                    HotWordScorer::build_scorer(hotwords, hotword_weight)};
+  if (num_threads > 1) {
+    ctx.thread_pool = get_thread_pool(num_threads);
+  }
   // std::cout << "input logits\n" << logits << std::endl;
   // printf("built hotword scorer\n");
-  if (std::abs((logits.rowwise().sum()).mean() - 1.0) <
-      std::numeric_limits<float>::epsilon()) {
-    logits = logits.cwiseMin(1).cwiseMax(MIN_TOKEN_CLIP_P).array().log();
+  return decode_logits(logits, ctx, logits_scale(logits), lm_start_state);
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams_prefix(
+    const Eigen::MatrixXf &logits, int beam_width, float beam_prune_logp,
+    float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    std::optional<AbstractLMStatePtr> lm_start_state,
+    size_t num_threads) const {
+  return decode_beams_prefix(logits_view(logits), beam_width, beam_prune_logp,
+                             token_min_logp, prune_history, hotwords,
+                             hotword_weight, lm_start_state, num_threads);
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams_prefix(
+    const LogitsView &logits, int beam_width, float beam_prune_logp,
+    float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    std::optional<AbstractLMStatePtr> lm_start_state,
+    size_t num_threads) const {
+  check_logits_dimension(logits);
+  DecodeContext ctx{beam_width, beam_prune_logp, token_min_logp, prune_history,
+                    HotWordScorer::build_scorer(hotwords, hotword_weight)};
+  ctx.prefix_search = true;
+  if (num_threads > 1) {
+    ctx.thread_pool = get_thread_pool(num_threads);
+  }
+  return decode_logits(logits, ctx, logits_scale(logits), lm_start_state);
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams_lexicon(
+    const Eigen::MatrixXf &logits, LexiconPtr lexicon, int beam_width,
+    float beam_prune_logp, float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    std::optional<AbstractLMStatePtr> lm_start_state,
+    size_t num_threads) const {
+  return decode_beams_lexicon(logits_view(logits), std::move(lexicon),
+                              beam_width, beam_prune_logp, token_min_logp,
+                              prune_history, hotwords, hotword_weight,
+                              lm_start_state, num_threads);
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams_lexicon(
+    const LogitsView &logits, LexiconPtr lexicon, int beam_width,
+    float beam_prune_logp, float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    std::optional<AbstractLMStatePtr> lm_start_state,
+    size_t num_threads) const {
+  check_logits_dimension(logits);
+  if (!lexicon) {
+    throw std::runtime_error("decode_beams_lexicon needs a lexicon");
+  }
+  DecodeContext ctx{beam_width, beam_prune_logp, token_min_logp, prune_history,
+                    HotWordScorer::build_scorer(hotwords, hotword_weight)};
+  ctx.lexicon = std::move(lexicon);
+  if (num_threads > 1) {
+    ctx.thread_pool = get_thread_pool(num_threads);
+  }
+  return decode_logits(logits, ctx, logits_scale(logits), lm_start_state);
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams_grammar(
+    const Eigen::MatrixXf &logits, GrammarPtr grammar, int beam_width,
+    float beam_prune_logp, float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    std::optional<AbstractLMStatePtr> lm_start_state,
+    size_t num_threads) const {
+  return decode_beams_grammar(logits_view(logits), std::move(grammar),
+                              beam_width, beam_prune_logp, token_min_logp,
+                              prune_history, hotwords, hotword_weight,
+                              lm_start_state, num_threads);
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams_grammar(
+    const LogitsView &logits, GrammarPtr grammar, int beam_width,
+    float beam_prune_logp, float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    std::optional<AbstractLMStatePtr> lm_start_state,
+    size_t num_threads) const {
+  check_logits_dimension(logits);
+  if (!grammar) {
+    throw std::runtime_error("decode_beams_grammar needs a grammar");
+  }
+  DecodeContext ctx{beam_width, beam_prune_logp, token_min_logp, prune_history,
+                    HotWordScorer::build_scorer(hotwords, hotword_weight)};
+  ctx.grammar = std::move(grammar);
+  if (num_threads > 1) {
+    ctx.thread_pool = get_thread_pool(num_threads);
+  }
+  return decode_logits(logits, ctx, logits_scale(logits), lm_start_state);
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams_adaptive(
+    const Eigen::MatrixXf &logits, const AdaptiveBeam &adaptive_beam,
+    int beam_width, float beam_prune_logp, float token_min_logp,
+    bool prune_history, const std::unordered_set<std::string> &hotwords,
+    float hotword_weight, std::optional<AbstractLMStatePtr> lm_start_state,
+    DecodeStats *stats) const {
+  return decode_beams_adaptive(logits_view(logits), adaptive_beam, beam_width,
+                               beam_prune_logp, token_min_logp, prune_history,
+                               hotwords, hotword_weight, lm_start_state, stats);
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams_adaptive(
+    const LogitsView &logits, const AdaptiveBeam &adaptive_beam,
+    int beam_width, float beam_prune_logp, float token_min_logp,
+    bool prune_history, const std::unordered_set<std::string> &hotwords,
+    float hotword_weight, std::optional<AbstractLMStatePtr> lm_start_state,
+    DecodeStats *stats) const {
+  check_logits_dimension(logits);
+  if (adaptive_beam.min_beam_width < 1 ||
+      !(adaptive_beam.max_entropy > adaptive_beam.min_entropy)) {
+    throw std::runtime_error(
+        "Adaptive beam needs min_beam_width >= 1 and max_entropy > "
+        "min_entropy");
+  }
+  DecodeContext ctx{beam_width, beam_prune_logp, token_min_logp, prune_history,
+                    HotWordScorer::build_scorer(hotwords, hotword_weight),
+                    adaptive_beam};
+  auto output_beams =
+      decode_logits(logits, ctx, logits_scale(logits), lm_start_state);
+  if (stats != nullptr) {
+    *stats = DecodeStats{ctx.processed_frames, ctx.active_beams};
+  }
+  return output_beams;
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams(
+    const HalfLogitsView &logits, int beam_width, float beam_prune_logp,
+    float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    std::optional<AbstractLMStatePtr> lm_start_state,
+    size_t num_threads) const {
+  check_logits_dimension(logits);
+  DecodeContext ctx{beam_width, beam_prune_logp, token_min_logp, prune_history,
+                    HotWordScorer::build_scorer(hotwords, hotword_weight)};
+  if (num_threads > 1) {
+    ctx.thread_pool = get_thread_pool(num_threads);
+  }
+  return decode_widened(logits, nullptr, ctx,
+                        input_scale(*kernels_, logits), lm_start_state);
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams(
+    const BFloat16LogitsView &logits, int beam_width, float beam_prune_logp,
+    float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    std::optional<AbstractLMStatePtr> lm_start_state,
+    size_t num_threads) const {
+  check_logits_dimension(logits);
+  DecodeContext ctx{beam_width, beam_prune_logp, token_min_logp, prune_history,
+                    HotWordScorer::build_scorer(hotwords, hotword_weight)};
+  if (num_threads > 1) {
+    ctx.thread_pool = get_thread_pool(num_threads);
+  }
+  return decode_widened(logits, nullptr, ctx,
+                        input_scale(*kernels_, logits), lm_start_state);
+}
+
+std::vector<OutputBeam> BeamSearchDecoderCTC::decode_beams(
+    const Int8LogitsView &log_probs,
+    const Eigen::Ref<const Eigen::VectorXf> &frame_scales, int beam_width,
+    float beam_prune_logp, float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    std::optional<AbstractLMStatePtr> lm_start_state,
+    size_t num_threads) const {
+  check_logits_dimension(log_probs);
+  if (frame_scales.size() != log_probs.rows()) {
+    std::stringstream ss;
+    ss << "Frame scales do not match the number of frames "
+       << frame_scales.size() << " vs " << log_probs.rows();
+    throw std::runtime_error(ss.str());
+  }
+  DecodeContext ctx{beam_width, beam_prune_logp, token_min_logp, prune_history,
+                    HotWordScorer::build_scorer(hotwords, hotword_weight)};
+  if (num_threads > 1) {
+    ctx.thread_pool = get_thread_pool(num_threads);
+  }
+  return decode_widened(log_probs, frame_scales.data(), ctx,
+                        LogitsScale::LOG_PROBS, lm_start_state);
+}
+
+OutputBeam
+BeamSearchDecoderCTC::decode_greedy(const Eigen::MatrixXf &logits) const {
+  return decode_greedy(logits_view(logits));
+}
+
+OutputBeam BeamSearchDecoderCTC::decode_greedy(const LogitsView &logits) const {
+  check_logits_dimension(logits);
+  const auto scale = logits_scale(logits);
+  BestPath path(alphabet_->bpe_pieces());
+  const auto push_frames = [this, scale, &path](const LogitsView &frames,
+                                               Eigen::Index start) {
+    for (Eigen::Index t = 0; t < frames.rows(); t++) {
+      const auto [idx, p_char] = best_token(
+          *kernels_,
+          Eigen::Map<const Eigen::RowVectorXf>(
+              frames.data() + t * frames.innerStride(), frames.cols()),
+          scale);
+      path.push(idx, idx2vocab_.at(idx), p_char, start + t);
+    }
+  };
+  if (logits.outerStride() == 1) {
+    push_frames(logits, 0);
   } else {
-    Eigen::MatrixXf temp;
-    EMatrixLogSoftmax<1>(logits, temp);
-    logits = temp.cwiseMin(0).cwiseMax(std::log(MIN_TOKEN_CLIP_P));
+    RowMajorMatrixXf block;
+    for (Eigen::Index start = 0; start < logits.rows();
+         start += CONVERT_BLOCK_FRAMES) {
+      copy_frames(logits, start,
+                  std::min(CONVERT_BLOCK_FRAMES, logits.rows() - start), block);
+      push_frames(logits_view(block), start);
+    }
+  }
+  return path.finish();
+}
+
+LogitsScale
+BeamSearchDecoderCTC::logits_scale(const LogitsView &logits) const {
+  return input_scale(*kernels_, logits);
+}
+
+void BeamSearchDecoderCTC::normalize_logits(RowMajorMatrixXf &logits) const {
+  const auto scale = logits_scale(logits_view(logits));
+  Eigen::RowVectorXf frame_log_probs;
+  for (Eigen::Index t = 0; t < logits.rows(); t++) {
+    normalize_frame(*kernels_, logits.row(t), scale, frame_log_probs);
+    logits.row(t) = frame_log_probs;
   }
-  // std::cout << "logits\n" << logits << std::endl;
-  return decode_logits(logits, beam_width, beam_prune_logp, token_min_logp,
-                       prune_history, hotword_scorer);
 }
 
-std::vector<LMBeam> BeamSearchDecoderCTC::finalize_beams(
-    const std::vector<Beam> &beams, int beam_width, float beam_prune_logp,
-    HotWordScorerPtr hotword_scorer, LMScoreCache &cached_lm_scores,
-    std::unordered_map<std::string, float> &cached_p_lm_scores,
-    bool force_next_word, bool is_end) {
+ThreadPoolPtr BeamSearchDecoderCTC::get_thread_pool(size_t num_threads) const {
+  std::lock_guard<std::mutex> lock(thread_pool_mutex_);
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  auto &pool = thread_pools_[num_threads];
+  if (!pool) {
+    pool = std::make_shared<ThreadPool>(num_threads);
+  }
+  return pool;
+}
+
+std::vector<std::vector<OutputBeam>> BeamSearchDecoderCTC::decode_batch(
+    const std::vector<Eigen::MatrixXf> &logits_list, int beam_width,
+    float beam_prune_logp, float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    size_t num_threads) const {
+  std::vector<LogitsView> views;
+  views.reserve(logits_list.size());
+  for (const auto &logits : logits_list) {
+    views.push_back(logits_view(logits));
+  }
+  return decode_batch(views, beam_width, beam_prune_logp, token_min_logp,
+                      prune_history, hotwords, hotword_weight, num_threads);
+}
+
+std::vector<std::vector<OutputBeam>> BeamSearchDecoderCTC::decode_batch(
+    const std::vector<LogitsView> &logits_list, int beam_width,
+    float beam_prune_logp, float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    size_t num_threads) const {
+  for (const auto &logits : logits_list) {
+    check_logits_dimension(logits);
+  }
+  const auto hotword_scorer =
+      HotWordScorer::build_scorer(hotwords, hotword_weight);
+  // longest utterances first to cut the tail of the batch
+  std::vector<size_t> order(logits_list.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&logits_list](size_t left, size_t right) {
+                     return logits_list.at(left).rows() >
+                            logits_list.at(right).rows();
+                   });
+  std::vector<std::vector<OutputBeam>> results(logits_list.size());
+  const auto thread_pool = get_thread_pool(num_threads);
+  // scale detection and per-frame normalization run on the worker decoding
+  // the item, there is no separate pass over the batch
+  thread_pool->parallel_for(order.size(), [&](size_t i) {
+    const auto idx = order.at(i);
+    DecodeContext ctx{beam_width, beam_prune_logp, token_min_logp,
+                      prune_history, hotword_scorer};
+    const auto &logits = logits_list.at(idx);
+    results.at(idx) = decode_logits(logits, ctx, logits_scale(logits));
+  });
+  return results;
+}
+
+std::vector<std::vector<OutputBeam>> BeamSearchDecoderCTC::decode_batch(
+    const float *logits, const std::vector<int> &lengths,
+    Eigen::Index max_frames, Eigen::Index n_vocab, int beam_width,
+    float beam_prune_logp, float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    size_t num_threads) const {
+  std::vector<LogitsView> views;
+  views.reserve(lengths.size());
+  for (size_t b = 0; b < lengths.size(); b++) {
+    if (lengths.at(b) < 0 || lengths.at(b) > max_frames) {
+      std::stringstream ss;
+      ss << "Length of batch item " << b << " is outside [0, " << max_frames
+         << "]: " << lengths.at(b);
+      throw std::runtime_error(ss.str());
+    }
+    views.push_back(
+        logits_view(logits + b * max_frames * n_vocab, lengths.at(b), n_vocab));
+  }
+  return decode_batch(views, beam_width, beam_prune_logp, token_min_logp,
+                      prune_history, hotwords, hotword_weight, num_threads);
+}
+
+OutputBeam BeamSearchDecoderCTC::decode_long(
+    const Eigen::MatrixXf &logits, int window_frames, int overlap_frames,
+    int beam_width, float beam_prune_logp, float token_min_logp,
+    bool prune_history, const std::unordered_set<std::string> &hotwords,
+    float hotword_weight, size_t num_threads) const {
+  check_logits_dimension(logits);
+  if (overlap_frames < 0 || overlap_frames >= window_frames) {
+    std::stringstream ss;
+    ss << "Overlap of " << overlap_frames
+       << " frames does not fit a window of " << window_frames << " frames";
+    throw std::runtime_error(ss.str());
+  }
+  const auto view = logits_view(logits);
+  const auto scale = logits_scale(view);
+  const int n_frames = view.rows();
+  std::vector<int> starts{0};
+  while (starts.back() + window_frames < n_frames) {
+    starts.push_back(starts.back() + window_frames - overlap_frames);
+  }
+
+  const auto hotword_scorer =
+      HotWordScorer::build_scorer(hotwords, hotword_weight);
+  std::vector<OutputBeam> windows(starts.size());
+  get_thread_pool(num_threads)->parallel_for(starts.size(), [&](size_t i) {
+    const auto start = starts.at(i);
+    DecodeContext ctx{beam_width, beam_prune_logp, token_min_logp,
+                      prune_history, hotword_scorer};
+    const auto frames =
+        view.middleRows(start, std::min(window_frames, n_frames - start));
+    auto beams = decode_logits(logits_view(frames), ctx, scale);
+    auto &window = windows.at(i);
+    if (beams.empty()) {
+      // a window left without hypotheses contributes no words
+      window = OutputBeam{"", std::nullopt, {},
+                          -std::numeric_limits<float>::infinity(),
+                          -std::numeric_limits<float>::infinity()};
+      return;
+    }
+    window = std::move(beams.front());
+    for (auto &[word, frames] : window.text_frames) {
+      frames.first += start;
+      frames.second += start;
+    }
+  });
+
+  std::optional<size_t> blank_idx;
+  for (const auto &[idx, token] : idx2vocab_) {
+    if (token == "") {
+      blank_idx = idx;
+    }
+  }
+  Eigen::RowVectorXf frame_log_probs;
+  const auto blank_logp = [&](int frame) {
+    if (!blank_idx.has_value()) {
+      return 0.0f;
+    }
+    normalize_frame(*kernels_, view.row(frame), scale, frame_log_probs);
+    return frame_log_probs[blank_idx.value()];
+  };
+  OutputBeam result = std::move(windows.front());
+  if (windows.size() == 1) {
+    return result;
+  }
+  // a word belongs to the window holding its centre frame relative to the cut
+  for (size_t i = 1; i < windows.size(); i++) {
+    auto &window = windows.at(i);
+    const auto cut = find_stitch_frame(
+        result.text_frames, window.text_frames, starts.at(i),
+        std::min(starts.at(i - 1) + window_frames, n_frames), blank_logp);
+    const auto is_before_cut = [cut](const WordFrames &word) {
+      return word.second.first + word.second.second < 2 * cut;
+    };
+    result.text_frames.erase(
+        std::remove_if(result.text_frames.begin(), result.text_frames.end(),
+                       [&is_before_cut](const WordFrames &word) {
+                         return !is_before_cut(word);
+                       }),
+        result.text_frames.end());
+    std::copy_if(window.text_frames.cbegin(), window.text_frames.cend(),
+                 std::back_inserter(result.text_frames),
+                 [&is_before_cut](const WordFrames &word) {
+                   return !is_before_cut(word);
+                 });
+    if (window.last_lm_state.has_value()) {
+      result.last_lm_state = window.last_lm_state;
+    }
+  }
+  // window scores count the overlaps twice, include words dropped at the cuts
+  // and restart the lm from <s>, none of it adds up to the stitched text
+  result.logit_score = 0.0;
+  result.lm_score = 0.0;
+  std::vector<std::string> words;
+  for (const auto &[word, frames] : result.text_frames) {
+    words.push_back(word);
+  }
+  result.text_ = boost::algorithm::join(words, " ");
+  return result;
+}
+
+std::vector<LMBeam>
+BeamSearchDecoderCTC::finalize_beams(DecodeContext &ctx, bool force_next_word,
+                                     bool is_end) const {
+  const auto &beams = ctx.beams;
   std::vector<Beam> new_beams;
   if (force_next_word || is_end) {
+    // a strict lexicon drops beams ending inside a word and a grammar the
+    // ones it does not accept, unless that drops them all
+    const auto *lexicon = ctx.lexicon.get();
+    const auto *grammar = ctx.grammar.get();
+    const auto accepted = [&](const Beam &beam) {
+      if (lexicon != nullptr && !ends_word(*lexicon, beam)) {
+        return false;
+      }
+      if (grammar == nullptr) {
+        return true;
+      }
+      const auto state = end_word(*grammar, beam);
+      return state != Grammar::NO_STATE &&
+             (!is_end || grammar->is_final(state));
+    };
+    const auto keep_all = std::none_of(beams.begin(), beams.end(), accepted);
     for (const auto &beam : beams) {
+      if (!keep_all && !accepted(beam)) {
+        continue;
+      }
+      auto grammar_state = beam.grammar_state_;
+      if (grammar != nullptr) {
+        const auto state = end_word(*grammar, beam);
+        grammar_state = state != Grammar::NO_STATE ? state : grammar_state;
+      }
       const auto new_token_times =
           beam.partial_word_ == "" ? beam.text_frames_ : [&beam]() {
             auto new_frames = beam.text_frames_;
@@ -533,31 +1776,18 @@ std::vector<LMBeam> BeamSearchDecoderCTC::finalize_beams(
           }();
       new_beams.push_back(Beam{beam.text_, beam.partial_word_, "", std::nullopt,
                                new_token_times, std::make_pair(-1, -1),
-                               beam.logit_score_});
+                               beam.logit_score_,
+                               -std::numeric_limits<float>::infinity(),
+                               -std::numeric_limits<float>::infinity(),
+                               grammar_state});
     }
     new_beams = merge_beams(new_beams);
   } else {
     new_beams = beams;
   }
-  auto scored_beams = get_lm_beam(new_beams, hotword_scorer, cached_lm_scores,
-                                  cached_p_lm_scores);
-  const auto max_score_it =
-      std::max_element(scored_beams.cbegin(), scored_beams.cend(),
-                       [](const LMBeam &left, const LMBeam &right) {
-                         return static_cast<const LMBeam *>(&left)->lm_score_ <
-                                static_cast<const LMBeam *>(&right)->lm_score_;
-                       });
-  const auto max_score = static_cast<const LMBeam *>(&*max_score_it)->lm_score_;
-
-  const auto score_thresh = max_score + beam_prune_logp;
-  scored_beams.erase(
-      std::remove_if(scored_beams.begin(), scored_beams.end(),
-                     [&score_thresh](const Beam &item) {
-                       return (static_cast<const LMBeam *>(&item)->lm_score_) <
-                              score_thresh;
-                     }),
-      scored_beams.end());
-  return sort_and_trim_beams(scored_beams, beam_width);
+  auto scored_beams = get_lm_beam(new_beams, ctx);
+  prune_beams(scored_beams, ctx.beam_prune_logp, ctx.beam_width);
+  return scored_beams;
 }
 
 } // namespace pyctcdecode
\ No newline at end of file
@@ -2,11 +2,18 @@
 #include "Eigen/Eigen"
 #include "alphabet.hpp"
 #include "constants.hpp"
+#include "grammar.hpp"
+#include "kernels.hpp"
 #include "language_model.hpp"
+#include "lexicon.hpp"
+#include "thread_pool.hpp"
 #include <cstddef>
+#include <cstdint>
 #include <filesystem>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <ostream>
 #include <sstream>
@@ -23,16 +30,88 @@ using Frames = std::pair<int, int>;
 using WordFrames = std::pair<std::string, Frames>;
 using LMScoreCacheKey = std::pair<std::string, bool>;
 using LMScoreCacheValue = std::tuple<float, float, AbstractLMStatePtr>;
+} // namespace pyctcdecode
+
+namespace std {
+template <> struct hash<pyctcdecode::LMScoreCacheKey> {
+  std::size_t operator()(const pyctcdecode::LMScoreCacheKey &key) const {
+    return std::hash<string>()(key.first) ^ std::hash<bool>()(key.second);
+  }
+};
+} // namespace std
+
+namespace pyctcdecode {
 using LMScoreCache = std::unordered_map<LMScoreCacheKey, LMScoreCacheValue>;
 
 using EigenMatrix =
     Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor>;
 using EigenArray =
     Eigen::Array<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor>;
+// frame-contiguous layout the search reads from
+using RowMajorMatrixXf =
+    Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
 template <int /*axis*/>
 void EMatrixLogSoftmax(const EigenMatrix &input, EigenMatrix &output);
 
+// Read-only frames x vocab view over logits owned by the caller. Any storage
+// order or padding is expressed through the strides, nothing is copied.
+using LogitsStride = Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>;
+template <typename Scalar>
+using LogitsViewT =
+    Eigen::Map<const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>,
+               Eigen::Unaligned, LogitsStride>;
+using LogitsView = LogitsViewT<float>;
+// reduced precision inputs, widened to float one frame at a time
+using HalfLogitsView = LogitsViewT<Eigen::half>;
+using BFloat16LogitsView = LogitsViewT<Eigen::bfloat16>;
+using Int8LogitsView = LogitsViewT<int8_t>;
+
+// leading_dim is the distance between frames of a row major buffer or between
+// tokens of a column major one, 0 for densely packed
+template <typename Scalar>
+LogitsViewT<Scalar> logits_view(const Scalar *data, Eigen::Index n_frames,
+                                Eigen::Index n_vocab, bool row_major = true,
+                                Eigen::Index leading_dim = 0) {
+  if (row_major) {
+    return LogitsViewT<Scalar>(
+        data, n_frames, n_vocab,
+        LogitsStride(1, leading_dim > 0 ? leading_dim : n_vocab));
+  }
+  return LogitsViewT<Scalar>(
+      data, n_frames, n_vocab,
+      LogitsStride(leading_dim > 0 ? leading_dim : n_frames, 1));
+}
+
+// View over any dense Eigen matrix, map or block with direct access
+template <typename Derived>
+LogitsViewT<typename Derived::Scalar>
+logits_view(const Eigen::DenseBase<Derived> &logits) {
+  using View = LogitsViewT<typename Derived::Scalar>;
+  const auto &derived = logits.derived();
+  if constexpr (Derived::IsRowMajor) {
+    return View(derived.data(), derived.rows(), derived.cols(),
+                LogitsStride(derived.innerStride(), derived.outerStride()));
+  } else {
+    return View(derived.data(), derived.rows(), derived.cols(),
+                LogitsStride(derived.outerStride(), derived.innerStride()));
+  }
+}
+
+// Top-k log probs in compressed row storage, one row per frame and one column
+// per token. Tokens a frame leaves out, the blank included, are impossible in
+// that frame, so the blank should be kept alongside the top tokens.
+using SparseLogProbs = Eigen::SparseMatrix<float, Eigen::RowMajor, int>;
+
+// token index and its clipped log prob in one frame
+using TokenCandidate = std::pair<size_t, float>;
+
+// What a logits matrix holds, everything is turned into clipped log probs
+// one frame at a time inside the search
+enum class LogitsScale { LOGITS, PROBS, LOG_PROBS };
+
 struct LMBeam;
+class StreamingSession;
+class AsyncDecoder;
 
 struct Beam {
   std::string text_;
@@ -42,6 +121,19 @@ struct Beam {
   std::vector<Frames> text_frames_;
   Frames partial_frames_;
   float logit_score_;
+  // prefix search only: logit_score_ split into the log probs of the prefix
+  // ending in a blank and ending in last_char_
+  float blank_logit_score_ = -std::numeric_limits<float>::infinity();
+  float token_logit_score_ = -std::numeric_limits<float>::infinity();
+  // grammar search only: state reached by the finished words
+  Grammar::State grammar_state_ = Grammar::START;
+  // lexicon search only: node of partial_word_ in the lexicon trie
+  Lexicon::Node lexicon_node_ = Lexicon::ROOT;
+  // grammar search only: node of partial_word_ in the words of grammar_state_
+  Lexicon::Node grammar_node_ = Lexicon::ROOT;
+  // bpe only: the last non-blank token closed its word, the next one starts
+  // a new word whatever its marker
+  bool piece_ends_word_ = false;
 
   Beam(const Beam &other) = default;
   Beam(Beam &&other) = default;
@@ -104,33 +196,121 @@ struct OutputBeam {
   float lm_score;
 };
 
+// Beam width chosen per frame from the frame's posterior entropy in nats.
+// Frames at or below min_entropy keep min_beam_width beams, frames at or
+// above max_entropy the full beam width, widths in between are interpolated.
+struct AdaptiveBeam {
+  int min_beam_width = DEFAULT_ADAPTIVE_MIN_BEAM_WIDTH;
+  float min_entropy = DEFAULT_ADAPTIVE_MIN_ENTROPY;
+  float max_entropy = DEFAULT_ADAPTIVE_MAX_ENTROPY;
+};
+
+// Work done by one search
+struct DecodeStats {
+  int frames;
+  // beams kept after each frame, summed over frames
+  size_t active_beams;
+
+  double mean_active_beams() const {
+    return frames > 0 ? static_cast<double>(active_beams) / frames : 0.0;
+  }
+};
+
+// Per-request search state. Every decode call owns its context, the decoder
+// itself is immutable after construction. Every member has an initializer so
+// callers can brace-initialize the leading settings only.
+struct DecodeContext {
+  // also the max_active cap of the histogram pruning after every frame
+  int beam_width = DEFAULT_BEAM_WIDTH;
+  float beam_prune_logp = DEFAULT_PRUNE_LOGP;
+  float token_min_logp = DEFAULT_MIN_TOKEN_LOGP;
+  bool prune_history = DEFAULT_PRUNE_BEAMS;
+  HotWordScorerPtr hotword_scorer{};
+  // nullopt keeps beam_width on every frame
+  std::optional<AdaptiveBeam> adaptive_beam{};
+  // CTC prefix search, see decode_beams_prefix
+  bool prefix_search = false;
+  // strict lexicon, see decode_beams_lexicon. nullptr allows any word.
+  LexiconPtr lexicon{};
+  // word grammar, see decode_beams_grammar. nullptr allows any sequence.
+  GrammarPtr grammar{};
+
+  std::vector<Beam> beams{};
+  int processed_frames = 0;
+  size_t active_beams = 0;
+  // entropy of the frame in ctx.candidates, set when adaptive_beam is
+  float frame_entropy = 0.0;
+  LMScoreCache cached_lm_scores{};
+  std::unordered_map<std::string, float> cached_p_lm_scores{};
+
+  // thread team splitting each frame's expansion and lm scoring, nullptr
+  // decodes on the calling thread
+  ThreadPoolPtr thread_pool{};
+
+  // scratch buffers reused across chunks and frames
+  RowMajorMatrixXf log_probs{};
+  Eigen::RowVectorXf frame{};
+  std::vector<TokenCandidate> candidates{};
+  std::vector<uint32_t> candidate_tokens{};
+  std::vector<Beam> new_beams{};
+  std::vector<std::vector<std::vector<Beam>>> partition_beams{};
+};
+
+// All const member functions are safe to call concurrently on one instance,
+// they only read the alphabet and language model and keep every per-request
+// structure in a DecodeContext.
 class BeamSearchDecoderCTC {
+  friend class StreamingSession;
+  friend class AsyncDecoder;
+
 private:
-  std::vector<LMBeam> get_lm_beam(
-      const std::vector<Beam> &beams, const HotWordScorerPtr hotword_scorer,
-      LMScoreCache &cached_lm_scores,
-      std::unordered_map<std::string, float> &cached_partial_token_scores,
-      bool is_eos = false) const;
-  std::vector<Beam> partial_decode_logits(
-      const Eigen::MatrixXf &logits, std::vector<Beam> &beams, int beam_width,
-      float beam_prune_logp, float token_min_logp, bool prune_history,
-      const HotWordScorerPtr hotword_scorer, LMScoreCache &cached_lm_scores,
-      std::unordered_map<std::string, float> &cached_p_lm_scores,
-      int processed_frames = 0) const;
-
-  std::vector<LMBeam>
-  finalize_beams(const std::vector<Beam> &beams, int beam_width,
-                 float beam_prune_logp, HotWordScorerPtr hotword_scorer,
-                 LMScoreCache &cached_lm_scores,
-                 std::unordered_map<std::string, float> &cached_p_lm_scores,
-                 bool force_next_word = false, bool is_end = false);
+  void init_decode_state(
+      DecodeContext &ctx,
+      std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt) const;
+  void normalize_logits(RowMajorMatrixXf &logits) const;
+  LogitsScale logits_scale(const LogitsView &logits) const;
+  int lm_order() const;
+  ThreadPoolPtr get_thread_pool(size_t num_threads) const;
+  std::vector<OutputBeam>
+  get_output_beams(const std::vector<LMBeam> &trimmed_beams,
+                   const LMScoreCache &cached_lm_scores) const;
+  void expand_beam(const Beam &beam, size_t idx_char, const std::string &chr,
+                   float p_char, int frame_idx, const DecodeContext &ctx,
+                   std::vector<Beam> &new_beams) const;
+  void extend_beam(const Beam &beam, size_t idx_char, const std::string &chr,
+                   float score, int frame_idx, const DecodeContext &ctx,
+                   std::vector<Beam> &new_beams) const;
+  void expand_prefix(const Beam &beam, size_t idx_char,
+                     const std::string &chr, float p_char, int frame_idx,
+                     const DecodeContext &ctx,
+                     std::vector<Beam> &new_beams) const;
+  std::vector<LMBeam> get_lm_beam(const std::vector<Beam> &beams,
+                                  DecodeContext &ctx,
+                                  bool is_eos = false) const;
+  void decode_candidates(DecodeContext &ctx) const;
+  void partial_decode_logits(
+      const LogitsView &logits, DecodeContext &ctx,
+      LogitsScale scale = LogitsScale::LOG_PROBS) const;
+  std::vector<LMBeam> finalize_beams(DecodeContext &ctx,
+                                     bool force_next_word = false,
+                                     bool is_end = false) const;
   std::vector<OutputBeam> decode_logits(
-      const Eigen::MatrixXf &logits, int beam_width, float beam_prune_logp,
-      float token_min_logp, bool prune_history, HotWordScorerPtr hotword_scorer,
-      std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt);
+      const LogitsView &logits, DecodeContext &ctx,
+      LogitsScale scale = LogitsScale::LOG_PROBS,
+      std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt) const;
+  std::vector<OutputBeam>
+  decode_sparse(
+      const Eigen::Ref<const SparseLogProbs> &log_probs, DecodeContext &ctx,
+      std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt) const;
+  template <typename Scalar>
+  std::vector<OutputBeam> decode_widened(
+      const LogitsViewT<Scalar> &logits, const float *frame_scales,
+      DecodeContext &ctx, LogitsScale scale,
+      std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt) const;
 
-  void check_logits_dimension(const Eigen::MatrixXf &logits) {
-    if (logits.cols() != idx2vocab_.size()) {
+  template <typename Derived>
+  void check_logits_dimension(const Eigen::EigenBase<Derived> &logits) const {
+    if (logits.cols() != static_cast<Eigen::Index>(idx2vocab_.size())) {
       std::stringstream ss;
       ss << "Input logits cols does not match vocab size " << logits.cols()
          << " vs " << idx2vocab_.size();
@@ -139,35 +319,276 @@ private:
   }
 
 private:
-  std::unordered_map<int, AbstractLanguageModelPtr> model_container_;
+  const AbstractLanguageModelPtr language_model_;
   AlphabetPtr alphabet_;
   std::unordered_map<size_t, std::string> idx2vocab_;
   bool is_bpe_;
-  int model_key_;
+  // frame kernels for the cpu, picked once at construction
+  const Kernels *kernels_;
+  // one pool per requested size, built on first use and kept for the life of
+  // the decoder. Concurrent callers of the same size share its workers.
+  mutable std::mutex thread_pool_mutex_;
+  mutable std::unordered_map<size_t, ThreadPoolPtr> thread_pools_;
 
 public:
+  // simd_level nullopt picks the best level the cpu supports, an explicit
+  // level throws when the cpu lacks it
   BeamSearchDecoderCTC(
       AlphabetPtr alphabet,
-      std::optional<AbstractLanguageModelPtr> language_model = std::nullopt);
-  std::vector<Beam> partial_decode_beams(
-      const Eigen::MatrixXf &logits, LMScoreCache &cached_lm_scores,
-      std::unordered_map<std::string, float> cached_p_lm_scores,
-      const std::vector<Beam> &beams, int processed_frames,
-      int beam_width = DEFAULT_BEAM_WIDTH,
-      float beam_prune_logp = DEFAULT_PRUNE_LOGP,
-      float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
-      bool prune_history = DEFAULT_PRUNE_BEAMS,
-      HotWordScorerPtr hotword_scorer = nullptr, bool force_next_word = false,
-      bool is_end = false);
-
-  std::vector<OutputBeam>
-  decode_beams(Eigen::MatrixXf &logits, int beam_width = DEFAULT_BEAM_WIDTH,
+      std::optional<AbstractLanguageModelPtr> language_model = std::nullopt,
+      std::optional<SimdLevel> simd_level = std::nullopt);
+
+  SimdLevel simd_level() const { return kernels_->level; }
+
+  std::vector<OutputBeam>
+  decode_beams(const Eigen::MatrixXf &logits,
+               int beam_width = DEFAULT_BEAM_WIDTH,
                float beam_prune_logp = DEFAULT_PRUNE_LOGP,
                float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
                bool prune_history = DEFAULT_PRUNE_BEAMS,
                const std::unordered_set<std::string> &hotwords = {},
                float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
-               std::optional<AbstractLMState> lm_start_state = std::nullopt);
+               std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt,
+               size_t num_threads = 1) const;
+  // Same search straight over a caller-owned buffer, see logits_view()
+  std::vector<OutputBeam>
+  decode_beams(const LogitsView &logits, int beam_width = DEFAULT_BEAM_WIDTH,
+               float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+               float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+               bool prune_history = DEFAULT_PRUNE_BEAMS,
+               const std::unordered_set<std::string> &hotwords = {},
+               float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+               std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt,
+               size_t num_threads = 1) const;
+
+  // fp16 and bf16 logits, probabilities or log probs. Each frame is widened
+  // to float right before the search reads it.
+  std::vector<OutputBeam>
+  decode_beams(const HalfLogitsView &logits,
+               int beam_width = DEFAULT_BEAM_WIDTH,
+               float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+               float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+               bool prune_history = DEFAULT_PRUNE_BEAMS,
+               const std::unordered_set<std::string> &hotwords = {},
+               float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+               std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt,
+               size_t num_threads = 1) const;
+  std::vector<OutputBeam>
+  decode_beams(const BFloat16LogitsView &logits,
+               int beam_width = DEFAULT_BEAM_WIDTH,
+               float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+               float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+               bool prune_history = DEFAULT_PRUNE_BEAMS,
+               const std::unordered_set<std::string> &hotwords = {},
+               float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+               std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt,
+               size_t num_threads = 1) const;
+  // Quantized log probs, frame t holds log_probs(t, v) * frame_scales(t)
+  std::vector<OutputBeam>
+  decode_beams(const Int8LogitsView &log_probs,
+               const Eigen::Ref<const Eigen::VectorXf> &frame_scales,
+               int beam_width = DEFAULT_BEAM_WIDTH,
+               float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+               float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+               bool prune_history = DEFAULT_PRUNE_BEAMS,
+               const std::unordered_set<std::string> &hotwords = {},
+               float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+               std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt,
+               size_t num_threads = 1) const;
+
+  // CTC prefix beam search: every beam is a distinct prefix holding the log
+  // probs of ending in a blank and in its last token, instead of one beam
+  // per way of ending. Hypotheses that only differ there no longer compete
+  // for beam slots, so a smaller beam_width reaches the same accuracy.
+  std::vector<OutputBeam>
+  decode_beams_prefix(const Eigen::MatrixXf &logits,
+                      int beam_width = DEFAULT_BEAM_WIDTH,
+                      float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+                      float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+                      bool prune_history = DEFAULT_PRUNE_BEAMS,
+                      const std::unordered_set<std::string> &hotwords = {},
+                      float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+                      std::optional<AbstractLMStatePtr> lm_start_state =
+                          std::nullopt,
+                      size_t num_threads = 1) const;
+  std::vector<OutputBeam>
+  decode_beams_prefix(const LogitsView &logits,
+                      int beam_width = DEFAULT_BEAM_WIDTH,
+                      float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+                      float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+                      bool prune_history = DEFAULT_PRUNE_BEAMS,
+                      const std::unordered_set<std::string> &hotwords = {},
+                      float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+                      std::optional<AbstractLMStatePtr> lm_start_state =
+                          std::nullopt,
+                      size_t num_threads = 1) const;
+
+  // Closed vocabulary search: every word must be in lexicon. Tokens that
+  // would take a beam's partial word out of the lexicon trie are masked
+  // before the beam is created, a frame with every token masked counts as a
+  // blank, and beams ending inside a word are dropped at the end unless no
+  // beam ends on a word.
+  std::vector<OutputBeam>
+  decode_beams_lexicon(const Eigen::MatrixXf &logits, LexiconPtr lexicon,
+                       int beam_width = DEFAULT_BEAM_WIDTH,
+                       float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+                       float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+                       bool prune_history = DEFAULT_PRUNE_BEAMS,
+                       const std::unordered_set<std::string> &hotwords = {},
+                       float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+                       std::optional<AbstractLMStatePtr> lm_start_state =
+                           std::nullopt,
+                       size_t num_threads = 1) const;
+  std::vector<OutputBeam>
+  decode_beams_lexicon(const LogitsView &logits, LexiconPtr lexicon,
+                       int beam_width = DEFAULT_BEAM_WIDTH,
+                       float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+                       float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+                       bool prune_history = DEFAULT_PRUNE_BEAMS,
+                       const std::unordered_set<std::string> &hotwords = {},
+                       float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+                       std::optional<AbstractLMStatePtr> lm_start_state =
+                           std::nullopt,
+                       size_t num_threads = 1) const;
+
+  // Search constrained to the word sequences grammar accepts. A token is
+  // masked when it would finish a word the grammar state of the beam has no
+  // arc for or start a word no arc begins with. A frame with every token
+  // masked counts as a blank, and beams not ending in a final state are
+  // dropped at the end unless none does.
+  std::vector<OutputBeam>
+  decode_beams_grammar(const Eigen::MatrixXf &logits, GrammarPtr grammar,
+                       int beam_width = DEFAULT_BEAM_WIDTH,
+                       float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+                       float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+                       bool prune_history = DEFAULT_PRUNE_BEAMS,
+                       const std::unordered_set<std::string> &hotwords = {},
+                       float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+                       std::optional<AbstractLMStatePtr> lm_start_state =
+                           std::nullopt,
+                       size_t num_threads = 1) const;
+  std::vector<OutputBeam>
+  decode_beams_grammar(const LogitsView &logits, GrammarPtr grammar,
+                       int beam_width = DEFAULT_BEAM_WIDTH,
+                       float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+                       float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+                       bool prune_history = DEFAULT_PRUNE_BEAMS,
+                       const std::unordered_set<std::string> &hotwords = {},
+                       float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+                       std::optional<AbstractLMStatePtr> lm_start_state =
+                           std::nullopt,
+                       size_t num_threads = 1) const;
+
+  // Search with a per-frame beam width of at most beam_width, see
+  // AdaptiveBeam. stats, when given, receives the work done.
+  std::vector<OutputBeam>
+  decode_beams_adaptive(const Eigen::MatrixXf &logits,
+                        const AdaptiveBeam &adaptive_beam = {},
+                        int beam_width = DEFAULT_BEAM_WIDTH,
+                        float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+                        float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+                        bool prune_history = DEFAULT_PRUNE_BEAMS,
+                        const std::unordered_set<std::string> &hotwords = {},
+                        float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+                        std::optional<AbstractLMStatePtr> lm_start_state =
+                            std::nullopt,
+                        DecodeStats *stats = nullptr) const;
+  std::vector<OutputBeam>
+  decode_beams_adaptive(const LogitsView &logits,
+                        const AdaptiveBeam &adaptive_beam = {},
+                        int beam_width = DEFAULT_BEAM_WIDTH,
+                        float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+                        float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+                        bool prune_history = DEFAULT_PRUNE_BEAMS,
+                        const std::unordered_set<std::string> &hotwords = {},
+                        float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+                        std::optional<AbstractLMStatePtr> lm_start_state =
+                            std::nullopt,
+                        DecodeStats *stats = nullptr) const;
+
+  // Sparse per-frame candidates, e.g. the top k tokens kept on the
+  // accelerator, as a SparseLogProbs or a map over caller buffers. The search
+  // reads the stored entries only.
+  template <typename Derived>
+  std::vector<OutputBeam>
+  decode_beams(const Eigen::SparseMatrixBase<Derived> &log_probs,
+               int beam_width = DEFAULT_BEAM_WIDTH,
+               float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+               float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+               bool prune_history = DEFAULT_PRUNE_BEAMS,
+               const std::unordered_set<std::string> &hotwords = {},
+               float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+               std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt,
+               size_t num_threads = 1) const {
+    DecodeContext ctx{beam_width, beam_prune_logp, token_min_logp,
+                      prune_history,
+                      HotWordScorer::build_scorer(hotwords, hotword_weight)};
+    if (num_threads > 1) {
+      ctx.thread_pool = get_thread_pool(num_threads);
+    }
+    return decode_sparse(log_probs.derived(), ctx, lm_start_state);
+  }
+
+  // Best path decoding: the top token of every frame with repeats collapsed
+  // and blanks dropped. Ignores the language model and hotwords, a cheap
+  // first pass or fallback when the search is too expensive. lm_score equals
+  // logit_score.
+  OutputBeam decode_greedy(const Eigen::MatrixXf &logits) const;
+  OutputBeam decode_greedy(const LogitsView &logits) const;
+
+  // Decode independent utterances on the decoder's thread pool, longest
+  // first. num_threads = 0 uses all hardware threads. Results are returned in
+  // input order.
+  std::vector<std::vector<OutputBeam>>
+  decode_batch(const std::vector<Eigen::MatrixXf> &logits_list,
+               int beam_width = DEFAULT_BEAM_WIDTH,
+               float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+               float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+               bool prune_history = DEFAULT_PRUNE_BEAMS,
+               const std::unordered_set<std::string> &hotwords = {},
+               float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+               size_t num_threads = 0) const;
+
+  std::vector<std::vector<OutputBeam>>
+  decode_batch(const std::vector<LogitsView> &logits_list,
+               int beam_width = DEFAULT_BEAM_WIDTH,
+               float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+               float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+               bool prune_history = DEFAULT_PRUNE_BEAMS,
+               const std::unordered_set<std::string> &hotwords = {},
+               float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+               size_t num_threads = 0) const;
+  // Padded batch x max_frames x n_vocab row major tensor where item b holds
+  // its first lengths[b] frames. Every item is decoded in place.
+  std::vector<std::vector<OutputBeam>>
+  decode_batch(const float *logits, const std::vector<int> &lengths,
+               Eigen::Index max_frames, Eigen::Index n_vocab,
+               int beam_width = DEFAULT_BEAM_WIDTH,
+               float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+               float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+               bool prune_history = DEFAULT_PRUNE_BEAMS,
+               const std::unordered_set<std::string> &hotwords = {},
+               float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+               size_t num_threads = 0) const;
+
+  // Decode one long recording as overlapping windows on the decoder's thread
+  // pool and stitch the best window hypotheses at a word boundary inside each
+  // overlap. Recordings spanning several windows get logit_score and
+  // lm_score 0: the scores of the stitched text are unknown and window scores
+  // are not comparable with decode_beams. last_lm_state is the one of the
+  // last window that kept a hypothesis. A window without any adds no words,
+  // and a recording of one such window comes back empty with -inf scores.
+  OutputBeam
+  decode_long(const Eigen::MatrixXf &logits,
+              int window_frames = DEFAULT_LONG_FORM_WINDOW_FRAMES,
+              int overlap_frames = DEFAULT_LONG_FORM_OVERLAP_FRAMES,
+              int beam_width = DEFAULT_BEAM_WIDTH,
+              float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+              float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+              bool prune_history = DEFAULT_PRUNE_BEAMS,
+              const std::unordered_set<std::string> &hotwords = {},
+              float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+              size_t num_threads = 0) const;
 
   std::string
   decode(const Eigen::MatrixXf &logits, int beam_width = DEFAULT_BEAM_WIDTH,
@@ -176,7 +597,15 @@ public:
          bool prune_history = DEFAULT_PRUNE_BEAMS,
          const std::unordered_set<std::string> &hotwords = {},
          float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
-         std::optional<AbstractLMState> lm_start_state = std::nullopt);
+         std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt) const;
+  std::string
+  decode(const LogitsView &logits, int beam_width = DEFAULT_BEAM_WIDTH,
+         float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+         float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+         bool prune_history = DEFAULT_PRUNE_BEAMS,
+         const std::unordered_set<std::string> &hotwords = {},
+         float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+         std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt) const;
 };
 
 using BeamSearchDecoderCTCPtr = std::shared_ptr<BeamSearchDecoderCTC>;
@@ -0,0 +1,97 @@
+#include "grammar.hpp"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace pyctcdecode {
+
+Grammar::Grammar(std::istream &is) {
+  // states are renumbered in order of first mention, the start state first
+  std::unordered_map<std::string, State> state_ids;
+  const auto state_id = [&](const std::string &name, int line_no) {
+    if (name.empty() ||
+        name.find_first_not_of("0123456789") != std::string::npos) {
+      throw std::runtime_error("Grammar line " + std::to_string(line_no) +
+                               ": bad state [" + name + "]");
+    }
+    const auto [it, inserted] = state_ids.emplace(name, arcs_.size());
+    if (inserted) {
+      arcs_.emplace_back();
+      is_final_.push_back(false);
+    }
+    return it->second;
+  };
+  std::string line;
+  int line_no = 0;
+  while (std::getline(is, line)) {
+    line_no++;
+    std::istringstream fields(line.substr(0, line.find('#')));
+    std::vector<std::string> tokens;
+    for (std::string token; fields >> token;) {
+      tokens.push_back(std::move(token));
+    }
+    if (tokens.size() == 1) {
+      is_final_.at(state_id(tokens[0], line_no)) = true;
+    } else if (tokens.size() == 3) {
+      if (tokens[2] == "<eps>") {
+        throw std::runtime_error("Grammar line " + std::to_string(line_no) +
+                                 ": epsilon arcs are not supported");
+      }
+      const auto src = state_id(tokens[0], line_no);
+      const auto dst = state_id(tokens[1], line_no);
+      arcs_.at(src).emplace_back(std::move(tokens[2]), dst);
+    } else if (!tokens.empty()) {
+      throw std::runtime_error("Grammar line " + std::to_string(line_no) +
+                               ": expected \"src dst word\" or \"state\"");
+    }
+  }
+  if (arcs_.empty()) {
+    throw std::runtime_error("Grammar has no states");
+  }
+  words_.reserve(arcs_.size());
+  node_states_.reserve(arcs_.size());
+  for (auto &arcs : arcs_) {
+    std::sort(arcs.begin(), arcs.end());
+    arcs.erase(std::unique(arcs.begin(), arcs.end()), arcs.end());
+    std::vector<std::string> words;
+    for (const auto &[word, dst] : arcs) {
+      if (!words.empty() && words.back() == word) {
+        throw std::runtime_error("Grammar is not deterministic on [" + word +
+                                 "]");
+      }
+      words.push_back(word);
+    }
+    words_.emplace_back(std::move(words));
+    const auto &lexicon = words_.back();
+    auto &node_states = node_states_.emplace_back(lexicon.n_nodes(), NO_STATE);
+    for (const auto &[word, dst] : arcs) {
+      node_states.at(lexicon.step(Lexicon::ROOT, word)) = dst;
+    }
+  }
+}
+
+Grammar::State Grammar::next_state(State state,
+                                   const std::string &word) const {
+  const auto &arcs = arcs_.at(state);
+  const auto it = std::lower_bound(
+      arcs.begin(), arcs.end(), word,
+      [](const auto &arc, const std::string &w) { return arc.first < w; });
+  return it != arcs.end() && it->first == word ? it->second : NO_STATE;
+}
+
+GrammarPtr Grammar::load_grammar(const std::filesystem::path &path) {
+  std::ifstream is(path);
+  if (!is) {
+    throw std::runtime_error("Cannot open " + path.string());
+  }
+  return std::make_shared<const Grammar>(is);
+}
+
+GrammarPtr Grammar::parse_grammar(const std::string &text) {
+  std::istringstream is(text);
+  return std::make_shared<const Grammar>(is);
+}
+
+} // namespace pyctcdecode
@@ -0,0 +1,55 @@
+#pragma once
+#include "lexicon.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace pyctcdecode {
+
+class Grammar;
+using GrammarPtr = std::shared_ptr<const Grammar>;
+
+// Deterministic word acceptor over the decoded text. Read from the OpenFst
+// text format without weights: one "src dst word" line per arc and one
+// "state" line per final state, "#" starts a comment. The state on the first
+// line is the start state. The outgoing words of every state are compiled into
+// a Lexicon, so checking a partial word is a walk down a trie.
+class Grammar {
+public:
+  using State = uint32_t;
+  static constexpr State START = 0;
+  // returned for a word the grammar does not allow
+  static constexpr State NO_STATE = std::numeric_limits<State>::max();
+
+private:
+  std::vector<Lexicon> words_;
+  // arcs of every state sorted by word
+  std::vector<std::vector<std::pair<std::string, State>>> arcs_;
+  // target state of every node of words_, NO_STATE where no word ends
+  std::vector<std::vector<State>> node_states_;
+  std::vector<bool> is_final_;
+
+public:
+  explicit Grammar(std::istream &is);
+
+  // state reached from state by word, NO_STATE when there is no such arc
+  State next_state(State state, const std::string &word) const;
+  // state reached from state by the word ending at node of words(state)
+  State next_state(State state, Lexicon::Node node) const {
+    return node == Lexicon::NO_NODE ? NO_STATE : node_states_[state][node];
+  }
+  bool is_final(State state) const { return is_final_.at(state); }
+  // outgoing words of state
+  const Lexicon &words(State state) const { return words_.at(state); }
+  size_t n_states() const { return words_.size(); }
+
+  static GrammarPtr load_grammar(const std::filesystem::path &path);
+  static GrammarPtr parse_grammar(const std::string &text);
+};
+
+} // namespace pyctcdecode
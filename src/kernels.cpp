@@ -0,0 +1,473 @@
+#include "kernels.hpp"
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PYCTCDECODE_X86_KERNELS 1
+// vector arguments only ever cross inlined calls, the abi note is noise. It is
+// reported at the end of the file, so it stays off for all of it.
+#pragma GCC diagnostic ignored "-Wpsabi"
+#include <immintrin.h>
+#endif
+
+namespace pyctcdecode {
+
+namespace {
+
+float scalar_sum_exp(const float *x, size_t n, float shift) {
+  float sum = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += std::exp(x[i] - shift);
+  }
+  return sum;
+}
+
+float scalar_max(const float *x, size_t n) {
+  auto max = -std::numeric_limits<float>::infinity();
+  for (size_t i = 0; i < n; ++i) {
+    max = std::max(max, x[i]);
+  }
+  return max;
+}
+
+size_t scalar_argmax(const float *x, size_t n) {
+  size_t max_idx = 0;
+  for (size_t i = 1; i < n; ++i) {
+    if (x[i] > x[max_idx]) {
+      max_idx = i;
+    }
+  }
+  return max_idx;
+}
+
+size_t scalar_select_above(const float *x, size_t n, float threshold,
+                           uint32_t *out) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (x[i] >= threshold) {
+      out[count++] = i;
+    }
+  }
+  return count;
+}
+
+void scalar_log_softmax(const float *x, size_t n, float *out) {
+  const auto max = scalar_max(x, n);
+  const auto lse = max + std::log(scalar_sum_exp(x, n, max));
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = x[i] - lse;
+  }
+}
+
+float half_bits_to_float(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+  const uint32_t exponent = (half >> 10) & 0x1fu;
+  const uint32_t mantissa = half & 0x3ffu;
+  if (exponent == 0) {
+    // zero or subnormal, mantissa * 2^-24 is exact in float
+    const auto value = std::ldexp(static_cast<float>(mantissa), -24);
+    return sign != 0 ? -value : value;
+  }
+  // inf and nan keep an all ones exponent, normal numbers are rebiased
+  const uint32_t bits = sign |
+                        ((exponent == 0x1fu ? 0xffu : exponent + 112) << 23) |
+                        (mantissa << 13);
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+void scalar_half_to_float(const uint16_t *x, size_t n, float *out) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = half_bits_to_float(x[i]);
+  }
+}
+
+// bf16 is the top half of a float
+void scalar_bfloat16_to_float(const uint16_t *x, size_t n, float *out) {
+  for (size_t i = 0; i < n; ++i) {
+    const uint32_t bits = static_cast<uint32_t>(x[i]) << 16;
+    std::memcpy(out + i, &bits, sizeof(bits));
+  }
+}
+
+#ifdef PYCTCDECODE_X86_KERNELS
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int v4si __attribute__((vector_size(16)));
+typedef float v8sf __attribute__((vector_size(32)));
+typedef int v8si __attribute__((vector_size(32)));
+typedef float v16sf __attribute__((vector_size(64)));
+typedef int v16si __attribute__((vector_size(64)));
+
+#define KERNEL_INLINE inline __attribute__((always_inline))
+
+template <typename V> constexpr size_t lanes() {
+  return sizeof(V) / sizeof(float);
+}
+
+template <typename V> KERNEL_INLINE V broadcast(float value) {
+  V out;
+  for (size_t i = 0; i < lanes<V>(); ++i) {
+    out[i] = value;
+  }
+  return out;
+}
+
+template <typename V> KERNEL_INLINE V load(const float *x) {
+  V out;
+  std::memcpy(&out, x, sizeof(V));
+  return out;
+}
+
+template <typename V> KERNEL_INLINE void store(float *x, const V &value) {
+  std::memcpy(x, &value, sizeof(V));
+}
+
+// first n lanes of x, the rest filled with fill
+template <typename V> KERNEL_INLINE V load_partial(const float *x, size_t n,
+                                                   float fill) {
+  auto out = broadcast<V>(fill);
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = x[i];
+  }
+  return out;
+}
+
+// mask lanes are all ones or all zeros
+template <typename V, typename VI>
+KERNEL_INLINE V select(const VI &mask, const V &if_true, const V &if_false) {
+  return reinterpret_cast<V>((reinterpret_cast<VI>(if_true) & mask) |
+                             (reinterpret_cast<VI>(if_false) & ~mask));
+}
+
+template <typename V, typename VI>
+KERNEL_INLINE V vmax(const V &a, const V &b) {
+  return select<V, VI>(a > b, a, b);
+}
+
+// exp by range reduction to [-ln2 / 2, ln2 / 2] and a degree 6 polynomial
+// (cephes expf), 2^n is built in the exponent bits. Lanes below the float
+// range, -inf included, come out as exactly zero.
+template <typename V, typename VI> KERNEL_INLINE V exp_poly(const V &in) {
+  const auto lo = broadcast<V>(-87.33654f);
+  const auto hi = broadcast<V>(88.0f);
+  const VI underflow = in < lo;
+  auto x = vmax<V, VI>(in, lo);
+  x = select<V, VI>(x > hi, hi, x);
+
+  // round to nearest by adding and removing 1.5 * 2^23
+  const auto magic = broadcast<V>(12582912.0f);
+  const auto n = (x * 1.44269504088896341f + magic) - magic;
+  x = x - n * 0.693359375f;
+  x = x + n * 2.12194440e-4f;
+
+  auto y = broadcast<V>(1.9875691500e-4f);
+  y = y * x + 1.3981999507e-3f;
+  y = y * x + 8.3334519073e-3f;
+  y = y * x + 4.1665795894e-2f;
+  y = y * x + 1.6666665459e-1f;
+  y = y * x + 5.0000001201e-1f;
+  y = y * x * x + x + 1.0f;
+
+  const auto pow2n = reinterpret_cast<V>(
+      (__builtin_convertvector(n, VI) + 127) << 23);
+  return reinterpret_cast<V>(reinterpret_cast<VI>(y * pow2n) & ~underflow);
+}
+
+template <typename V> KERNEL_INLINE float horizontal_sum(const V &v) {
+  float sum = 0.0;
+  for (size_t i = 0; i < lanes<V>(); ++i) {
+    sum += v[i];
+  }
+  return sum;
+}
+
+template <typename V, typename VI>
+KERNEL_INLINE float vector_max(const float *x, size_t n) {
+  const auto neg_inf = -std::numeric_limits<float>::infinity();
+  auto acc = broadcast<V>(neg_inf);
+  size_t i = 0;
+  for (; i + lanes<V>() <= n; i += lanes<V>()) {
+    acc = vmax<V, VI>(acc, load<V>(x + i));
+  }
+  acc = vmax<V, VI>(acc, load_partial<V>(x + i, n - i, neg_inf));
+  auto max = neg_inf;
+  for (size_t j = 0; j < lanes<V>(); ++j) {
+    max = std::max(max, acc[j]);
+  }
+  return max;
+}
+
+template <typename VI> KERNEL_INLINE bool any_lane(const VI &mask) {
+  int any = 0;
+  for (size_t i = 0; i < lanes<VI>(); ++i) {
+    any |= mask[i];
+  }
+  return any != 0;
+}
+
+// max pass, then a search for the first lane equal to it
+template <typename V, typename VI>
+KERNEL_INLINE size_t vector_argmax(const float *x, size_t n) {
+  const auto max = vector_max<V, VI>(x, n);
+  const auto max_v = broadcast<V>(max);
+  size_t i = 0;
+  for (; i + lanes<V>() <= n; i += lanes<V>()) {
+    if (any_lane<VI>(load<V>(x + i) == max_v)) {
+      break;
+    }
+  }
+  while (i + 1 < n && x[i] != max) {
+    ++i;
+  }
+  return i;
+}
+
+// most frames have a handful of tokens above the threshold, whole vectors
+// below it are skipped with one test
+template <typename V, typename VI>
+KERNEL_INLINE size_t vector_select_above(const float *x, size_t n,
+                                         float threshold, uint32_t *out) {
+  const auto threshold_v = broadcast<V>(threshold);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + lanes<V>() <= n; i += lanes<V>()) {
+    const VI mask = load<V>(x + i) >= threshold_v;
+    if (any_lane<VI>(mask)) {
+      for (size_t j = 0; j < lanes<V>(); ++j) {
+        if (mask[j] != 0) {
+          out[count++] = i + j;
+        }
+      }
+    }
+  }
+  for (; i < n; ++i) {
+    if (x[i] >= threshold) {
+      out[count++] = i;
+    }
+  }
+  return count;
+}
+
+template <typename V, typename VI>
+KERNEL_INLINE float vector_sum_exp(const float *x, size_t n, float shift) {
+  const auto shift_v = broadcast<V>(shift);
+  auto acc = broadcast<V>(0.0f);
+  size_t i = 0;
+  for (; i + lanes<V>() <= n; i += lanes<V>()) {
+    acc += exp_poly<V, VI>(load<V>(x + i) - shift_v);
+  }
+  if (i < n) {
+    const auto tail =
+        load_partial<V>(x + i, n - i, -std::numeric_limits<float>::infinity());
+    acc += exp_poly<V, VI>(tail - shift_v);
+  }
+  return horizontal_sum(acc);
+}
+
+template <typename V, typename VI>
+KERNEL_INLINE void vector_log_softmax(const float *x, size_t n, float *out) {
+  const auto max = vector_max<V, VI>(x, n);
+  const auto lse = max + std::log(vector_sum_exp<V, VI>(x, n, max));
+  const auto lse_v = broadcast<V>(lse);
+  size_t i = 0;
+  for (; i + lanes<V>() <= n; i += lanes<V>()) {
+    store(out + i, load<V>(x + i) - lse_v);
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] - lse;
+  }
+}
+
+#define DEFINE_KERNELS(suffix, isa, V, VI)                                     \
+  __attribute__((target(isa))) float max_##suffix(const float *x, size_t n) { \
+    return vector_max<V, VI>(x, n);                                            \
+  }                                                                            \
+  __attribute__((target(isa))) size_t argmax_##suffix(const float *x,         \
+                                                      size_t n) {              \
+    return vector_argmax<V, VI>(x, n);                                         \
+  }                                                                            \
+  __attribute__((target(isa))) size_t select_above_##suffix(                   \
+      const float *x, size_t n, float threshold, uint32_t *out) {              \
+    return vector_select_above<V, VI>(x, n, threshold, out);                   \
+  }                                                                            \
+  __attribute__((target(isa))) float sum_exp_##suffix(                         \
+      const float *x, size_t n, float shift) {                                 \
+    return vector_sum_exp<V, VI>(x, n, shift);                                 \
+  }                                                                            \
+  __attribute__((target(isa))) void log_softmax_##suffix(                      \
+      const float *x, size_t n, float *out) {                                  \
+    vector_log_softmax<V, VI>(x, n, out);                                      \
+  }
+
+DEFINE_KERNELS(sse4, "sse4.1", v4sf, v4si)
+DEFINE_KERNELS(avx2, "avx2,fma", v8sf, v8si)
+DEFINE_KERNELS(avx512, "avx512f", v16sf, v16si)
+
+#undef DEFINE_KERNELS
+#undef KERNEL_INLINE
+
+// The conversions use intrinsics, the vector extensions have no widening
+// loads. fp16 needs F16C below avx512f, sse4.1 keeps the scalar one.
+__attribute__((target("sse4.1"))) void
+bfloat16_to_float_sse4(const uint16_t *x, size_t n, float *out) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const auto raw = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(x + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                     _mm_slli_epi32(_mm_cvtepu16_epi32(raw), 16));
+  }
+  scalar_bfloat16_to_float(x + i, n - i, out + i);
+}
+
+__attribute__((target("avx2,fma,f16c"))) void
+half_to_float_avx2(const uint16_t *x, size_t n, float *out) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128(
+                                  reinterpret_cast<const __m128i *>(x + i))));
+  }
+  scalar_half_to_float(x + i, n - i, out + i);
+}
+
+__attribute__((target("avx2,fma"))) void
+bfloat16_to_float_avx2(const uint16_t *x, size_t n, float *out) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const auto raw = _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i),
+                        _mm256_slli_epi32(_mm256_cvtepu16_epi32(raw), 16));
+  }
+  scalar_bfloat16_to_float(x + i, n - i, out + i);
+}
+
+__attribute__((target("avx512f"))) void
+half_to_float_avx512(const uint16_t *x, size_t n, float *out) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm512_storeu_ps(out + i, _mm512_cvtph_ps(_mm256_loadu_si256(
+                                  reinterpret_cast<const __m256i *>(x + i))));
+  }
+  scalar_half_to_float(x + i, n - i, out + i);
+}
+
+__attribute__((target("avx512f"))) void
+bfloat16_to_float_avx512(const uint16_t *x, size_t n, float *out) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const auto raw =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i));
+    _mm512_storeu_si512(out + i,
+                        _mm512_slli_epi32(_mm512_cvtepu16_epi32(raw), 16));
+  }
+  scalar_bfloat16_to_float(x + i, n - i, out + i);
+}
+
+#endif
+
+bool cpu_supports(SimdLevel level) {
+#ifdef PYCTCDECODE_X86_KERNELS
+  switch (level) {
+  case SimdLevel::SCALAR:
+    return true;
+  case SimdLevel::SSE4:
+    return __builtin_cpu_supports("sse4.1");
+  case SimdLevel::AVX2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+           __builtin_cpu_supports("f16c");
+  case SimdLevel::AVX512:
+    return __builtin_cpu_supports("avx512f");
+  }
+  return false;
+#else
+  return level == SimdLevel::SCALAR;
+#endif
+}
+
+} // namespace
+
+std::array<float, LOG_ADD_TABLE_SIZE> make_log_add_table() {
+  std::array<float, LOG_ADD_TABLE_SIZE> table{};
+  for (size_t i = 0; i < table.size(); ++i) {
+    const double d = static_cast<double>(i) / LOG_ADD_STEPS_PER_UNIT;
+    table[i] = static_cast<float>(std::log1p(std::exp(-d)));
+  }
+  return table;
+}
+
+const char *simd_level_name(SimdLevel level) {
+  switch (level) {
+  case SimdLevel::SCALAR:
+    return "scalar";
+  case SimdLevel::SSE4:
+    return "sse4.1";
+  case SimdLevel::AVX2:
+    return "avx2";
+  case SimdLevel::AVX512:
+    return "avx512f";
+  }
+  return "unknown";
+}
+
+SimdLevel detect_simd_level() {
+  for (auto level : {SimdLevel::AVX512, SimdLevel::AVX2, SimdLevel::SSE4}) {
+    if (cpu_supports(level)) {
+      return level;
+    }
+  }
+  return SimdLevel::SCALAR;
+}
+
+const Kernels &simd_kernels(SimdLevel level) {
+  static const Kernels scalar{SimdLevel::SCALAR, scalar_max, scalar_argmax,
+                              scalar_select_above, scalar_sum_exp,
+                              scalar_log_softmax, scalar_half_to_float,
+                              scalar_bfloat16_to_float};
+  if (!cpu_supports(level)) {
+    throw std::runtime_error(std::string("CPU does not support ") +
+                             simd_level_name(level) + " kernels");
+  }
+#ifdef PYCTCDECODE_X86_KERNELS
+  static const Kernels sse4{SimdLevel::SSE4, max_sse4, argmax_sse4,
+                            select_above_sse4, sum_exp_sse4,
+                            log_softmax_sse4, scalar_half_to_float,
+                            bfloat16_to_float_sse4};
+  static const Kernels avx2{SimdLevel::AVX2, max_avx2, argmax_avx2,
+                            select_above_avx2, sum_exp_avx2,
+                            log_softmax_avx2, half_to_float_avx2,
+                            bfloat16_to_float_avx2};
+  static const Kernels avx512{SimdLevel::AVX512, max_avx512, argmax_avx512,
+                              select_above_avx512, sum_exp_avx512,
+                              log_softmax_avx512, half_to_float_avx512,
+                              bfloat16_to_float_avx512};
+  switch (level) {
+  case SimdLevel::SSE4:
+    return sse4;
+  case SimdLevel::AVX2:
+    return avx2;
+  case SimdLevel::AVX512:
+    return avx512;
+  default:
+    break;
+  }
+#endif
+  return scalar;
+}
+
+const Kernels &simd_kernels() {
+  static const Kernels &best = simd_kernels(detect_simd_level());
+  return best;
+}
+
+float log_sum_exp(const float *x, size_t n) {
+  const auto &kernels = simd_kernels();
+  const auto max = kernels.max(x, n);
+  if (max == -std::numeric_limits<float>::infinity()) {
+    return max;
+  }
+  return max + std::log(kernels.sum_exp(x, n, max));
+}
+
+} // namespace pyctcdecode
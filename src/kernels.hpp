@@ -0,0 +1,90 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace pyctcdecode {
+
+// Instruction sets the vectorized kernels are built for, in increasing order
+enum class SimdLevel { SCALAR, SSE4, AVX2, AVX512 };
+
+const char *simd_level_name(SimdLevel level);
+// Best level the running cpu supports
+SimdLevel detect_simd_level();
+
+// One build of the vectorized kernels. Results agree across levels up to
+// float rounding, decoders pick theirs once at construction.
+struct Kernels {
+  SimdLevel level;
+  // max of n floats, -inf when n is 0
+  float (*max)(const float *x, size_t n);
+  // first index holding the max, n > 0
+  size_t (*argmax)(const float *x, size_t n);
+  // indices i with x[i] >= threshold in increasing order, out holds up to n,
+  // returns how many were written
+  size_t (*select_above)(const float *x, size_t n, float threshold,
+                         uint32_t *out);
+  // sum(exp(x - shift)) over n floats, exp is a polynomial with a relative
+  // error of a few ulp
+  float (*sum_exp)(const float *x, size_t n, float shift);
+  // out = x - log(sum(exp(x))), out may alias x
+  void (*log_softmax)(const float *x, size_t n, float *out);
+  // n IEEE fp16 bit patterns widened to float, exact
+  void (*half_to_float)(const uint16_t *x, size_t n, float *out);
+  // n bf16 bit patterns widened to float, exact
+  void (*bfloat16_to_float)(const uint16_t *x, size_t n, float *out);
+};
+
+// Kernels for a level, throws when the cpu does not support it
+const Kernels &simd_kernels(SimdLevel level);
+// Kernels for the best supported level, picked once
+const Kernels &simd_kernels();
+
+// log(sum(exp(x))) over n floats
+float log_sum_exp(const float *x, size_t n);
+
+// log1p(exp(-d)) sampled on [0, LOG_ADD_RANGE], beyond it the term is below
+// float resolution of the larger score
+constexpr float LOG_ADD_RANGE = 16.0;
+constexpr int LOG_ADD_STEPS_PER_UNIT = 256;
+// one sample past the range for the interpolation, one more as d just below
+// the range can round up to the last index
+constexpr size_t LOG_ADD_TABLE_SIZE =
+    static_cast<size_t>(LOG_ADD_RANGE) * LOG_ADD_STEPS_PER_UNIT + 2;
+// Absolute error of the interpolated log1p(exp(-d)) term: the linear
+// interpolation bound of the table (|f''| <= 1/4) plus its float rounding.
+// Adding the term to the larger score rounds once more at half an ulp of
+// the result, which dominates for typical beam scores (about 7.6e-6 at 100)
+const float LOG_ADD_MAX_ERROR = 1e-6;
+
+std::array<float, LOG_ADD_TABLE_SIZE> make_log_add_table();
+// Sampled log1p(exp(-d)), built on first use
+inline const std::array<float, LOG_ADD_TABLE_SIZE> &log_add_table() {
+  static const auto table = make_log_add_table();
+  return table;
+}
+
+// Approximate log(exp(a) + exp(b)) without libm calls, absolute error below
+// LOG_ADD_MAX_ERROR plus half an ulp of the result
+inline float log_add(float a, float b) {
+  const auto hi = std::max(a, b);
+  const auto lo = std::min(a, b);
+  const auto d = hi - lo;
+  if (!(d < LOG_ADD_RANGE)) {
+    // also covers -inf operands, where d is inf or nan
+    return lo == -std::numeric_limits<float>::infinity() ||
+                   d >= LOG_ADD_RANGE
+               ? hi
+               : hi + std::log1p(std::exp(-d));
+  }
+  const auto pos = d * LOG_ADD_STEPS_PER_UNIT;
+  const auto idx = static_cast<int>(pos);
+  const auto frac = pos - idx;
+  const auto &table = log_add_table();
+  return hi + table[idx] + frac * (table[idx + 1] - table[idx]);
+}
+
+} // namespace pyctcdecode
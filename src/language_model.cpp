@@ -7,11 +7,14 @@
 #include <boost/range/adaptor/reversed.hpp>
 #include <cstddef>
 #include <cstdio>
+#include <istream>
 #include <iterator>
 #include <limits>
 #include <lm/state.hh>
 #include <memory>
+#include <ostream>
 #include <regex>
+#include <stdexcept>
 #include <string>
 #include <type_traits>
 #include <utility>
@@ -29,9 +32,10 @@ HotWordScorer::HotWordScorer(std::regex match_ptn,
       weight_(weight) {}
 
 float HotWordScorer::score(const std::string &text) const {
-  std::smatch matches;
-  std::regex_search(text, matches, match_ptn_);
-  return matches.size() * weight_;
+  const auto n_matches = std::distance(
+      std::sregex_iterator(text.begin(), text.end(), match_ptn_),
+      std::sregex_iterator());
+  return n_matches * weight_;
 }
 
 float HotWordScorer::score_partial_token(const std::string &text) const {
@@ -76,10 +80,12 @@ HotWordScorer::build_scorer(const std::unordered_set<std::string> &hotwords,
     }
     std::transform(hotword_unigrams.begin(), hotword_unigrams.end(),
                    hotword_unigrams.begin(), [](std::string &item) {
-                     return R"((?<!\S))" + item + R"((?!\S))";
+                     // ECMAScript has no lookbehind, the leading boundary is
+                     // matched instead
+                     return R"((?:^|\s))" + item + R"((?!\S))";
                    });
     std::regex match_ptn(boost::join(hotword_unigrams, "|"));
-    return std::make_shared<HotWordScorer>(match_ptn, char_trie);
+    return std::make_shared<HotWordScorer>(match_ptn, char_trie, weight);
   }
   return std::make_shared<HotWordScorer>(std::regex(R"(^\b$)"),
                                          tsl::htrie_set<char>());
@@ -175,4 +181,36 @@ ScoreResult LanguageModel::score(AbstractLMStatePtr &prev_state_,
   lm_score = alpha_ * lm_score * LOG_BASE_CHANGE_FACTOR + beta_;
   return std::make_pair(lm_score, std::make_shared<KenlmState>(end_state));
 }
+
+void LanguageModel::save_state(const AbstractLMStatePtr &state_,
+                               std::ostream &os) const {
+  const auto state = std::dynamic_pointer_cast<KenlmState>(state_);
+  if (!state) {
+    throw std::runtime_error("LanguageModel::save_state expects a KenlmState");
+  }
+  const auto &kenlm_state = *state->state();
+  const auto length = kenlm_state.length;
+  os.write(reinterpret_cast<const char *>(&length), sizeof(length));
+  os.write(reinterpret_cast<const char *>(kenlm_state.words),
+           length * sizeof(lm::WordIndex));
+  os.write(reinterpret_cast<const char *>(kenlm_state.backoff),
+           length * sizeof(float));
+}
+
+AbstractLMStatePtr LanguageModel::load_state(std::istream &is) const {
+  auto state = std::make_shared<kenlm_state>();
+  is.read(reinterpret_cast<char *>(&state->length), sizeof(state->length));
+  if (!is || state->length > KENLM_MAX_ORDER - 1) {
+    throw std::runtime_error("LanguageModel::load_state invalid state");
+  }
+  is.read(reinterpret_cast<char *>(state->words),
+          state->length * sizeof(lm::WordIndex));
+  is.read(reinterpret_cast<char *>(state->backoff),
+          state->length * sizeof(float));
+  if (!is) {
+    throw std::runtime_error("LanguageModel::load_state truncated state");
+  }
+  state->ZeroRemaining();
+  return std::make_shared<KenlmState>(state);
+}
 } // namespace pyctcdecode
\ No newline at end of file
@@ -2,10 +2,13 @@
 #include "constants.hpp"
 #include "lm/model.hh"
 #include "tsl/htrie_set.h"
+#include <istream>
 #include <lm/state.hh>
 #include <memory>
 #include <optional>
+#include <ostream>
 #include <regex>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -68,6 +71,14 @@ public:
   virtual ScoreResult score(AbstractLMStatePtr &prev_state,
                             const std::string &word,
                             bool is_last_word = false) const = 0;
+  virtual void save_state(const AbstractLMStatePtr &, std::ostream &) const {
+    throw std::runtime_error(
+        "AbstractLanguageModel::save_state not implemented");
+  }
+  virtual AbstractLMStatePtr load_state(std::istream &) const {
+    throw std::runtime_error(
+        "AbstractLanguageModel::load_state not implemented");
+  }
 };
 
 using AbstractLanguageModelPtr = std::shared_ptr<AbstractLanguageModel>;
@@ -86,6 +97,10 @@ public:
   float score_partial_token(const std::string &) const override;
   ScoreResult score(AbstractLMStatePtr &prev_state, const std::string &word,
                     bool is_last_word = false) const override;
+  // kenlm states are written by value: length, words and backoffs
+  void save_state(const AbstractLMStatePtr &state,
+                  std::ostream &os) const override;
+  AbstractLMStatePtr load_state(std::istream &is) const override;
 
 private:
   float get_raw_end_score(std::shared_ptr<kenlm_state> &start_state) const;
@@ -0,0 +1,75 @@
+#include "lexicon.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+namespace pyctcdecode {
+
+Lexicon::Lexicon(std::vector<std::string> words) {
+  for (const auto &word : words) {
+    if (word.empty() || word.find(' ') != std::string::npos) {
+      throw std::runtime_error("Lexicon words must be non-empty and contain "
+                               "no spaces, got [" +
+                               word + "]");
+    }
+  }
+  std::sort(words.begin(), words.end());
+  words.erase(std::unique(words.begin(), words.end()), words.end());
+  n_words_ = words.size();
+  add_node(words, 0, words.size(), 0);
+}
+
+// words[begin, end) share their first depth bytes and sort bytewise
+Lexicon::Node Lexicon::add_node(const std::vector<std::string> &words,
+                                size_t begin, size_t end, size_t depth) {
+  const Node node = nodes_.size();
+  nodes_.push_back({0, 0, false});
+  if (begin < end && words[begin].size() == depth) {
+    nodes_[node].is_word = true;
+    begin++;
+  }
+  std::vector<std::pair<size_t, size_t>> children;
+  for (auto i = begin; i < end;) {
+    auto j = i + 1;
+    while (j < end && words[j][depth] == words[i][depth]) {
+      j++;
+    }
+    children.emplace_back(i, j);
+    i = j;
+  }
+  const uint32_t first_edge = edge_chars_.size();
+  nodes_[node].first_edge = first_edge;
+  nodes_[node].n_edges = children.size();
+  for (const auto &[child_begin, child_end] : children) {
+    edge_chars_.push_back(words[child_begin][depth]);
+    edge_targets_.push_back(NO_NODE);
+  }
+  for (size_t c = 0; c < children.size(); c++) {
+    edge_targets_[first_edge + c] =
+        add_node(words, children[c].first, children[c].second, depth + 1);
+  }
+  return node;
+}
+
+Lexicon::Node Lexicon::step(Node node, const std::string &chars) const {
+  for (const unsigned char c : chars) {
+    if (node == NO_NODE) {
+      break;
+    }
+    const auto &edges = nodes_[node];
+    const auto first = edge_chars_.begin() + edges.first_edge;
+    const auto last = first + edges.n_edges;
+    const auto it = std::lower_bound(first, last, c);
+    node = it != last && *it == c ? edge_targets_[it - edge_chars_.begin()]
+                                  : NO_NODE;
+  }
+  return node;
+}
+
+LexiconPtr
+Lexicon::build_lexicon(const std::unordered_set<std::string> &words) {
+  return std::make_shared<const Lexicon>(
+      std::vector<std::string>(words.begin(), words.end()));
+}
+
+} // namespace pyctcdecode
@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace pyctcdecode {
+
+class Lexicon;
+using LexiconPtr = std::shared_ptr<const Lexicon>;
+
+// Closed vocabulary compiled into a byte trie. Nodes are laid out depth first
+// in flat arrays and the edges of a node are contiguous and sorted, so a step
+// is a binary search over at most 256 bytes.
+class Lexicon {
+public:
+  using Node = uint32_t;
+  static constexpr Node ROOT = 0;
+  // returned once a walk leaves the trie
+  static constexpr Node NO_NODE = std::numeric_limits<Node>::max();
+
+private:
+  struct NodeEdges {
+    uint32_t first_edge;
+    uint32_t n_edges;
+    bool is_word;
+  };
+  std::vector<NodeEdges> nodes_;
+  std::vector<unsigned char> edge_chars_;
+  std::vector<Node> edge_targets_;
+  size_t n_words_;
+
+  Node add_node(const std::vector<std::string> &words, size_t begin,
+                size_t end, size_t depth);
+
+public:
+  explicit Lexicon(std::vector<std::string> words);
+
+  // node reached from node by the bytes of chars, NO_NODE when it leaves
+  Node step(Node node, const std::string &chars) const;
+  bool is_word(Node node) const {
+    return node != NO_NODE && nodes_[node].is_word;
+  }
+  // whether some word starts with prefix, the empty prefix included
+  bool is_prefix(const std::string &prefix) const {
+    return step(ROOT, prefix) != NO_NODE;
+  }
+  bool contains(const std::string &word) const {
+    return is_word(step(ROOT, word));
+  }
+  size_t size() const { return n_words_; }
+  size_t n_nodes() const { return nodes_.size(); }
+
+  static LexiconPtr build_lexicon(const std::unordered_set<std::string> &words);
+};
+
+} // namespace pyctcdecode
@@ -0,0 +1,456 @@
+#include "logits_archive.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+
+namespace {
+const uint32_t ARCHIVE_MAGIC = 0x4c435443; // "CTCL"
+const uint32_t ARCHIVE_VERSION = 1;
+const size_t ARCHIVE_ALIGNMENT = 64;
+
+const uint32_t ZIP_LOCAL_HEADER = 0x04034b50;
+const uint32_t ZIP_CENTRAL_HEADER = 0x02014b50;
+const uint32_t ZIP_END_OF_DIRECTORY = 0x06054b50;
+const uint32_t ZIP64_END_OF_DIRECTORY = 0x06064b50;
+const uint32_t ZIP64_LOCATOR = 0x07064b50;
+const uint16_t ZIP64_EXTRA_FIELD = 0x0001;
+
+size_t dtype_size(pyctcdecode::LogitsDType dtype) {
+  return dtype == pyctcdecode::LogitsDType::FLOAT32 ? 4 : 2;
+}
+
+// Whether an n_frames x n_vocab array of dtype fits in available bytes,
+// checked without computing the possibly overflowing byte count
+bool shape_fits(uint64_t n_frames, uint64_t n_vocab,
+                pyctcdecode::LogitsDType dtype, size_t available) {
+  const auto value_size = dtype_size(dtype);
+  return n_vocab <= available / value_size &&
+         n_frames <= available / value_size / n_vocab;
+}
+
+template <typename T>
+T read_at(const pyctcdecode::MappedFile &file, size_t offset) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  if (offset > file.size() || sizeof(T) > file.size() - offset) {
+    throw std::runtime_error("Truncated logits file");
+  }
+  T value;
+  std::memcpy(&value, file.data() + offset, sizeof(T));
+  return value;
+}
+
+std::string read_string_at(const pyctcdecode::MappedFile &file, size_t offset,
+                           size_t length) {
+  if (offset > file.size() || length > file.size() - offset) {
+    throw std::runtime_error("Truncated logits file");
+  }
+  return std::string(file.data() + offset, length);
+}
+
+// Point entry at an aligned copy of its data if the mapped bytes are not
+// aligned to the element type, as for an npz member that follows a zip
+// header. Reading floats through a misaligned pointer is undefined
+void align_entry(pyctcdecode::LogitsEntry &entry) {
+  if (reinterpret_cast<uintptr_t>(entry.data) % dtype_size(entry.dtype) == 0) {
+    return;
+  }
+  const auto n_bytes = entry.n_bytes();
+  auto copy = std::make_shared<std::vector<float>>(
+      (n_bytes + sizeof(float) - 1) / sizeof(float));
+  std::memcpy(copy->data(), entry.data, n_bytes);
+  entry.data = reinterpret_cast<const char *>(copy->data());
+  entry.copy = std::move(copy);
+}
+
+template <typename T> void write_value(std::ostream &os, const T &value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  os.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+size_t align_up(size_t offset) {
+  return (offset + ARCHIVE_ALIGNMENT - 1) / ARCHIVE_ALIGNMENT *
+         ARCHIVE_ALIGNMENT;
+}
+
+// Value of key in a .npy header, a python dict literal such as
+// {'descr': '<f4', 'fortran_order': False, 'shape': (13, 8), }
+std::string npy_header_value(const std::string &header,
+                             const std::string &key) {
+  const auto key_pos = header.find("'" + key + "'");
+  const auto colon = header.find(':', key_pos);
+  auto begin = header.find_first_not_of(' ', colon + 1);
+  if (key_pos == std::string::npos || colon == std::string::npos ||
+      begin == std::string::npos) {
+    throw std::runtime_error("Malformed npy header, missing " + key);
+  }
+  auto end = std::string::npos;
+  if (header.at(begin) == '\'') {
+    begin++;
+    end = header.find('\'', begin);
+  } else if (header.at(begin) == '(') {
+    begin++;
+    end = header.find(')', begin);
+  } else {
+    end = header.find_first_of(",}", begin);
+  }
+  if (end == std::string::npos) {
+    throw std::runtime_error("Malformed npy header value for " + key);
+  }
+  return header.substr(begin, end - begin);
+}
+} // namespace
+
+namespace pyctcdecode {
+
+size_t LogitsEntry::n_bytes() const {
+  if (n_frames <= 0 || n_vocab <= 0 ||
+      !shape_fits(n_frames, n_vocab, dtype,
+                  std::numeric_limits<size_t>::max())) {
+    throw std::runtime_error("Invalid logits shape for " + name);
+  }
+  return static_cast<size_t>(n_frames) * n_vocab * dtype_size(dtype);
+}
+
+MappedFile::MappedFile(const std::filesystem::path &path)
+    : data_(nullptr), size_(0) {
+  const auto fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Cannot open " + path.string() + ": " +
+                             std::strerror(errno));
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    ::close(fd);
+    throw std::runtime_error("Cannot stat " + path.string());
+  }
+  size_ = st.st_size;
+  if (size_ > 0) {
+    auto *mapped = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      ::close(fd);
+      throw std::runtime_error("Cannot map " + path.string() + ": " +
+                               std::strerror(errno));
+    }
+    data_ = static_cast<const char *>(mapped);
+    // entries are decoded front to back
+    ::madvise(mapped, size_, MADV_SEQUENTIAL);
+  }
+  ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    ::munmap(const_cast<char *>(data_), size_);
+  }
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)),
+      size_(std::exchange(other.size_, 0)) {}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+  if (this != &other) {
+    if (data_ != nullptr) {
+      ::munmap(const_cast<char *>(data_), size_);
+    }
+    data_ = std::exchange(other.data_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+  }
+  return *this;
+}
+
+void MappedFile::will_need(size_t offset, size_t length) const {
+  if (data_ == nullptr || offset >= size_) {
+    return;
+  }
+  // madvise wants a page aligned start, the hint is best effort
+  const size_t page = ::sysconf(_SC_PAGESIZE);
+  const auto begin = offset / page * page;
+  const auto end = std::min(size_, offset + length);
+  ::madvise(const_cast<char *>(data_) + begin, end - begin, MADV_WILLNEED);
+}
+
+LogitsArchive::LogitsArchive(MappedFile &&file) : file_(std::move(file)) {}
+
+LogitsArchive LogitsArchive::open(const std::filesystem::path &path) {
+  LogitsArchive archive(MappedFile{path});
+  const auto extension = path.extension();
+  if (extension == ".npy") {
+    archive.entries_.push_back(
+        archive.read_npy(path.stem().string(), 0, archive.file_.size()));
+  } else if (extension == ".npz") {
+    archive.read_npz();
+  } else {
+    archive.read_ctcl();
+  }
+  return archive;
+}
+
+void LogitsArchive::prefetch(size_t idx) const {
+  const auto &entry = entries_.at(idx);
+  if (entry.copy) {
+    return;
+  }
+  file_.will_need(entry.data - file_.data(), entry.n_bytes());
+}
+
+void LogitsArchive::read_ctcl() {
+  if (read_at<uint32_t>(file_, 0) != ARCHIVE_MAGIC) {
+    throw std::runtime_error("Not a logits archive");
+  }
+  if (read_at<uint32_t>(file_, 4) != ARCHIVE_VERSION) {
+    throw std::runtime_error("Unsupported logits archive version");
+  }
+  const auto n_entries = read_at<uint64_t>(file_, 8);
+  size_t pos = 16;
+  for (uint64_t i = 0; i < n_entries; i++) {
+    const auto offset = read_at<uint64_t>(file_, pos);
+    const auto n_frames = read_at<uint64_t>(file_, pos + 8);
+    const auto n_vocab = read_at<uint64_t>(file_, pos + 16);
+    const auto dtype = read_at<uint32_t>(file_, pos + 24);
+    const auto name_length = read_at<uint32_t>(file_, pos + 28);
+    if (dtype > static_cast<uint32_t>(LogitsDType::BFLOAT16)) {
+      throw std::runtime_error("Unknown dtype in logits archive");
+    }
+    auto name = read_string_at(file_, pos + 32, name_length);
+    if (n_frames == 0 || n_vocab == 0) {
+      throw std::runtime_error("Empty logits archive entry " + name);
+    }
+    if (offset > file_.size() ||
+        !shape_fits(n_frames, n_vocab, static_cast<LogitsDType>(dtype),
+                    file_.size() - offset)) {
+      throw std::runtime_error("Truncated logits archive entry " + name);
+    }
+    LogitsEntry entry{std::move(name),
+                      static_cast<LogitsDType>(dtype),
+                      static_cast<Eigen::Index>(n_frames),
+                      static_cast<Eigen::Index>(n_vocab),
+                      true,
+                      file_.data() + offset,
+                      nullptr};
+    // archives written by write are 64 byte aligned, foreign ones may not be
+    align_entry(entry);
+    entries_.push_back(std::move(entry));
+    pos += 32 + name_length;
+  }
+}
+
+LogitsEntry LogitsArchive::read_npy(const std::string &name, size_t offset,
+                                    size_t size) const {
+  if (read_string_at(file_, offset, 6) != "\x93NUMPY") {
+    throw std::runtime_error(name + " is not an npy array");
+  }
+  // version 1 has a 2 byte header length, later versions 4 bytes
+  const auto major = read_at<uint8_t>(file_, offset + 6);
+  const size_t header_length = major == 1
+                                   ? read_at<uint16_t>(file_, offset + 8)
+                                   : read_at<uint32_t>(file_, offset + 8);
+  const size_t header_start = major == 1 ? 10 : 12;
+  const auto header =
+      read_string_at(file_, offset + header_start, header_length);
+
+  const auto descr = npy_header_value(header, "descr");
+  LogitsDType dtype;
+  if (descr == "<f4") {
+    dtype = LogitsDType::FLOAT32;
+  } else if (descr == "<f2") {
+    dtype = LogitsDType::FLOAT16;
+  } else {
+    throw std::runtime_error("Unsupported npy dtype " + descr + " in " +
+                             name + ", expected <f4 or <f2");
+  }
+  std::vector<Eigen::Index> shape;
+  std::stringstream dims(npy_header_value(header, "shape"));
+  std::string dim;
+  while (std::getline(dims, dim, ',')) {
+    if (dim.find_first_not_of(' ') != std::string::npos) {
+      shape.push_back(std::stoll(dim));
+    }
+  }
+  if (shape.size() != 2) {
+    throw std::runtime_error("Expected a frames x vocab array in " + name);
+  }
+  if (shape.at(0) <= 0 || shape.at(1) <= 0) {
+    throw std::runtime_error("Empty npy array " + name);
+  }
+  const auto data_offset = header_start + header_length;
+  if (data_offset > size ||
+      !shape_fits(shape.at(0), shape.at(1), dtype, size - data_offset)) {
+    throw std::runtime_error("Truncated npy array " + name);
+  }
+  LogitsEntry entry{name,
+                    dtype,
+                    shape.at(0),
+                    shape.at(1),
+                    npy_header_value(header, "fortran_order") != "True",
+                    file_.data() + offset + data_offset,
+                    nullptr};
+  align_entry(entry);
+  return entry;
+}
+
+void LogitsArchive::read_npz() {
+  // the end of central directory record sits in the last 64k of the file
+  const size_t min_record = 22;
+  if (file_.size() < min_record) {
+    throw std::runtime_error("Not an npz archive");
+  }
+  auto eocd = file_.size() - min_record;
+  const auto search_end =
+      file_.size() > 0xffff + min_record ? file_.size() - 0xffff - min_record
+                                         : 0;
+  while (read_at<uint32_t>(file_, eocd) != ZIP_END_OF_DIRECTORY) {
+    if (eocd == search_end) {
+      throw std::runtime_error("Not an npz archive");
+    }
+    eocd--;
+  }
+  uint64_t n_entries = read_at<uint16_t>(file_, eocd + 10);
+  uint64_t directory = read_at<uint32_t>(file_, eocd + 16);
+  if (eocd >= 20 && read_at<uint32_t>(file_, eocd - 20) == ZIP64_LOCATOR) {
+    const auto eocd64 = read_at<uint64_t>(file_, eocd - 20 + 8);
+    if (read_at<uint32_t>(file_, eocd64) != ZIP64_END_OF_DIRECTORY) {
+      throw std::runtime_error("Malformed zip64 npz archive");
+    }
+    n_entries = read_at<uint64_t>(file_, eocd64 + 32);
+    directory = read_at<uint64_t>(file_, eocd64 + 48);
+  }
+
+  auto pos = directory;
+  for (uint64_t i = 0; i < n_entries; i++) {
+    if (read_at<uint32_t>(file_, pos) != ZIP_CENTRAL_HEADER) {
+      throw std::runtime_error("Malformed npz central directory");
+    }
+    const auto method = read_at<uint16_t>(file_, pos + 10);
+    uint64_t size = read_at<uint32_t>(file_, pos + 24);
+    const auto name_length = read_at<uint16_t>(file_, pos + 28);
+    const auto extra_length = read_at<uint16_t>(file_, pos + 30);
+    const auto comment_length = read_at<uint16_t>(file_, pos + 32);
+    uint64_t local_header = read_at<uint32_t>(file_, pos + 42);
+    auto name = read_string_at(file_, pos + 46, name_length);
+    // zip64 sizes and offsets replace the 32 bit fields set to 0xffffffff
+    const auto extra = pos + 46 + name_length;
+    for (size_t field = extra; field + 4 <= extra + extra_length;) {
+      const auto id = read_at<uint16_t>(file_, field);
+      const auto field_length = read_at<uint16_t>(file_, field + 2);
+      if (id == ZIP64_EXTRA_FIELD) {
+        auto value = field + 4;
+        if (size == 0xffffffff) {
+          size = read_at<uint64_t>(file_, value);
+          value += 8;
+        }
+        if (read_at<uint32_t>(file_, pos + 20) == 0xffffffff) {
+          value += 8;
+        }
+        if (local_header == 0xffffffff) {
+          local_header = read_at<uint64_t>(file_, value);
+        }
+      }
+      field += 4 + field_length;
+    }
+    if (method != 0) {
+      throw std::runtime_error("Compressed npz member " + name +
+                               " cannot be mapped, save with np.savez");
+    }
+    if (read_at<uint32_t>(file_, local_header) != ZIP_LOCAL_HEADER) {
+      throw std::runtime_error("Malformed npz member " + name);
+    }
+    const auto data = local_header + 30 +
+                      read_at<uint16_t>(file_, local_header + 26) +
+                      read_at<uint16_t>(file_, local_header + 28);
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".npy") == 0) {
+      name.resize(name.size() - 4);
+    }
+    if (data > file_.size() || size > file_.size() - data) {
+      throw std::runtime_error("Truncated npz member " + name);
+    }
+    entries_.push_back(read_npy(name, data, size));
+    pos += 46 + name_length + extra_length + comment_length;
+  }
+}
+
+template <typename Scalar>
+void LogitsArchive::write(
+    const std::filesystem::path &path,
+    const std::vector<std::pair<std::string, LogitsViewT<Scalar>>> &logits) {
+  std::ofstream os(path, std::ios::binary);
+  if (!os) {
+    throw std::runtime_error("Cannot write " + path.string());
+  }
+  size_t offset = 16;
+  for (const auto &[name, view] : logits) {
+    offset += 32 + name.size();
+  }
+  write_value<uint32_t>(os, ARCHIVE_MAGIC);
+  write_value<uint32_t>(os, ARCHIVE_VERSION);
+  write_value<uint64_t>(os, logits.size());
+  std::vector<size_t> offsets;
+  for (const auto &[name, view] : logits) {
+    offset = align_up(offset);
+    offsets.push_back(offset);
+    write_value<uint64_t>(os, offset);
+    write_value<uint64_t>(os, view.rows());
+    write_value<uint64_t>(os, view.cols());
+    write_value<uint32_t>(os, static_cast<uint32_t>(logits_dtype<Scalar>()));
+    write_value<uint32_t>(os, name.size());
+    os.write(name.data(), name.size());
+    offset += view.size() * sizeof(Scalar);
+  }
+  Eigen::Matrix<Scalar, 1, Eigen::Dynamic> frame;
+  for (size_t i = 0; i < logits.size(); i++) {
+    const auto &view = logits.at(i).second;
+    const std::string padding(offsets.at(i) - os.tellp(), '\0');
+    os.write(padding.data(), padding.size());
+    for (Eigen::Index t = 0; t < view.rows(); t++) {
+      frame = view.row(t);
+      os.write(reinterpret_cast<const char *>(frame.data()),
+               frame.size() * sizeof(Scalar));
+    }
+  }
+  if (!os) {
+    throw std::runtime_error("Failed writing " + path.string());
+  }
+}
+
+template void LogitsArchive::write<float>(
+    const std::filesystem::path &,
+    const std::vector<std::pair<std::string, LogitsView>> &);
+template void LogitsArchive::write<Eigen::half>(
+    const std::filesystem::path &,
+    const std::vector<std::pair<std::string, HalfLogitsView>> &);
+template void LogitsArchive::write<Eigen::bfloat16>(
+    const std::filesystem::path &,
+    const std::vector<std::pair<std::string, BFloat16LogitsView>> &);
+
+std::vector<OutputBeam>
+decode_entry(const BeamSearchDecoderCTC &decoder, const LogitsEntry &entry,
+             int beam_width, float beam_prune_logp, float token_min_logp,
+             bool prune_history,
+             const std::unordered_set<std::string> &hotwords,
+             float hotword_weight) {
+  switch (entry.dtype) {
+  case LogitsDType::FLOAT16:
+    return decoder.decode_beams(entry.view<Eigen::half>(), beam_width,
+                                beam_prune_logp, token_min_logp, prune_history,
+                                hotwords, hotword_weight);
+  case LogitsDType::BFLOAT16:
+    return decoder.decode_beams(entry.view<Eigen::bfloat16>(), beam_width,
+                                beam_prune_logp, token_min_logp, prune_history,
+                                hotwords, hotword_weight);
+  default:
+    return decoder.decode_beams(entry.view<float>(), beam_width,
+                                beam_prune_logp, token_min_logp, prune_history,
+                                hotwords, hotword_weight);
+  }
+}
+
+} // namespace pyctcdecode
@@ -0,0 +1,119 @@
+#pragma once
+#include "Eigen/Eigen"
+#include "constants.hpp"
+#include "decoder.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace pyctcdecode {
+
+enum class LogitsDType : uint32_t { FLOAT32 = 0, FLOAT16 = 1, BFLOAT16 = 2 };
+
+template <typename Scalar> constexpr LogitsDType logits_dtype();
+template <> constexpr LogitsDType logits_dtype<float>() {
+  return LogitsDType::FLOAT32;
+}
+template <> constexpr LogitsDType logits_dtype<Eigen::half>() {
+  return LogitsDType::FLOAT16;
+}
+template <> constexpr LogitsDType logits_dtype<Eigen::bfloat16>() {
+  return LogitsDType::BFLOAT16;
+}
+
+// One utterance inside a mapped file, data points into the mapping or, when
+// the file stores it misaligned for its element type, into copy
+struct LogitsEntry {
+  std::string name;
+  LogitsDType dtype;
+  Eigen::Index n_frames;
+  Eigen::Index n_vocab;
+  bool row_major;
+  const char *data;
+  std::shared_ptr<const std::vector<float>> copy;
+
+  template <typename Scalar> LogitsViewT<Scalar> view() const {
+    if (dtype != logits_dtype<Scalar>()) {
+      throw std::runtime_error("Logits entry " + name +
+                               " has a different element type");
+    }
+    return logits_view(reinterpret_cast<const Scalar *>(data), n_frames,
+                       n_vocab, row_major);
+  }
+  // throws for an empty shape or one whose size overflows
+  size_t n_bytes() const;
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+private:
+  const char *data_;
+  size_t size_;
+
+public:
+  explicit MappedFile(const std::filesystem::path &path);
+  ~MappedFile();
+  MappedFile(MappedFile &&other) noexcept;
+  MappedFile &operator=(MappedFile &&other) noexcept;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+  // Ask the kernel to start reading [offset, offset + length) in the
+  // background
+  void will_need(size_t offset, size_t length) const;
+};
+
+// Saved logits for offline decoding, mapped rather than read so entries are
+// decoded straight from the page cache. Reads
+//  - .ctcl archives: header, an index of name / offset / frames / vocab /
+//    dtype per utterance, then 64 byte aligned row major data
+//  - .npy files holding one 2-D float32 or float16 array
+//  - .npz files whose members are stored uncompressed (np.savez), a member
+//    the zip layout leaves misaligned is copied once on open
+class LogitsArchive {
+private:
+  MappedFile file_;
+  std::vector<LogitsEntry> entries_;
+
+  explicit LogitsArchive(MappedFile &&file);
+  void read_ctcl();
+  void read_npz();
+  LogitsEntry read_npy(const std::string &name, size_t offset,
+                       size_t size) const;
+
+public:
+  // Format is picked by extension
+  static LogitsArchive open(const std::filesystem::path &path);
+
+  size_t size() const { return entries_.size(); }
+  const LogitsEntry &at(size_t idx) const { return entries_.at(idx); }
+  const std::vector<LogitsEntry> &entries() const { return entries_; }
+  // Readahead hint for an entry, e.g. the next one while the current one
+  // decodes
+  void prefetch(size_t idx) const;
+
+  template <typename Scalar>
+  static void
+  write(const std::filesystem::path &path,
+        const std::vector<std::pair<std::string, LogitsViewT<Scalar>>> &logits);
+};
+
+// Decode an entry of any element type
+std::vector<OutputBeam>
+decode_entry(const BeamSearchDecoderCTC &decoder, const LogitsEntry &entry,
+             int beam_width = DEFAULT_BEAM_WIDTH,
+             float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+             float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+             bool prune_history = DEFAULT_PRUNE_BEAMS,
+             const std::unordered_set<std::string> &hotwords = {},
+             float hotword_weight = DEFAULT_HOTWORD_WEIGHT);
+
+} // namespace pyctcdecode
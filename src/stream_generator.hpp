@@ -0,0 +1,192 @@
+#pragma once
+// C++20 coroutine front end for StreamingSession, only available to
+// translation units built with coroutine support. The library itself stays
+// C++17, everything here is inline.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include "Eigen/Eigen"
+#include "decoder.hpp"
+#include "streaming.hpp"
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace pyctcdecode {
+
+struct InterimHypothesis {
+  // words committed since the previous hypothesis
+  std::vector<WordFrames> committed_words;
+  // best beam's uncommitted text
+  std::string partial_text;
+  int processed_frames;
+  bool is_final;
+};
+
+// Chunks handed from a feeder to a suspended stream. push() and close()
+// resume the stream inline, so they must be called from the thread that
+// drives the consumer, e.g. an event loop multiplexing many streams.
+class FrameFeed {
+private:
+  std::deque<Eigen::MatrixXf> chunks_;
+  bool closed_ = false;
+  std::coroutine_handle<> waiting_;
+
+  void resume_waiting() {
+    if (waiting_) {
+      std::exchange(waiting_, nullptr).resume();
+    }
+  }
+
+public:
+  void push(Eigen::MatrixXf chunk) {
+    chunks_.push_back(std::move(chunk));
+    resume_waiting();
+  }
+  void close() {
+    closed_ = true;
+    resume_waiting();
+  }
+
+  // Awaitable for the next chunk, nullopt once the feed is closed and drained
+  auto next() {
+    struct Awaiter {
+      FrameFeed &feed;
+      bool await_ready() const {
+        return !feed.chunks_.empty() || feed.closed_;
+      }
+      void await_suspend(std::coroutine_handle<> handle) {
+        feed.waiting_ = handle;
+      }
+      std::optional<Eigen::MatrixXf> await_resume() {
+        if (feed.chunks_.empty()) {
+          return std::nullopt;
+        }
+        auto chunk = std::move(feed.chunks_.front());
+        feed.chunks_.pop_front();
+        return chunk;
+      }
+    };
+    return Awaiter{*this};
+  }
+};
+
+// Lazy generator of interim hypotheses. co_await next() runs the stream until
+// it yields and returns nullopt after the final hypothesis.
+class InterimStream {
+public:
+  struct promise_type {
+    std::optional<InterimHypothesis> current;
+    std::coroutine_handle<> consumer;
+    std::exception_ptr error;
+
+    // hand control straight back to the coroutine awaiting next()
+    struct ToConsumer {
+      bool await_ready() const noexcept { return false; }
+      std::coroutine_handle<>
+      await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+        return handle.promise().consumer;
+      }
+      void await_resume() const noexcept {}
+    };
+
+    InterimStream get_return_object() {
+      return InterimStream(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    ToConsumer final_suspend() noexcept { return {}; }
+    ToConsumer yield_value(InterimHypothesis &&hypothesis) {
+      current = std::move(hypothesis);
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() { error = std::current_exception(); }
+  };
+
+private:
+  std::coroutine_handle<promise_type> handle_;
+
+  explicit InterimStream(std::coroutine_handle<promise_type> handle)
+      : handle_(handle) {}
+
+public:
+  InterimStream(InterimStream &&other) noexcept
+      : handle_(std::exchange(other.handle_, nullptr)) {}
+  InterimStream &operator=(InterimStream &&other) noexcept {
+    if (this != &other) {
+      if (handle_) {
+        handle_.destroy();
+      }
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+  InterimStream(const InterimStream &) = delete;
+  InterimStream &operator=(const InterimStream &) = delete;
+  ~InterimStream() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  bool done() const { return !handle_ || handle_.done(); }
+
+  auto next() {
+    struct Awaiter {
+      std::coroutine_handle<promise_type> stream;
+      bool await_ready() const { return !stream || stream.done(); }
+      std::coroutine_handle<>
+      await_suspend(std::coroutine_handle<> consumer) {
+        stream.promise().consumer = consumer;
+        stream.promise().current.reset();
+        return stream;
+      }
+      std::optional<InterimHypothesis> await_resume() {
+        if (!stream) {
+          return std::nullopt;
+        }
+        if (stream.promise().error) {
+          std::rethrow_exception(std::exchange(stream.promise().error, {}));
+        }
+        return std::exchange(stream.promise().current, std::nullopt);
+      }
+    };
+    return Awaiter{handle_};
+  }
+};
+
+// Decode the chunks of feed with session, yielding after every chunk and once
+// more with is_final after the feed is closed. session and feed must outlive
+// the returned stream.
+inline InterimStream stream_decode(StreamingSession &session,
+                                   FrameFeed &feed) {
+  const auto partial_text = [&session]() {
+    if (session.beams().empty()) {
+      return std::string();
+    }
+    const auto &best = session.beams().front();
+    if (best.text_.empty() || best.partial_word_.empty()) {
+      return best.text_ + best.partial_word_;
+    }
+    return best.text_ + " " + best.partial_word_;
+  };
+  // NB: hypotheses are named locals, gcc 12 mishandles the lifetime of
+  // temporaries inside co_yield expressions
+  while (auto chunk = co_await feed.next()) {
+    InterimHypothesis interim{session.push(*chunk), partial_text(),
+                              session.processed_frames(), false};
+    co_yield std::move(interim);
+  }
+  const auto output_beams = session.finalize();
+  InterimHypothesis final_interim{
+      output_beams.empty() ? std::vector<WordFrames>()
+                           : output_beams.front().text_frames,
+      "", session.processed_frames(), true};
+  co_yield std::move(final_interim);
+}
+
+} // namespace pyctcdecode
+#endif
@@ -0,0 +1,455 @@
+#include "streaming.hpp"
+#include "decoder.hpp"
+#include "language_model.hpp"
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <limits>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace {
+std::vector<std::string> split_words(const std::string &text) {
+  std::vector<std::string> words;
+  if (!text.empty()) {
+    boost::split(words, text, boost::is_any_of(" "));
+  }
+  return words;
+}
+
+const uint32_t SNAPSHOT_MAGIC = 0x53435443; // "CTCS"
+const uint32_t SNAPSHOT_VERSION = 2;
+
+template <typename T> void write_value(std::ostream &os, const T &value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  os.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> T read_value(std::istream &is) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  T value;
+  is.read(reinterpret_cast<char *>(&value), sizeof(T));
+  if (!is) {
+    throw std::runtime_error("StreamingSession::restore truncated snapshot");
+  }
+  return value;
+}
+
+void write_string(std::ostream &os, const std::string &value) {
+  write_value<uint32_t>(os, value.size());
+  os.write(value.data(), value.size());
+}
+
+// Bytes between the read position and the end of a seekable stream, the
+// maximum for streams that cannot seek
+size_t bytes_left(std::istream &is) {
+  const auto pos = is.tellg();
+  if (pos < 0 || !is.seekg(0, std::ios::end)) {
+    is.clear();
+    return std::numeric_limits<size_t>::max();
+  }
+  const auto end = is.tellg();
+  is.seekg(pos);
+  return static_cast<size_t>(end - pos);
+}
+
+// Number of items that follows, each taking at least min_item_bytes, checked
+// against what is left of the stream before anything is allocated for them
+uint32_t read_count(std::istream &is, size_t min_item_bytes) {
+  const auto count = read_value<uint32_t>(is);
+  if (count > bytes_left(is) / min_item_bytes) {
+    throw std::runtime_error("StreamingSession::restore truncated snapshot");
+  }
+  return count;
+}
+
+std::string read_string(std::istream &is) {
+  // grown in bounded steps so a corrupt length on a stream that cannot
+  // seek fails at its end rather than allocating up front
+  const size_t max_step = 1 << 16;
+  auto length = read_count(is, 1);
+  std::string value;
+  while (length > 0) {
+    const auto step = std::min<size_t>(length, max_step);
+    const auto size = value.size();
+    value.resize(size + step);
+    is.read(value.data() + size, step);
+    if (!is) {
+      throw std::runtime_error("StreamingSession::restore truncated snapshot");
+    }
+    length -= step;
+  }
+  return value;
+}
+
+void write_frames(std::ostream &os, const pyctcdecode::Frames &frames) {
+  write_value<int32_t>(os, frames.first);
+  write_value<int32_t>(os, frames.second);
+}
+
+pyctcdecode::Frames read_frames(std::istream &is) {
+  const auto first = read_value<int32_t>(is);
+  return {first, read_value<int32_t>(is)};
+}
+} // namespace
+
+namespace pyctcdecode {
+
+StreamingSession::StreamingSession(
+    const BeamSearchDecoderCTC &decoder, int beam_width,
+    float beam_prune_logp, float token_min_logp, bool prune_history,
+    const std::unordered_set<std::string> &hotwords, float hotword_weight,
+    std::optional<AbstractLMStatePtr> lm_start_state)
+    : decoder_(decoder),
+      ctx_{beam_width, beam_prune_logp, token_min_logp, prune_history,
+           HotWordScorer::build_scorer(hotwords, hotword_weight)},
+      lm_start_state_(std::move(lm_start_state)),
+      endpoint_blank_frames_(DEFAULT_ENDPOINT_BLANK_FRAMES),
+      endpoint_blank_logp_(DEFAULT_ENDPOINT_BLANK_LOGP), blank_run_(0) {
+  for (const auto &[idx, token] : decoder_.idx2vocab_) {
+    if (token == "") {
+      blank_idx_ = idx;
+    } else if (token == " ") {
+      space_idx_ = idx;
+    }
+  }
+  decoder_.init_decode_state(ctx_, lm_start_state_);
+}
+
+void StreamingSession::set_endpointing(int min_blank_frames,
+                                       float min_blank_logp) {
+  endpoint_blank_frames_ = min_blank_frames;
+  endpoint_blank_logp_ = min_blank_logp;
+  blank_run_ = 0;
+}
+
+std::vector<WordFrames> StreamingSession::push(const Eigen::MatrixXf &logits) {
+  decoder_.check_logits_dimension(logits);
+  auto &log_probs = ctx_.log_probs;
+  log_probs = logits;
+  decoder_.normalize_logits(log_probs);
+  newly_committed_.clear();
+  if (endpoint_blank_frames_ <= 0) {
+    decode_frames(logits_view(log_probs));
+  } else {
+    // decode up to the end of every long enough blank run and check whether
+    // it closes a segment
+    Eigen::Index start = 0;
+    for (Eigen::Index t = 0; t < log_probs.rows(); t++) {
+      const bool is_blank =
+          (blank_idx_.has_value() &&
+           log_probs(t, blank_idx_.value()) >= endpoint_blank_logp_) ||
+          (space_idx_.has_value() &&
+           log_probs(t, space_idx_.value()) >= endpoint_blank_logp_);
+      blank_run_ = is_blank ? blank_run_ + 1 : 0;
+      if (blank_run_ >= endpoint_blank_frames_) {
+        decode_frames(
+            logits_view(log_probs.middleRows(start, t + 1 - start)));
+        start = t + 1;
+        if (is_endpoint()) {
+          finalize_segment();
+          endpoints_.push_back(ctx_.processed_frames);
+        }
+        blank_run_ = 0;
+      }
+    }
+    decode_frames(
+        logits_view(log_probs.bottomRows(log_probs.rows() - start)));
+  }
+  commit_stable_prefix();
+  return std::move(newly_committed_);
+}
+
+void StreamingSession::commit(const std::vector<WordFrames> &words) {
+  newly_committed_.insert(newly_committed_.end(), words.cbegin(),
+                          words.cend());
+  if (keep_committed_words_) {
+    committed_words_.insert(committed_words_.end(), words.cbegin(),
+                            words.cend());
+  }
+}
+
+void StreamingSession::decode_frames(const LogitsView &log_probs) {
+  if (log_probs.rows() == 0) {
+    return;
+  }
+  decoder_.partial_decode_logits(log_probs, ctx_);
+}
+
+bool StreamingSession::is_endpoint() const {
+  if (ctx_.beams.empty()) {
+    return false;
+  }
+  const auto &best_beam = ctx_.beams.front();
+  return !best_beam.text_.empty() || !best_beam.partial_word_.empty();
+}
+
+std::vector<OutputBeam> StreamingSession::finalize() {
+  auto output_beams = finalize_segment();
+  // the caller gets these words through the best beam, push() must not
+  // hand them out again
+  newly_committed_.clear();
+  return output_beams;
+}
+
+std::vector<OutputBeam> StreamingSession::finalize_segment() {
+  const auto trimmed_beams = decoder_.finalize_beams(ctx_, true, true);
+  auto output_beams =
+      decoder_.get_output_beams(trimmed_beams, ctx_.cached_lm_scores);
+  if (!output_beams.empty()) {
+    commit(output_beams.front().text_frames);
+  }
+  // start a new segment from the start state, dropping the per-segment caches
+  decoder_.init_decode_state(ctx_, lm_start_state_);
+  blank_run_ = 0;
+  return output_beams;
+}
+
+void StreamingSession::commit_stable_prefix() {
+  auto &beams = ctx_.beams;
+  std::vector<WordFrames> newly_committed;
+  if (beams.empty()) {
+    return;
+  }
+  // keep enough history uncommitted so that prune_history hashes and the
+  // lm context of every beam are unaffected by the trimming
+  const auto min_n_history = (size_t)std::max(1, decoder_.lm_order() - 1);
+  std::vector<std::vector<std::string>> beam_words;
+  beam_words.reserve(beams.size());
+  auto n_common = std::numeric_limits<size_t>::max();
+  for (const auto &beam : beams) {
+    beam_words.push_back(split_words(beam.text_));
+    const auto &words = beam_words.back();
+    if (words.size() <= min_n_history) {
+      return;
+    }
+    const auto &first_words = beam_words.front();
+    const auto mismatch = std::mismatch(
+        first_words.cbegin(),
+        first_words.cbegin() + std::min(first_words.size(), words.size()),
+        words.cbegin());
+    n_common = std::min({n_common,
+                         (size_t)(mismatch.first - first_words.cbegin()),
+                         words.size() - min_n_history});
+  }
+  if (n_common == 0) {
+    return;
+  }
+
+  const auto &first_words = beam_words.front();
+  const auto &first_frames = beams.front().text_frames_;
+  for (size_t i = 0; i < n_common; i++) {
+    newly_committed.emplace_back(
+        first_words.at(i),
+        i < first_frames.size() ? first_frames.at(i) : Frames{-1, -1});
+  }
+  const auto prefix = boost::algorithm::join(
+      std::vector<std::string>(first_words.cbegin(),
+                               first_words.cbegin() + n_common),
+      " ");
+
+  for (size_t b = 0; b < beams.size(); b++) {
+    auto &beam = beams.at(b);
+    const auto &words = beam_words.at(b);
+    beam.text_ = boost::algorithm::join(
+        std::vector<std::string>(words.cbegin() + n_common, words.cend()),
+        " ");
+    beam.text_frames_.erase(
+        beam.text_frames_.begin(),
+        beam.text_frames_.begin() +
+            std::min(n_common, beam.text_frames_.size()));
+  }
+
+  // re-key the lm cache relative to the committed prefix, entries of beams
+  // that did not survive are dropped. The hotword bonus of each entry is
+  // rescored on the trimmed text, as new entries are, so beams hitting the
+  // cache and beams extending it rank alike.
+  LMScoreCache trimmed_cache;
+  const auto &hotword_scorer = ctx_.hotword_scorer;
+  for (auto &[key, value] : ctx_.cached_lm_scores) {
+    const auto &text = key.first;
+    std::string trimmed_text;
+    if (text == prefix) {
+      trimmed_text = "";
+    } else if (text.size() > prefix.size() &&
+               text.compare(0, prefix.size(), prefix) == 0 &&
+               text.at(prefix.size()) == ' ') {
+      trimmed_text = text.substr(prefix.size() + 1);
+    } else {
+      continue;
+    }
+    auto &[lm_hw_score, raw_lm_score, lm_state] = value;
+    lm_hw_score = raw_lm_score + hotword_scorer->score(trimmed_text);
+    trimmed_cache.emplace(std::make_pair(std::move(trimmed_text), key.second),
+                          std::move(value));
+  }
+  ctx_.cached_lm_scores = std::move(trimmed_cache);
+
+  commit(newly_committed);
+}
+
+void StreamingSession::save(std::ostream &os) const {
+  write_value(os, SNAPSHOT_MAGIC);
+  write_value(os, SNAPSHOT_VERSION);
+  write_value<int32_t>(os, ctx_.beam_width);
+  write_value(os, ctx_.beam_prune_logp);
+  write_value(os, ctx_.token_min_logp);
+  write_value<uint8_t>(os, ctx_.prune_history);
+  write_value<int32_t>(os, ctx_.processed_frames);
+  write_value<int32_t>(os, endpoint_blank_frames_);
+  write_value(os, endpoint_blank_logp_);
+  write_value<int32_t>(os, blank_run_);
+  write_value<uint32_t>(os, endpoints_.size());
+  for (const auto endpoint : endpoints_) {
+    write_value<int32_t>(os, endpoint);
+  }
+  write_value<uint8_t>(os, keep_committed_words_);
+  write_value<uint32_t>(os, committed_words_.size());
+  for (const auto &[word, frames] : committed_words_) {
+    write_string(os, word);
+    write_frames(os, frames);
+  }
+
+  write_value<uint32_t>(os, ctx_.beams.size());
+  for (const auto &beam : ctx_.beams) {
+    write_string(os, beam.text_);
+    write_string(os, beam.next_word_);
+    write_string(os, beam.partial_word_);
+    write_value<uint8_t>(os, beam.last_char_.has_value());
+    if (beam.last_char_.has_value()) {
+      write_string(os, beam.last_char_.value());
+    }
+    write_value<uint32_t>(os, beam.text_frames_.size());
+    for (const auto &frames : beam.text_frames_) {
+      write_frames(os, frames);
+    }
+    write_frames(os, beam.partial_frames_);
+    write_value(os, beam.logit_score_);
+    write_value<uint8_t>(os, beam.piece_ends_word_);
+  }
+
+  // only the lm states reachable from live beams are needed to resume,
+  // partial token scores are recomputed on demand
+  const auto &language_model = decoder_.language_model_;
+  std::vector<LMScoreCache::const_iterator> live_entries;
+  if (language_model) {
+    std::unordered_set<std::string> seen_texts;
+    for (const auto &beam : ctx_.beams) {
+      const auto it =
+          ctx_.cached_lm_scores.find(std::make_pair(beam.text_, false));
+      if (it != ctx_.cached_lm_scores.end() &&
+          seen_texts.insert(beam.text_).second) {
+        live_entries.push_back(it);
+      }
+    }
+  }
+  write_value<uint32_t>(os, live_entries.size());
+  for (const auto &it : live_entries) {
+    const auto &[lm_hw_score, raw_lm_score, lm_state] = it->second;
+    write_string(os, it->first.first);
+    write_value(os, lm_hw_score);
+    write_value(os, raw_lm_score);
+    language_model->save_state(lm_state, os);
+  }
+}
+
+void StreamingSession::restore(std::istream &is) {
+  // everything is decoded into locals first so a corrupt snapshot leaves the
+  // session untouched
+  if (read_value<uint32_t>(is) != SNAPSHOT_MAGIC) {
+    throw std::runtime_error("StreamingSession::restore bad snapshot magic");
+  }
+  if (read_value<uint32_t>(is) != SNAPSHOT_VERSION) {
+    throw std::runtime_error("StreamingSession::restore unsupported version");
+  }
+  const auto beam_width = read_value<int32_t>(is);
+  const auto beam_prune_logp = read_value<float>(is);
+  const auto token_min_logp = read_value<float>(is);
+  const bool prune_history = read_value<uint8_t>(is);
+  const auto processed_frames = read_value<int32_t>(is);
+  const auto endpoint_blank_frames = read_value<int32_t>(is);
+  const auto endpoint_blank_logp = read_value<float>(is);
+  const auto blank_run = read_value<int32_t>(is);
+  std::vector<int> endpoints;
+  const auto n_endpoints = read_count(is, sizeof(int32_t));
+  for (uint32_t i = 0; i < n_endpoints; i++) {
+    endpoints.push_back(read_value<int32_t>(is));
+  }
+  const bool keep_committed_words = read_value<uint8_t>(is);
+  std::vector<WordFrames> committed_words;
+  const auto n_committed = read_count(is, sizeof(uint32_t) + sizeof(Frames));
+  for (uint32_t i = 0; i < n_committed; i++) {
+    auto word = read_string(is);
+    committed_words.emplace_back(std::move(word), read_frames(is));
+  }
+
+  std::vector<Beam> beams;
+  // three string lengths, the last char flag, the frame count, the partial
+  // frames, the score and the word break flag
+  const size_t min_beam_bytes = 3 * sizeof(uint32_t) + 1 + sizeof(uint32_t) +
+                                sizeof(Frames) + sizeof(float) + 1;
+  const auto n_beams = read_count(is, min_beam_bytes);
+  for (uint32_t i = 0; i < n_beams; i++) {
+    auto text = read_string(is);
+    auto next_word = read_string(is);
+    auto partial_word = read_string(is);
+    std::optional<std::string> last_char;
+    if (read_value<uint8_t>(is)) {
+      last_char = read_string(is);
+    }
+    std::vector<Frames> text_frames;
+    const auto n_frames = read_count(is, sizeof(Frames));
+    for (uint32_t j = 0; j < n_frames; j++) {
+      text_frames.push_back(read_frames(is));
+    }
+    const auto partial_frames = read_frames(is);
+    Beam beam{std::move(text),        std::move(next_word),
+              std::move(partial_word), std::move(last_char),
+              std::move(text_frames), partial_frames,
+              read_value<float>(is)};
+    beam.piece_ends_word_ = read_value<uint8_t>(is);
+    beams.push_back(std::move(beam));
+  }
+
+  LMScoreCache cached_lm_scores;
+  const auto n_entries =
+      read_count(is, sizeof(uint32_t) + 2 * sizeof(float));
+  const auto &language_model = decoder_.language_model_;
+  if (n_entries > 0 && !language_model) {
+    throw std::runtime_error(
+        "StreamingSession::restore snapshot has lm states but the decoder "
+        "has no language model");
+  }
+  for (uint32_t i = 0; i < n_entries; i++) {
+    auto text = read_string(is);
+    const auto lm_hw_score = read_value<float>(is);
+    const auto raw_lm_score = read_value<float>(is);
+    cached_lm_scores[std::make_pair(std::move(text), false)] =
+        std::make_tuple(lm_hw_score, raw_lm_score,
+                        language_model->load_state(is));
+  }
+
+  ctx_.beam_width = beam_width;
+  ctx_.beam_prune_logp = beam_prune_logp;
+  ctx_.token_min_logp = token_min_logp;
+  ctx_.prune_history = prune_history;
+  ctx_.processed_frames = processed_frames;
+  ctx_.beams = std::move(beams);
+  ctx_.cached_lm_scores = std::move(cached_lm_scores);
+  ctx_.cached_p_lm_scores.clear();
+  endpoint_blank_frames_ = endpoint_blank_frames;
+  endpoint_blank_logp_ = endpoint_blank_logp;
+  blank_run_ = blank_run;
+  endpoints_ = std::move(endpoints);
+  keep_committed_words_ = keep_committed_words;
+  committed_words_ = std::move(committed_words);
+}
+
+} // namespace pyctcdecode
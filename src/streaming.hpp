@@ -0,0 +1,89 @@
+#pragma once
+#include "Eigen/Eigen"
+#include "constants.hpp"
+#include "decoder.hpp"
+#include "language_model.hpp"
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace pyctcdecode {
+
+// Incremental decoding of a stream of logits chunks.
+// Words shared by every live beam are committed as final and dropped from the
+// beam state, so per-frame cost does not grow with the length of the stream.
+// With endpointing enabled, a run of confident blank or space frames after
+// speech finalizes the segment and restarts the search from the start state.
+// Committed words are handed to the caller and only kept in the session when
+// asked to, so memory and snapshot size stay bounded on an always-on stream.
+class StreamingSession {
+private:
+  const BeamSearchDecoderCTC &decoder_;
+  DecodeContext ctx_;
+  // every segment starts from it, <s> when nullopt
+  std::optional<AbstractLMStatePtr> lm_start_state_;
+  bool keep_committed_words_ = false;
+  std::vector<WordFrames> committed_words_;
+  // words committed since the current push started
+  std::vector<WordFrames> newly_committed_;
+
+  int endpoint_blank_frames_;
+  float endpoint_blank_logp_;
+  int blank_run_;
+  std::optional<size_t> blank_idx_;
+  std::optional<size_t> space_idx_;
+  std::vector<int> endpoints_;
+
+  void decode_frames(const LogitsView &log_probs);
+  bool is_endpoint() const;
+  void commit_stable_prefix();
+  void commit(const std::vector<WordFrames> &words);
+  std::vector<OutputBeam> finalize_segment();
+
+public:
+  StreamingSession(
+      const BeamSearchDecoderCTC &decoder, int beam_width = DEFAULT_BEAM_WIDTH,
+      float beam_prune_logp = DEFAULT_PRUNE_LOGP,
+      float token_min_logp = DEFAULT_MIN_TOKEN_LOGP,
+      bool prune_history = DEFAULT_PRUNE_BEAMS,
+      const std::unordered_set<std::string> &hotwords = {},
+      float hotword_weight = DEFAULT_HOTWORD_WEIGHT,
+      std::optional<AbstractLMStatePtr> lm_start_state = std::nullopt);
+
+  // Decode the next chunk of frames, returns the words committed by this call
+  std::vector<WordFrames> push(const Eigen::MatrixXf &logits);
+  // Flush the remaining beams and start a new segment from the start state,
+  // <s> unless lm_start_state was given. Returns the final beams, best first.
+  // The words of the best one not yet returned by push() are in its
+  // text_frames, they are committed and only also kept in committed_words()
+  // after set_keep_committed_words(true).
+  std::vector<OutputBeam> finalize();
+  // Finalize a segment once min_blank_frames consecutive frames have a blank
+  // or space log probability of at least min_blank_logp, 0 disables
+  void set_endpointing(int min_blank_frames = DEFAULT_ENDPOINT_BLANK_FRAMES,
+                       float min_blank_logp = DEFAULT_ENDPOINT_BLANK_LOGP);
+
+  // Keep every committed word in committed_words(), off by default
+  void set_keep_committed_words(bool keep) { keep_committed_words_ = keep; }
+
+  // Binary snapshot of the search state for migrating a live stream.
+  // restore() expects a session built on the same decoder, hotwords and
+  // lm_start_state.
+  void save(std::ostream &os) const;
+  void restore(std::istream &is);
+
+  const std::vector<Beam> &beams() const { return ctx_.beams; }
+  // empty unless set_keep_committed_words(true)
+  const std::vector<WordFrames> &committed_words() const {
+    return committed_words_;
+  }
+  int processed_frames() const { return ctx_.processed_frames; }
+  // frame indices at which endpointing finalized a segment
+  const std::vector<int> &endpoints() const { return endpoints_; }
+};
+
+} // namespace pyctcdecode
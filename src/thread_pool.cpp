@@ -0,0 +1,124 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace pyctcdecode {
+
+namespace {
+// pool whose job the current thread is running
+thread_local const ThreadPool *current_pool = nullptr;
+} // namespace
+
+ThreadPool::ThreadPool(size_t num_threads)
+    : generation_(0), stop_(false) {
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (size_t i = 0; i < num_threads; i++) {
+    queues_.push_back(std::make_unique<WorkerQueue>());
+  }
+  for (size_t i = 0; i < num_threads; i++) {
+    threads_.emplace_back([this, i]() { worker_loop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::parallel_for(size_t n,
+                              const std::function<void(size_t)> &fn) {
+  if (n == 0) {
+    return;
+  }
+  if (current_pool == this) {
+    for (size_t i = 0; i < n; i++) {
+      fn(i);
+    }
+    return;
+  }
+  Job job{&fn, n, nullptr};
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < n; i++) {
+    auto &queue = *queues_.at(i % queues_.size());
+    std::lock_guard<std::mutex> queue_lock(queue.mutex);
+    queue.items.emplace_back(&job, i);
+  }
+  generation_++;
+  work_cv_.notify_all();
+  done_cv_.wait(lock, [&job]() { return job.pending == 0; });
+  if (job.error) {
+    std::rethrow_exception(job.error);
+  }
+}
+
+bool ThreadPool::pop_item(size_t worker_idx, WorkItem &item) {
+  {
+    auto &queue = *queues_.at(worker_idx);
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.items.empty()) {
+      item = queue.items.front();
+      queue.items.pop_front();
+      return true;
+    }
+  }
+  for (size_t offset = 1; offset < queues_.size(); offset++) {
+    auto &queue = *queues_.at((worker_idx + offset) % queues_.size());
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.items.empty()) {
+      item = queue.items.back();
+      queue.items.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::worker_loop(size_t worker_idx) {
+  current_pool = this;
+  size_t seen_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this, &seen_generation]() {
+        return stop_ || generation_ != seen_generation;
+      });
+      if (stop_) {
+        return;
+      }
+      seen_generation = generation_;
+    }
+    WorkItem item;
+    while (pop_item(worker_idx, item)) {
+      auto &[job, idx] = item;
+      std::exception_ptr error;
+      try {
+        (*job->fn)(idx);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (error && !job->error) {
+        job->error = error;
+      }
+      // the caller may return and destroy job as soon as pending hits 0
+      if (--job->pending == 0) {
+        done_cv_.notify_all();
+      }
+    }
+  }
+}
+
+} // namespace pyctcdecode
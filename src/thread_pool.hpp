@@ -0,0 +1,66 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace pyctcdecode {
+
+class ThreadPool;
+using ThreadPoolPtr = std::shared_ptr<ThreadPool>;
+
+// Fixed set of worker threads with one task queue per worker.
+// Workers drain their own queue from the front and steal from the back of the
+// other queues once it is empty. Several parallel_for calls can share the
+// workers at once, each item carries the job it belongs to.
+class ThreadPool {
+private:
+  // one parallel_for call, pending and error are guarded by mutex_
+  struct Job {
+    const std::function<void(size_t)> *fn;
+    size_t pending;
+    std::exception_ptr error;
+  };
+  using WorkItem = std::pair<Job *, size_t>;
+
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<WorkItem> items;
+  };
+
+  std::vector<std::thread> threads_;
+  std::vector<std::unique_ptr<WorkerQueue>> queues_;
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  size_t generation_;
+  bool stop_;
+
+  void worker_loop(size_t worker_idx);
+  bool pop_item(size_t worker_idx, WorkItem &item);
+
+public:
+  explicit ThreadPool(size_t num_threads = 0);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  size_t size() const { return threads_.size(); }
+  // Call fn(i) for every i in [0, n) and block until all calls returned.
+  // Indices are dealt round robin in increasing order, so each worker starts
+  // with the lowest indices it was given. The first exception is rethrown.
+  // Calls from other threads run at the same time, their items queued
+  // behind the ones already waiting. A call from inside a job of this pool
+  // runs fn serially on the calling worker, as waiting for the pool there
+  // would deadlock.
+  void parallel_for(size_t n, const std::function<void(size_t)> &fn);
+};
+
+} // namespace pyctcdecode
@@ -0,0 +1,123 @@
+#include "alphabet.hpp"
+#include "constants.hpp"
+#include "decoder.hpp"
+#include <Eigen/Eigen>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Decoding speed on large random inputs, e.g. a 5k token BPE-sized vocab.
+// usage: benchmark [frames] [vocab] [repeats]
+
+namespace {
+double time_ms(const std::function<void()> &fn, int repeats) {
+  const auto start = std::chrono::steady_clock::now();
+  for (auto i = 0; i < repeats; i++) {
+    fn();
+  }
+  const std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / repeats;
+}
+
+// the per-frame work the search does before expanding beams
+float scan_frames(const pyctcdecode::LogitsView &logits) {
+  float total = 0.0;
+  for (Eigen::Index t = 0; t < logits.rows(); t++) {
+    const Eigen::RowVectorXf frame = logits.row(t);
+    const auto max_logit = frame.maxCoeff();
+    total += max_logit + std::log((frame.array() - max_logit).exp().sum());
+  }
+  return total;
+}
+
+// acoustic models emit one frame per 20 ms of audio
+const double FRAME_MS = 20.0;
+
+void print_search(const char *name, double ms,
+                  const pyctcdecode::DecodeStats &stats) {
+  printf("%s %8.2f ms, rtf %.4f, mean active beams %6.2f\n", name, ms,
+         ms / (stats.frames * FRAME_MS), stats.mean_active_beams());
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  const auto n_frames = argc > 1 ? std::atoi(argv[1]) : 2000;
+  const auto n_vocab = argc > 2 ? std::atoi(argv[2]) : 5000;
+  const auto repeats = argc > 3 ? std::atoi(argv[3]) : 3;
+
+  pyctcdecode::Labels labels{"", " "};
+  for (auto i = 2; i < n_vocab; i++) {
+    labels.push_back(std::string(1, 'a' + i % 26) + std::to_string(i));
+  }
+  const auto decoder = std::make_shared<const pyctcdecode::BeamSearchDecoderCTC>(
+      pyctcdecode::Alphabet::build_alphabet(labels));
+
+  std::srand(0);
+  const Eigen::MatrixXf col_major =
+      Eigen::MatrixXf::Random(n_frames, n_vocab) * 5.0f;
+  const pyctcdecode::RowMajorMatrixXf row_major = col_major;
+  const auto col_view = pyctcdecode::logits_view(col_major);
+  const auto row_view = pyctcdecode::logits_view(row_major);
+  const Eigen::Matrix<Eigen::half, Eigen::Dynamic, Eigen::Dynamic,
+                      Eigen::RowMajor>
+      half = row_major.cast<Eigen::half>();
+
+  printf("%d frames x %d tokens, mean of %d runs\n", n_frames, n_vocab,
+         repeats);
+  volatile float sink = 0.0;
+  printf("frame scan, column major (strided):   %8.2f ms\n",
+         time_ms([&]() { sink = scan_frames(col_view); }, repeats));
+  printf("frame scan, row major (contiguous):   %8.2f ms\n",
+         time_ms([&]() { sink = scan_frames(row_view); }, repeats));
+  printf("decode_beams, column major input:     %8.2f ms\n",
+         time_ms([&]() { decoder->decode_beams(col_view); }, repeats));
+  printf("decode_beams, row major input:        %8.2f ms\n",
+         time_ms([&]() { decoder->decode_beams(row_view); }, repeats));
+  printf("decode_beams, fp16 row major input:   %8.2f ms\n",
+         time_ms([&]() {
+           decoder->decode_beams(pyctcdecode::logits_view(half));
+         }, repeats));
+  printf("decode_greedy, row major input:       %8.2f ms\n",
+         time_ms([&]() { decoder->decode_greedy(row_view); }, repeats));
+
+  // model-like posteriors: nine frames in ten have one clear winner, mostly
+  // the blank, the rest split their mass over a few tokens
+  pyctcdecode::RowMajorMatrixXf peaked = row_major;
+  for (auto t = 0; t < n_frames; t++) {
+    if (t % 10 != 0) {
+      peaked(t, t % 3 == 0 ? std::rand() % n_vocab : 0) += 20.0f;
+    } else {
+      for (auto k = 0; k < 4; k++) {
+        peaked(t, std::rand() % n_vocab) += 18.0f;
+      }
+    }
+  }
+  const auto peaked_view = pyctcdecode::logits_view(peaked);
+  const auto search = [&](const pyctcdecode::AdaptiveBeam &adaptive_beam,
+                          pyctcdecode::DecodeStats &stats) {
+    return time_ms(
+        [&]() {
+          decoder->decode_beams_adaptive(
+              peaked_view, adaptive_beam, pyctcdecode::DEFAULT_BEAM_WIDTH,
+              pyctcdecode::DEFAULT_PRUNE_LOGP,
+              pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+              pyctcdecode::DEFAULT_PRUNE_BEAMS, {},
+              pyctcdecode::DEFAULT_HOTWORD_WEIGHT, std::nullopt, &stats);
+        },
+        repeats);
+  };
+  pyctcdecode::DecodeStats stats{};
+  auto ms = search({pyctcdecode::DEFAULT_BEAM_WIDTH, 0.0, 1.0}, stats);
+  print_search("peaked input, fixed beam width:     ", ms, stats);
+  ms = search({}, stats);
+  print_search("peaked input, adaptive beam width:  ", ms, stats);
+  printf("peaked input, prefix search:         %8.2f ms\n",
+         time_ms([&]() { decoder->decode_beams_prefix(peaked_view); },
+                 repeats));
+  return 0;
+}
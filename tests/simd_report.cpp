@@ -0,0 +1,20 @@
+#include "alphabet.hpp"
+#include "decoder.hpp"
+#include "kernels.hpp"
+#include <cstdio>
+
+// Prints the kernel variants this cpu supports and the one a decoder picks
+int main() {
+  for (auto level : {pyctcdecode::SimdLevel::SCALAR,
+                     pyctcdecode::SimdLevel::SSE4, pyctcdecode::SimdLevel::AVX2,
+                     pyctcdecode::SimdLevel::AVX512}) {
+    printf("%-8s %s\n", pyctcdecode::simd_level_name(level),
+           level <= pyctcdecode::detect_simd_level() ? "supported"
+                                                     : "unsupported");
+  }
+  const pyctcdecode::BeamSearchDecoderCTC decoder(
+      pyctcdecode::Alphabet::build_alphabet({"", "a"}));
+  printf("decoder kernels: %s\n",
+         pyctcdecode::simd_level_name(decoder.simd_level()));
+  return 0;
+}
@@ -0,0 +1,119 @@
+#include "alphabet.hpp"
+#include "async_decoder.hpp"
+#include "constants.hpp"
+#include "decoder.hpp"
+#include "language_model.hpp"
+#include "streaming.hpp"
+#include <Eigen/Eigen>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <lm/model.hh>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// Runs many threads against a single decoder instance and checks every result
+// against a single threaded reference. Built with -fsanitize=thread.
+// usage: stress_test [num_threads] [iterations] [kenlm arpa/binary path]
+
+namespace {
+static std::vector<std::string> SAMPLE_LABELS{" ", "b", "g", "n",
+                                              "s", "u", "y", ""};
+
+Eigen::MatrixXf random_logits(int n_frames, int n_vocab, unsigned int seed) {
+  std::srand(seed);
+  return Eigen::MatrixXf::Random(n_frames, n_vocab) * 5.0f;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  const auto num_threads = argc > 1 ? std::atoi(argv[1]) : 8;
+  const auto iterations = argc > 2 ? std::atoi(argv[2]) : 20;
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  std::optional<pyctcdecode::AbstractLanguageModelPtr> language_model;
+  if (argc > 3) {
+    const auto ken_lm = std::make_shared<const lm::ngram::Model>(argv[3]);
+    language_model = std::make_shared<pyctcdecode::LanguageModel>(
+        ken_lm, std::unordered_set<std::string>(), 1.0);
+  }
+  const auto decoder = std::make_shared<const pyctcdecode::BeamSearchDecoderCTC>(
+      alphabet, language_model);
+
+  std::vector<Eigen::MatrixXf> inputs;
+  std::vector<std::string> expected;
+  for (auto i = 0; i < 16; i++) {
+    inputs.push_back(random_logits(20 + 5 * i, SAMPLE_LABELS.size(), i));
+    expected.push_back(decoder->decode(inputs.back()));
+  }
+
+  std::atomic<int> failures{0};
+  std::vector<std::thread> threads;
+  for (auto t = 0; t < num_threads; t++) {
+    threads.emplace_back([&, t]() {
+      for (auto it = 0; it < iterations; it++) {
+        const auto idx = (t + it) % inputs.size();
+        if (decoder->decode(inputs.at(idx)) != expected.at(idx)) {
+          failures++;
+        }
+        // a streaming session per thread on the shared decoder
+        pyctcdecode::StreamingSession session(*decoder);
+        session.push(inputs.at(idx));
+        if (session.finalize().empty()) {
+          failures++;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  const auto batch = decoder->decode_batch(
+      inputs, pyctcdecode::DEFAULT_BEAM_WIDTH, pyctcdecode::DEFAULT_PRUNE_LOGP,
+      pyctcdecode::DEFAULT_MIN_TOKEN_LOGP, true);
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (batch.at(i).empty() || batch.at(i).at(0).text_ != expected.at(i)) {
+      failures++;
+    }
+  }
+  // one utterance at a time with the frame loop split across the threads
+  for (size_t i = 0; i < inputs.size(); i++) {
+    const auto beams = decoder->decode_beams(
+        inputs.at(i), pyctcdecode::DEFAULT_BEAM_WIDTH,
+        pyctcdecode::DEFAULT_PRUNE_LOGP, pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+        true, {}, pyctcdecode::DEFAULT_HOTWORD_WEIGHT, std::nullopt,
+        num_threads);
+    if (beams.empty() || beams.at(0).text_ != expected.at(i)) {
+      failures++;
+    }
+  }
+  // requests queued from every thread onto the async workers
+  {
+    // same search settings as decode(), which prunes the beam history
+    pyctcdecode::AsyncDecoder async_decoder(
+        *decoder, num_threads, 4, pyctcdecode::DEFAULT_BEAM_WIDTH,
+        pyctcdecode::DEFAULT_PRUNE_LOGP, pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+        true);
+    std::vector<std::thread> producers;
+    for (auto t = 0; t < num_threads; t++) {
+      producers.emplace_back([&, t]() {
+        for (auto it = 0; it < iterations; it++) {
+          const auto idx = (t + it) % inputs.size();
+          auto beams = async_decoder.submit(inputs.at(idx)).get();
+          if (beams.empty() || beams.at(0).text_ != expected.at(idx)) {
+            failures++;
+          }
+        }
+      });
+    }
+    for (auto &producer : producers) {
+      producer.join();
+    }
+  }
+  printf("%d threads x %d iterations, %d failures\n", num_threads, iterations,
+         failures.load());
+  return failures.load() == 0 ? 0 : 1;
+}
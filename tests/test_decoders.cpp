@@ -1,10 +1,28 @@
 #include "constants.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <numeric>
 #include <optional>
 #include <set>
+#include <sstream>
 #include <unordered_set>
 #define BOOST_TEST_MODULE cppctcdecode
 // #include "src/decoder.hpp"
+#include "async_decoder.hpp"
 #include "decoder.hpp"
+#include "grammar.hpp"
+#include "kernels.hpp"
+#include "lexicon.hpp"
+#include "logits_archive.hpp"
+#include "stream_generator.hpp"
+#include "streaming.hpp"
 #include <boost/test/included/unit_test.hpp>
 #include <lm/model.hh>
 namespace {
@@ -64,6 +82,96 @@ static Eigen::Matrix<float, 13, 8> TEST_LOGIT{
 
 static std::vector<std::string> SAMPLE_LABELS{" ", "b", "g", "n",
                                               "s", "u", "y", ""};
+
+// kenlm model of the sample data, loaded once. PYCTCDECODE_TEST_LM overrides
+// the default path.
+std::shared_ptr<const lm::ngram::Model> test_kenlm() {
+  static const auto model = []() {
+    const char *path = std::getenv("PYCTCDECODE_TEST_LM");
+    return std::make_shared<const lm::ngram::Model>(
+        path != nullptr ? path
+                        : "/Volumes/SSD-PGU3/Documents/programming_proj/"
+                          "pyctcdecode/pyctcdecode/tests/sample_data/"
+                          "bugs_bunny_kenlm.arpa");
+  }();
+  return model;
+}
+
+// decoder over SAMPLE_LABELS scored by the sample kenlm model
+std::unique_ptr<pyctcdecode::BeamSearchDecoderCTC> make_lm_decoder() {
+  auto language_model = std::make_shared<pyctcdecode::LanguageModel>(
+      test_kenlm(), std::unordered_set<std::string>(), 1.0);
+  return std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(
+      pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS), language_model);
+}
+
+// version 1 .npy image of a float32 frames x vocab matrix
+std::string npy_bytes(const pyctcdecode::RowMajorMatrixXf &logits) {
+  std::string header = "{'descr': '<f4', 'fortran_order': False, 'shape': (" +
+                       std::to_string(logits.rows()) + ", " +
+                       std::to_string(logits.cols()) + "), }";
+  header.resize(128 - 10 - 1, ' ');
+  header += '\n';
+  std::string bytes = "\x93NUMPY\x01";
+  bytes += '\0';
+  bytes += static_cast<char>(header.size());
+  bytes += '\0';
+  bytes += header;
+  bytes.append(reinterpret_cast<const char *>(logits.data()),
+               logits.size() * sizeof(float));
+  return bytes;
+}
+
+// uncompressed zip as written by np.savez, crc left out as it is never read
+std::string zip_bytes(
+    const std::vector<std::pair<std::string, std::string>> &members) {
+  const auto u16 = [](std::string &out, uint16_t value) {
+    out.append(reinterpret_cast<const char *>(&value), 2);
+  };
+  const auto u32 = [](std::string &out, uint32_t value) {
+    out.append(reinterpret_cast<const char *>(&value), 4);
+  };
+  std::string bytes;
+  std::string directory;
+  for (const auto &[name, data] : members) {
+    const auto offset = bytes.size();
+    u32(bytes, 0x04034b50);
+    for (auto i = 0; i < 5; i++) {
+      u16(bytes, 0);
+    }
+    u32(bytes, 0);
+    u32(bytes, data.size());
+    u32(bytes, data.size());
+    u16(bytes, name.size());
+    u16(bytes, 0);
+    bytes += name + data;
+    u32(directory, 0x02014b50);
+    for (auto i = 0; i < 6; i++) {
+      u16(directory, 0);
+    }
+    u32(directory, 0);
+    u32(directory, data.size());
+    u32(directory, data.size());
+    u16(directory, name.size());
+    for (auto i = 0; i < 4; i++) {
+      u16(directory, 0);
+    }
+    u32(directory, 0);
+    u32(directory, offset);
+    directory += name;
+  }
+  const auto directory_offset = bytes.size();
+  bytes += directory;
+  u32(bytes, 0x06054b50);
+  u16(bytes, 0);
+  u16(bytes, 0);
+  u16(bytes, members.size());
+  u16(bytes, members.size());
+  u32(bytes, directory.size());
+  u32(bytes, directory_offset);
+  u16(bytes, 0);
+  return bytes;
+}
 } // namespace
 
 BOOST_AUTO_TEST_CASE(free_test_function)
@@ -73,9 +181,7 @@ BOOST_AUTO_TEST_CASE(free_test_function)
   pyctcdecode::EMatrixLogSoftmax<1>(TEST_LOGIT, output);
 
   // load kenlm
-  const auto ken_lm = std::make_shared<const lm::ngram::Model>(
-      "/Volumes/SSD-PGU3/Documents/programming_proj/pyctcdecode/"
-      "pyctcdecode/tests/sample_data/bugs_bunny_kenlm.arpa");
+  const auto ken_lm = test_kenlm();
   auto start_state = lm::ngram::State();
   auto end_state = lm::ngram::State();
   ken_lm->BeginSentenceWrite(&start_state);
@@ -124,3 +230,1340 @@ BOOST_AUTO_TEST_CASE(free_test_function)
     BOOST_CHECK_EQUAL(text, "bunny bunny");
   }
 }
+
+BOOST_AUTO_TEST_CASE(streaming_session_test) {
+  const auto decoder = make_lm_decoder();
+  const Eigen::MatrixXf logits = TEST_LOGIT;
+  const auto expected = decoder->decode(logits);
+
+  for (const auto chunk_size : {1, 4, 13}) {
+    pyctcdecode::StreamingSession session(
+        *decoder, pyctcdecode::DEFAULT_BEAM_WIDTH,
+        pyctcdecode::DEFAULT_PRUNE_LOGP, pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+        true);
+    session.set_keep_committed_words(true);
+    // words handed out by push and finalize, without relying on the session
+    // keeping them
+    std::vector<pyctcdecode::WordFrames> streamed;
+    for (auto start = 0; start < logits.rows(); start += chunk_size) {
+      const auto rows = std::min<int>(chunk_size, logits.rows() - start);
+      const auto words = session.push(logits.middleRows(start, rows));
+      streamed.insert(streamed.end(), words.begin(), words.end());
+    }
+    const auto output_beams = session.finalize();
+    BOOST_REQUIRE(!output_beams.empty());
+    const auto &final_words = output_beams.front().text_frames;
+    streamed.insert(streamed.end(), final_words.begin(), final_words.end());
+    std::string text;
+    for (const auto &[word, frames] : session.committed_words()) {
+      text += (text.empty() ? "" : " ") + word;
+    }
+    BOOST_CHECK_EQUAL(text, expected);
+    BOOST_CHECK(streamed == session.committed_words());
+    BOOST_CHECK_EQUAL(session.processed_frames(), logits.rows());
+  }
+
+  pyctcdecode::StreamingSession session(*decoder);
+  for (auto start = 0; start < logits.rows(); start += 4) {
+    session.push(
+        logits.middleRows(start, std::min<int>(4, logits.rows() - start)));
+  }
+  session.finalize();
+  BOOST_CHECK(session.committed_words().empty());
+}
+
+BOOST_AUTO_TEST_CASE(streaming_hotword_test) {
+  const auto decoder = make_lm_decoder();
+  // five "bugs bunny" segments, the fourth followed by a frame that is as
+  // likely blank as space. Hotwords in the committed words must not favour
+  // the beam that keeps its cached lm score there over the one that
+  // completes a word.
+  const auto n_vocab = TEST_LOGIT.cols();
+  const int n_rows = TEST_LOGIT.rows() + 1;
+  Eigen::MatrixXf logits(5 * n_rows, n_vocab);
+  for (auto i = 0; i < 5; i++) {
+    Eigen::RowVectorXf separator =
+        Eigen::RowVectorXf::Constant(n_vocab, TEST_LOGIT(0, 0));
+    if (i == 3) {
+      separator(0) = std::log(0.5f);
+      separator(n_vocab - 1) = std::log(0.5f);
+    } else {
+      separator(0) = 0.0;
+    }
+    logits.middleRows(i * n_rows, TEST_LOGIT.rows()) = TEST_LOGIT;
+    logits.row(i * n_rows + TEST_LOGIT.rows()) = separator;
+  }
+  const std::unordered_set<std::string> hotwords{"bugs"};
+  const auto hotword_weight = 30.0f;
+  const auto expected =
+      decoder
+          ->decode_beams(logits, pyctcdecode::DEFAULT_BEAM_WIDTH,
+                         pyctcdecode::DEFAULT_PRUNE_LOGP,
+                         pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+                         pyctcdecode::DEFAULT_PRUNE_BEAMS, hotwords,
+                         hotword_weight)
+          .at(0);
+
+  for (const auto chunk_size : {1, 4, n_rows}) {
+    pyctcdecode::StreamingSession session(
+        *decoder, pyctcdecode::DEFAULT_BEAM_WIDTH,
+        pyctcdecode::DEFAULT_PRUNE_LOGP, pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+        pyctcdecode::DEFAULT_PRUNE_BEAMS, hotwords, hotword_weight);
+    std::string committed;
+    for (auto start = 0; start < logits.rows(); start += chunk_size) {
+      const auto rows = std::min<int>(chunk_size, logits.rows() - start);
+      for (const auto &[word, frames] :
+           session.push(logits.middleRows(start, rows))) {
+        committed += word + " ";
+      }
+    }
+    const auto output_beams = session.finalize();
+    BOOST_REQUIRE(!output_beams.empty());
+    const auto &uncommitted = output_beams.front().text_;
+    BOOST_CHECK(!committed.empty());
+    BOOST_CHECK_EQUAL(expected.text_.substr(0, committed.size()), committed);
+    BOOST_CHECK_EQUAL(committed + uncommitted, expected.text_);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(streaming_endpoint_test) {
+  const auto decoder = make_lm_decoder();
+  // two utterances separated by confident blank frames
+  const auto n_blank = 5;
+  Eigen::MatrixXf logits(2 * TEST_LOGIT.rows() + n_blank, TEST_LOGIT.cols());
+  Eigen::MatrixXf blank_frames =
+      Eigen::MatrixXf::Constant(n_blank, TEST_LOGIT.cols(), -34.5);
+  blank_frames.col(TEST_LOGIT.cols() - 1).setZero();
+  logits << TEST_LOGIT, blank_frames, TEST_LOGIT;
+
+  pyctcdecode::StreamingSession session(*decoder);
+  session.set_keep_committed_words(true);
+  session.set_endpointing(n_blank);
+  for (auto start = 0; start < logits.rows(); start += 4) {
+    session.push(
+        logits.middleRows(start, std::min<int>(4, logits.rows() - start)));
+  }
+  BOOST_CHECK_EQUAL(session.endpoints().size(), 1);
+  BOOST_CHECK_EQUAL(session.endpoints().at(0), TEST_LOGIT.rows() + n_blank);
+  session.finalize();
+  std::string text;
+  for (const auto &[word, frames] : session.committed_words()) {
+    text += (text.empty() ? "" : " ") + word;
+  }
+  BOOST_CHECK_EQUAL(text, "bugs bunny bugs bunny");
+}
+
+BOOST_AUTO_TEST_CASE(streaming_start_state_test) {
+  const auto language_model = std::make_shared<pyctcdecode::LanguageModel>(
+      test_kenlm(), std::unordered_set<std::string>(), 1.0);
+  const auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(
+      pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS), language_model);
+  const Eigen::MatrixXf logits = TEST_LOGIT;
+  // continue after a previous utterance that ended in "bugs"
+  auto start_state = language_model->get_start_state();
+  const std::optional<pyctcdecode::AbstractLMStatePtr> context =
+      language_model->score(start_state, "bugs", false).second;
+
+  pyctcdecode::StreamingSession session(
+      *decoder, pyctcdecode::DEFAULT_BEAM_WIDTH,
+      pyctcdecode::DEFAULT_PRUNE_LOGP, pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+      pyctcdecode::DEFAULT_PRUNE_BEAMS, {}, pyctcdecode::DEFAULT_HOTWORD_WEIGHT,
+      context);
+  // every segment continues from the context, not only the first one
+  std::vector<std::string> segment_texts;
+  for (auto segment = 0; segment < 2; segment++) {
+    std::vector<pyctcdecode::WordFrames> words;
+    for (auto start = 0; start < logits.rows(); start += 4) {
+      const auto committed = session.push(
+          logits.middleRows(start, std::min<int>(4, logits.rows() - start)));
+      words.insert(words.end(), committed.begin(), committed.end());
+    }
+    const auto output_beams = session.finalize();
+    BOOST_REQUIRE(!output_beams.empty());
+    const auto &final_words = output_beams.front().text_frames;
+    words.insert(words.end(), final_words.begin(), final_words.end());
+    std::string text;
+    for (const auto &[word, frames] : words) {
+      text += (text.empty() ? "" : " ") + word;
+    }
+    segment_texts.push_back(text);
+  }
+  BOOST_CHECK_NE(segment_texts.at(0),
+                 decoder->decode_beams(logits).at(0).text_);
+  BOOST_CHECK_EQUAL(segment_texts.at(1), segment_texts.at(0));
+}
+
+BOOST_AUTO_TEST_CASE(streaming_snapshot_test) {
+  const auto decoder = make_lm_decoder();
+  Eigen::MatrixXf logits(3 * TEST_LOGIT.rows(), TEST_LOGIT.cols());
+  logits << TEST_LOGIT, TEST_LOGIT, TEST_LOGIT;
+  const auto split = 20;
+
+  pyctcdecode::StreamingSession reference(*decoder);
+  reference.set_keep_committed_words(true);
+  reference.push(logits.topRows(split));
+  reference.push(logits.bottomRows(logits.rows() - split));
+  const auto expected = reference.finalize();
+
+  pyctcdecode::StreamingSession session(*decoder);
+  session.set_keep_committed_words(true);
+  session.push(logits.topRows(split));
+  std::stringstream snapshot;
+  session.save(snapshot);
+  pyctcdecode::StreamingSession resumed(*decoder);
+  resumed.restore(snapshot);
+  BOOST_CHECK_EQUAL(resumed.processed_frames(), split);
+  resumed.push(logits.bottomRows(logits.rows() - split));
+  const auto output_beams = resumed.finalize();
+
+  BOOST_REQUIRE_EQUAL(output_beams.size(), expected.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    BOOST_CHECK_EQUAL(output_beams.at(i).text_, expected.at(i).text_);
+    BOOST_CHECK_EQUAL(output_beams.at(i).logit_score,
+                      expected.at(i).logit_score);
+    BOOST_CHECK_EQUAL(output_beams.at(i).lm_score, expected.at(i).lm_score);
+  }
+  BOOST_CHECK(resumed.committed_words() == reference.committed_words());
+}
+
+BOOST_AUTO_TEST_CASE(streaming_snapshot_corrupt_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  const pyctcdecode::BeamSearchDecoderCTC decoder(alphabet);
+  const Eigen::MatrixXf logits = TEST_LOGIT;
+  pyctcdecode::StreamingSession session(decoder);
+  session.push(logits.topRows(5));
+  std::stringstream snapshot;
+  session.save(snapshot);
+  const auto bytes = snapshot.str();
+
+  pyctcdecode::StreamingSession resumed(decoder);
+  resumed.push(logits.topRows(2));
+  const auto check_rejected = [&](const std::string &corrupt) {
+    std::stringstream is(corrupt);
+    BOOST_CHECK_THROW(resumed.restore(is), std::runtime_error);
+    // a failed restore leaves the session as it was
+    BOOST_CHECK_EQUAL(resumed.processed_frames(), 2);
+  };
+  check_rejected(bytes.substr(0, bytes.size() - 3));
+  // endpoint count far beyond what the snapshot holds, rejected before it
+  // is allocated
+  auto huge_count = bytes;
+  const uint32_t count = 0xffffffff;
+  huge_count.replace(37, 4, reinterpret_cast<const char *>(&count), 4);
+  check_rejected(huge_count);
+
+  std::stringstream is(bytes);
+  resumed.restore(is);
+  BOOST_CHECK_EQUAL(resumed.processed_frames(), 5);
+}
+
+BOOST_AUTO_TEST_CASE(decode_batch_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  std::vector<Eigen::MatrixXf> logits_list;
+  for (const auto n_repeat : {1, 3, 2, 1}) {
+    Eigen::MatrixXf logits(n_repeat * TEST_LOGIT.rows(), TEST_LOGIT.cols());
+    for (auto i = 0; i < n_repeat; i++) {
+      logits.middleRows(i * TEST_LOGIT.rows(), TEST_LOGIT.rows()) = TEST_LOGIT;
+    }
+    logits_list.push_back(logits);
+  }
+  const auto results = decoder->decode_batch(
+      logits_list, pyctcdecode::DEFAULT_BEAM_WIDTH,
+      pyctcdecode::DEFAULT_PRUNE_LOGP, pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+      pyctcdecode::DEFAULT_PRUNE_BEAMS, {}, pyctcdecode::DEFAULT_HOTWORD_WEIGHT,
+      2);
+  BOOST_REQUIRE_EQUAL(results.size(), logits_list.size());
+  for (size_t i = 0; i < logits_list.size(); i++) {
+    auto logits = logits_list.at(i);
+    const auto expected = decoder->decode_beams(logits);
+    BOOST_REQUIRE(!results.at(i).empty());
+    BOOST_CHECK_EQUAL(results.at(i).at(0).text_, expected.at(0).text_);
+    BOOST_CHECK_EQUAL(results.at(i).at(0).logit_score,
+                      expected.at(0).logit_score);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(padded_batch_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  const std::vector<int> n_repeats{1, 3, 2, 0};
+  const auto max_frames = 3 * TEST_LOGIT.rows();
+  const auto n_vocab = TEST_LOGIT.cols();
+  // padding is never read, fill it with values that would change the result
+  std::vector<float> padded(n_repeats.size() * max_frames * n_vocab, 50.0f);
+  std::vector<int> lengths;
+  for (size_t b = 0; b < n_repeats.size(); b++) {
+    for (auto t = 0; t < n_repeats.at(b) * TEST_LOGIT.rows(); t++) {
+      for (auto v = 0; v < n_vocab; v++) {
+        padded.at((b * max_frames + t) * n_vocab + v) =
+            TEST_LOGIT(t % TEST_LOGIT.rows(), v);
+      }
+    }
+    lengths.push_back(n_repeats.at(b) * TEST_LOGIT.rows());
+  }
+  const auto results = decoder->decode_batch(
+      padded.data(), lengths, max_frames, n_vocab,
+      pyctcdecode::DEFAULT_BEAM_WIDTH, pyctcdecode::DEFAULT_PRUNE_LOGP,
+      pyctcdecode::DEFAULT_MIN_TOKEN_LOGP, pyctcdecode::DEFAULT_PRUNE_BEAMS, {},
+      pyctcdecode::DEFAULT_HOTWORD_WEIGHT, 2);
+  BOOST_REQUIRE_EQUAL(results.size(), lengths.size());
+  for (size_t b = 0; b < lengths.size(); b++) {
+    const auto expected = decoder->decode_beams(pyctcdecode::logits_view(
+        padded.data() + b * max_frames * n_vocab, lengths.at(b), n_vocab));
+    BOOST_REQUIRE(!results.at(b).empty());
+    BOOST_CHECK_EQUAL(results.at(b).at(0).text_, expected.at(0).text_);
+    BOOST_CHECK_EQUAL(results.at(b).at(0).logit_score,
+                      expected.at(0).logit_score);
+  }
+  BOOST_CHECK_THROW(
+      decoder->decode_batch(padded.data(), {1, max_frames + 1}, max_frames,
+                            n_vocab),
+      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(parallel_frame_test) {
+  const auto decoder = make_lm_decoder();
+  // wide beams so every frame goes through the thread team
+  std::srand(7);
+  const Eigen::MatrixXf logits =
+      Eigen::MatrixXf::Random(40, SAMPLE_LABELS.size()) * 2.0f;
+  const auto expected =
+      decoder->decode_beams(logits, 256, -100.0, -20.0, false);
+  const auto results = decoder->decode_beams(
+      logits, 256, -100.0, -20.0, false, {},
+      pyctcdecode::DEFAULT_HOTWORD_WEIGHT, std::nullopt, 4);
+  BOOST_REQUIRE_EQUAL(results.size(), expected.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    BOOST_CHECK_EQUAL(results.at(i).text_, expected.at(i).text_);
+    BOOST_CHECK_EQUAL(results.at(i).logit_score, expected.at(i).logit_score);
+    BOOST_CHECK_EQUAL(results.at(i).lm_score, expected.at(i).lm_score);
+  }
+  // a second call runs on the same cached pool
+  const auto again = decoder->decode_beams(
+      logits, 256, -100.0, -20.0, false, {},
+      pyctcdecode::DEFAULT_HOTWORD_WEIGHT, std::nullopt, 4);
+  BOOST_CHECK_EQUAL(again.at(0).text_, expected.at(0).text_);
+  // concurrent calls share the cached pool of their size and interleave
+  // their frames on it, calls of another size use their own pool
+  auto two_threads = std::async(std::launch::async, [&]() {
+    return decoder->decode_beams(logits, 256, -100.0, -20.0, false, {},
+                                 pyctcdecode::DEFAULT_HOTWORD_WEIGHT,
+                                 std::nullopt, 2);
+  });
+  auto other_four_threads = std::async(std::launch::async, [&]() {
+    return decoder->decode_beams(logits, 256, -100.0, -20.0, false, {},
+                                 pyctcdecode::DEFAULT_HOTWORD_WEIGHT,
+                                 std::nullopt, 4);
+  });
+  const auto four_threads = decoder->decode_beams(
+      logits, 256, -100.0, -20.0, false, {},
+      pyctcdecode::DEFAULT_HOTWORD_WEIGHT, std::nullopt, 4);
+  BOOST_CHECK_EQUAL(two_threads.get().at(0).text_, expected.at(0).text_);
+  BOOST_CHECK_EQUAL(other_four_threads.get().at(0).text_,
+                    expected.at(0).text_);
+  BOOST_CHECK_EQUAL(four_threads.at(0).text_, expected.at(0).text_);
+
+  // a job calling back into its own pool runs the inner loop inline
+  pyctcdecode::ThreadPool pool(2);
+  std::atomic<int> calls{0};
+  pool.parallel_for(4, [&](size_t) {
+    pool.parallel_for(3, [&](size_t) { calls++; });
+  });
+  BOOST_CHECK_EQUAL(calls.load(), 12);
+}
+
+BOOST_AUTO_TEST_CASE(thread_pool_test) {
+  // a job waiting on another caller's job only finishes if the pool runs
+  // both at once, the wait is bounded so a serializing pool fails instead
+  // of hanging
+  pyctcdecode::ThreadPool pool(2);
+  std::promise<void> second_ran;
+  auto second_ran_future = second_ran.get_future();
+  std::atomic<bool> saw_second{false};
+  auto first = std::async(std::launch::async, [&]() {
+    pool.parallel_for(1, [&](size_t) {
+      saw_second = second_ran_future.wait_for(std::chrono::seconds(10)) ==
+                   std::future_status::ready;
+    });
+  });
+  pool.parallel_for(1, [&](size_t) { second_ran.set_value(); });
+  first.get();
+  BOOST_CHECK(saw_second.load());
+
+  // exceptions reach the caller of the job that threw
+  BOOST_CHECK_THROW(pool.parallel_for(3,
+                                      [](size_t i) {
+                                        if (i == 1) {
+                                          throw std::runtime_error("job");
+                                        }
+                                      }),
+                    std::runtime_error);
+  std::atomic<int> calls{0};
+  pool.parallel_for(5, [&](size_t) { calls++; });
+  BOOST_CHECK_EQUAL(calls.load(), 5);
+}
+
+BOOST_AUTO_TEST_CASE(decode_long_test) {
+  const auto decoder = make_lm_decoder();
+  // repeat the sample with a space and some blank frames in between
+  const auto n_repeat = 12;
+  const auto gap = 4;
+  Eigen::MatrixXf logits = Eigen::MatrixXf::Constant(
+      n_repeat * (TEST_LOGIT.rows() + gap), TEST_LOGIT.cols(),
+      TEST_LOGIT(0, 0));
+  for (auto i = 0; i < n_repeat; i++) {
+    const auto start = i * (TEST_LOGIT.rows() + gap);
+    logits.middleRows(start, TEST_LOGIT.rows()) = TEST_LOGIT;
+    logits(start + TEST_LOGIT.rows(), 0) = 0.0;
+    for (auto g = 1; g < gap; g++) {
+      logits(start + TEST_LOGIT.rows() + g, TEST_LOGIT.cols() - 1) = 0.0;
+    }
+  }
+  const auto expected = decoder->decode_beams(logits).at(0);
+  for (const auto &[window, overlap] : std::vector<std::pair<int, int>>{
+           {68, 34}, {90, 40}, {1000, 100}}) {
+    const auto result = decoder->decode_long(logits, window, overlap);
+    BOOST_CHECK_EQUAL(result.text_, expected.text_);
+    BOOST_REQUIRE_EQUAL(result.text_frames.size(),
+                        expected.text_frames.size());
+    for (size_t i = 0; i < expected.text_frames.size(); i++) {
+      BOOST_CHECK(result.text_frames.at(i) == expected.text_frames.at(i));
+    }
+    if (window >= logits.rows()) {
+      BOOST_CHECK_EQUAL(result.logit_score, expected.logit_score);
+      BOOST_CHECK_EQUAL(result.lm_score, expected.lm_score);
+    } else {
+      BOOST_CHECK_EQUAL(result.logit_score, 0.0);
+      BOOST_CHECK_EQUAL(result.lm_score, 0.0);
+    }
+  }
+  BOOST_CHECK_THROW(decoder->decode_long(logits, 10, 10), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(async_decoder_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  const Eigen::MatrixXf logits = TEST_LOGIT;
+  const auto expected = decoder->decode_beams(logits);
+  {
+    pyctcdecode::AsyncDecoder async_decoder(*decoder, 2);
+    std::vector<std::future<std::vector<pyctcdecode::OutputBeam>>> futures;
+    for (auto i = 0; i < 8; i++) {
+      futures.push_back(async_decoder.submit(logits));
+    }
+    for (auto &future : futures) {
+      const auto output_beams = future.get();
+      BOOST_REQUIRE(!output_beams.empty());
+      BOOST_CHECK_EQUAL(output_beams.at(0).text_, expected.at(0).text_);
+    }
+    BOOST_CHECK_THROW(async_decoder.submit(Eigen::MatrixXf::Zero(2, 3)),
+                      std::runtime_error);
+  }
+
+  // one worker held up in a callback, a queue of one, the third is refused
+  pyctcdecode::AsyncDecoder async_decoder(*decoder, 1, 1);
+  std::promise<void> release;
+  auto released = release.get_future().share();
+  std::promise<void> started;
+  std::atomic<int> done{0};
+  const auto blocking_callback =
+      [&](std::vector<pyctcdecode::OutputBeam> &&, std::exception_ptr) {
+        if (done++ == 0) {
+          started.set_value();
+        }
+        released.wait();
+      };
+  async_decoder.submit(logits, blocking_callback);
+  started.get_future().wait();
+  BOOST_CHECK(async_decoder.try_submit(logits, blocking_callback));
+  BOOST_CHECK(!async_decoder.try_submit(logits).has_value());
+  BOOST_CHECK_EQUAL(async_decoder.queue_depth(), 1);
+  release.set_value();
+  auto future = async_decoder.submit(logits);
+  BOOST_CHECK_EQUAL(future.get().at(0).text_, expected.at(0).text_);
+  const auto stats = async_decoder.stats();
+  BOOST_CHECK_EQUAL(stats.submitted, 3);
+  BOOST_CHECK_EQUAL(stats.rejected, 1);
+  BOOST_CHECK_EQUAL(stats.completed, 3);
+  BOOST_CHECK_EQUAL(stats.max_queue_depth, 1);
+  BOOST_CHECK(stats.max_wait_ms > 0.0);
+}
+
+#if defined(__cpp_impl_coroutine)
+namespace {
+// runs eagerly until the first suspension, nobody awaits it
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+DetachedTask
+collect_interims(pyctcdecode::InterimStream &stream,
+                 std::vector<pyctcdecode::InterimHypothesis> &interims) {
+  while (auto interim = co_await stream.next()) {
+    interims.push_back(std::move(*interim));
+  }
+}
+} // namespace
+
+BOOST_AUTO_TEST_CASE(stream_generator_test) {
+  const auto decoder = make_lm_decoder();
+  const Eigen::MatrixXf logits = TEST_LOGIT;
+  const auto expected = decoder->decode_beams(logits).at(0).text_;
+
+  // two interleaved streams driven from this thread only
+  pyctcdecode::StreamingSession first_session(*decoder);
+  pyctcdecode::StreamingSession second_session(*decoder);
+  pyctcdecode::FrameFeed first_feed;
+  pyctcdecode::FrameFeed second_feed;
+  auto first_stream = pyctcdecode::stream_decode(first_session, first_feed);
+  auto second_stream = pyctcdecode::stream_decode(second_session, second_feed);
+  std::vector<pyctcdecode::InterimHypothesis> first_interims;
+  std::vector<pyctcdecode::InterimHypothesis> second_interims;
+  collect_interims(first_stream, first_interims);
+  collect_interims(second_stream, second_interims);
+  BOOST_CHECK(first_interims.empty());
+
+  for (auto start = 0; start < logits.rows(); start += 4) {
+    const auto rows = std::min<int>(4, logits.rows() - start);
+    first_feed.push(logits.middleRows(start, rows));
+    BOOST_CHECK_EQUAL(first_interims.back().processed_frames, start + rows);
+    second_feed.push(logits.middleRows(start, rows));
+  }
+  first_feed.close();
+  second_feed.close();
+  BOOST_CHECK(first_stream.done());
+  BOOST_CHECK(second_stream.done());
+  for (const auto *interims : {&first_interims, &second_interims}) {
+    BOOST_REQUIRE(!interims->empty());
+    BOOST_CHECK(interims->back().is_final);
+    std::string text;
+    for (const auto &interim : *interims) {
+      for (const auto &[word, frames] : interim.committed_words) {
+        text += (text.empty() ? "" : " ") + word;
+      }
+    }
+    BOOST_CHECK_EQUAL(text, expected);
+  }
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(logits_view_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  const Eigen::MatrixXf logits = TEST_LOGIT;
+  const auto expected = decoder->decode_beams(logits).at(0);
+
+  // frame-contiguous buffer with two floats of padding per frame
+  const auto n_vocab = logits.cols();
+  std::vector<float> row_major(logits.rows() * (n_vocab + 2), 99.0f);
+  for (auto t = 0; t < logits.rows(); t++) {
+    for (auto v = 0; v < n_vocab; v++) {
+      row_major.at(t * (n_vocab + 2) + v) = logits(t, v);
+    }
+  }
+  const auto row_view = pyctcdecode::logits_view(
+      row_major.data(), logits.rows(), n_vocab, true, n_vocab + 2);
+  const auto col_view = pyctcdecode::logits_view(logits.data(), logits.rows(),
+                                                 n_vocab, false);
+  for (const auto &view : {row_view, col_view}) {
+    const auto output_beam = decoder->decode_beams(view).at(0);
+    BOOST_CHECK_EQUAL(output_beam.text_, expected.text_);
+    BOOST_CHECK_CLOSE(output_beam.logit_score, expected.logit_score, 1e-3);
+  }
+  BOOST_CHECK_THROW(decoder->decode_beams(pyctcdecode::logits_view(
+                        row_major.data(), logits.rows(), n_vocab + 2)),
+                    std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(input_scale_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  std::srand(3);
+  const Eigen::MatrixXf logits =
+      Eigen::MatrixXf::Random(30, SAMPLE_LABELS.size()) * 4.0f;
+  // probabilities, log probs and shifted logits all pick the same candidates
+  Eigen::MatrixXf log_probs = logits;
+  for (auto t = 0; t < logits.rows(); t++) {
+    const auto max_logit = logits.row(t).maxCoeff();
+    log_probs.row(t).array() -=
+        max_logit + std::log((logits.row(t).array() - max_logit).exp().sum());
+  }
+  const Eigen::MatrixXf probs = log_probs.array().exp();
+  const Eigen::MatrixXf shifted = logits.array() + 7.0f;
+  for (const auto token_min_logp : {-40.0f, -5.0f, -1.0f, 0.5f}) {
+    const auto expected =
+        decoder->decode_beams(logits, 20, -10.0, token_min_logp).at(0);
+    for (const auto &input :
+         std::vector<Eigen::MatrixXf>{probs, log_probs, shifted}) {
+      const auto output_beam =
+          decoder->decode_beams(input, 20, -10.0, token_min_logp).at(0);
+      BOOST_CHECK_EQUAL(output_beam.text_, expected.text_);
+      BOOST_CHECK_CLOSE(output_beam.logit_score, expected.logit_score, 1e-2);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(reduced_precision_input_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  const Eigen::MatrixXf log_probs = TEST_LOGIT;
+  const Eigen::MatrixXf probs = log_probs.array().exp();
+  for (const auto &input : std::vector<Eigen::MatrixXf>{log_probs, probs}) {
+    const auto expected = decoder->decode_beams(input).at(0);
+    const Eigen::Matrix<Eigen::half, Eigen::Dynamic, Eigen::Dynamic> half =
+        input.cast<Eigen::half>();
+    const pyctcdecode::RowMajorMatrixXf row_major = input;
+    const Eigen::Matrix<Eigen::bfloat16, Eigen::Dynamic, Eigen::Dynamic,
+                        Eigen::RowMajor>
+        bfloat16 = row_major.cast<Eigen::bfloat16>();
+    for (const auto &output_beam :
+         {decoder->decode_beams(pyctcdecode::logits_view(half)).at(0),
+          decoder->decode_beams(pyctcdecode::logits_view(bfloat16)).at(0)}) {
+      BOOST_CHECK_EQUAL(output_beam.text_, expected.text_);
+      BOOST_CHECK_CLOSE(output_beam.logit_score, expected.logit_score, 1.0);
+    }
+  }
+
+  // per-frame scaled int8 log probs
+  const Eigen::VectorXf frame_scales =
+      log_probs.cwiseAbs().rowwise().maxCoeff() / 127.0f;
+  const Eigen::Matrix<int8_t, Eigen::Dynamic, Eigen::Dynamic> quantized =
+      (frame_scales.cwiseInverse().asDiagonal() * log_probs)
+          .array()
+          .round()
+          .cast<int8_t>();
+  const auto output_beam =
+      decoder->decode_beams(pyctcdecode::logits_view(quantized), frame_scales)
+          .at(0);
+  BOOST_CHECK_EQUAL(output_beam.text_,
+                    decoder->decode_beams(log_probs).at(0).text_);
+  BOOST_CHECK_THROW(decoder->decode_beams(pyctcdecode::logits_view(quantized),
+                                          frame_scales.head(3)),
+                    std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(input_lm_start_state_test) {
+  const auto language_model = std::make_shared<pyctcdecode::LanguageModel>(
+      test_kenlm(), std::unordered_set<std::string>(), 1.0);
+  const auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(
+      pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS), language_model);
+  const Eigen::MatrixXf log_probs = TEST_LOGIT;
+  // continue after a previous utterance that ended in "bugs"
+  auto start_state = language_model->get_start_state();
+  const std::optional<pyctcdecode::AbstractLMStatePtr> context =
+      language_model->score(start_state, "bugs", false).second;
+  const auto decode_from_context = [&](const auto &input) {
+    return decoder
+        ->decode_beams(input, pyctcdecode::DEFAULT_BEAM_WIDTH,
+                       pyctcdecode::DEFAULT_PRUNE_LOGP,
+                       pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+                       pyctcdecode::DEFAULT_PRUNE_BEAMS, {},
+                       pyctcdecode::DEFAULT_HOTWORD_WEIGHT, context)
+        .at(0);
+  };
+  // lm_score adds the logit score, which reduced precision inputs shift
+  const auto lm_part = [](const pyctcdecode::OutputBeam &beam) {
+    return beam.lm_score - beam.logit_score;
+  };
+  const auto expected = decode_from_context(log_probs);
+  BOOST_CHECK_NE(lm_part(expected),
+                 lm_part(decoder->decode_beams(log_probs).at(0)));
+
+  const pyctcdecode::RowMajorMatrixXf row_major = log_probs;
+  const Eigen::Matrix<Eigen::half, Eigen::Dynamic, Eigen::Dynamic> half =
+      log_probs.cast<Eigen::half>();
+  const Eigen::Matrix<Eigen::bfloat16, Eigen::Dynamic, Eigen::Dynamic>
+      bfloat16 = log_probs.cast<Eigen::bfloat16>();
+  // every entry stored, sparseView would drop the zero log probs
+  std::vector<Eigen::Triplet<float>> entries;
+  for (auto t = 0; t < log_probs.rows(); t++) {
+    for (auto v = 0; v < log_probs.cols(); v++) {
+      entries.emplace_back(t, v, log_probs(t, v));
+    }
+  }
+  pyctcdecode::SparseLogProbs sparse(log_probs.rows(), log_probs.cols());
+  sparse.setFromTriplets(entries.begin(), entries.end());
+  for (const auto &output_beam :
+       {decode_from_context(pyctcdecode::logits_view(row_major)),
+        decode_from_context(pyctcdecode::logits_view(half)),
+        decode_from_context(pyctcdecode::logits_view(bfloat16)),
+        decode_from_context(sparse)}) {
+    BOOST_CHECK_EQUAL(output_beam.text_, expected.text_);
+    BOOST_CHECK_CLOSE(lm_part(output_beam), lm_part(expected), 1e-3);
+  }
+  const Eigen::VectorXf frame_scales =
+      log_probs.cwiseAbs().rowwise().maxCoeff() / 127.0f;
+  const Eigen::Matrix<int8_t, Eigen::Dynamic, Eigen::Dynamic> quantized =
+      (frame_scales.cwiseInverse().asDiagonal() * log_probs)
+          .array()
+          .round()
+          .cast<int8_t>();
+  const auto int8_beam =
+      decoder
+          ->decode_beams(pyctcdecode::logits_view(quantized), frame_scales,
+                         pyctcdecode::DEFAULT_BEAM_WIDTH,
+                         pyctcdecode::DEFAULT_PRUNE_LOGP,
+                         pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+                         pyctcdecode::DEFAULT_PRUNE_BEAMS, {},
+                         pyctcdecode::DEFAULT_HOTWORD_WEIGHT, context)
+          .at(0);
+  BOOST_CHECK_EQUAL(int8_beam.text_, expected.text_);
+  BOOST_CHECK_CLOSE(lm_part(int8_beam), lm_part(expected), 1e-3);
+
+  // a floor at the full width is the fixed width search
+  const auto adaptive_beam =
+      decoder
+          ->decode_beams_adaptive(
+              log_probs, {pyctcdecode::DEFAULT_BEAM_WIDTH, 0.0, 1.0},
+              pyctcdecode::DEFAULT_BEAM_WIDTH, pyctcdecode::DEFAULT_PRUNE_LOGP,
+              pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+              pyctcdecode::DEFAULT_PRUNE_BEAMS, {},
+              pyctcdecode::DEFAULT_HOTWORD_WEIGHT, context)
+          .at(0);
+  BOOST_CHECK_EQUAL(adaptive_beam.text_, expected.text_);
+  BOOST_CHECK_CLOSE(lm_part(adaptive_beam), lm_part(expected), 1e-3);
+
+  const auto prefix_beam =
+      decoder
+          ->decode_beams_prefix(log_probs, pyctcdecode::DEFAULT_BEAM_WIDTH,
+                                pyctcdecode::DEFAULT_PRUNE_LOGP,
+                                pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+                                pyctcdecode::DEFAULT_PRUNE_BEAMS, {},
+                                pyctcdecode::DEFAULT_HOTWORD_WEIGHT, context)
+          .at(0);
+  BOOST_CHECK_EQUAL(prefix_beam.text_, expected.text_);
+  BOOST_CHECK_NE(lm_part(prefix_beam),
+                 lm_part(decoder->decode_beams_prefix(log_probs).at(0)));
+
+  const auto lexicon_beam =
+      decoder
+          ->decode_beams_lexicon(
+              log_probs, pyctcdecode::Lexicon::build_lexicon({"bugs", "bunny"}),
+              pyctcdecode::DEFAULT_BEAM_WIDTH, pyctcdecode::DEFAULT_PRUNE_LOGP,
+              pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+              pyctcdecode::DEFAULT_PRUNE_BEAMS, {},
+              pyctcdecode::DEFAULT_HOTWORD_WEIGHT, context)
+          .at(0);
+  BOOST_CHECK_EQUAL(lexicon_beam.text_, expected.text_);
+  BOOST_CHECK_CLOSE(lm_part(lexicon_beam), lm_part(expected), 1e-3);
+
+  const auto grammar_beam =
+      decoder
+          ->decode_beams_grammar(
+              log_probs,
+              pyctcdecode::Grammar::parse_grammar(
+                  "0 1 bugs\n0 1 bunny\n1 2 bunny\n2\n"),
+              pyctcdecode::DEFAULT_BEAM_WIDTH, pyctcdecode::DEFAULT_PRUNE_LOGP,
+              pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+              pyctcdecode::DEFAULT_PRUNE_BEAMS, {},
+              pyctcdecode::DEFAULT_HOTWORD_WEIGHT, context)
+          .at(0);
+  BOOST_CHECK_EQUAL(grammar_beam.text_, expected.text_);
+  BOOST_CHECK_CLOSE(lm_part(grammar_beam), lm_part(expected), 1e-3);
+}
+
+BOOST_AUTO_TEST_CASE(sparse_input_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  const Eigen::MatrixXf log_probs = TEST_LOGIT;
+  const auto expected = decoder->decode_beams(log_probs).at(0);
+
+  // top 2 tokens of every frame
+  std::vector<int> frame_offsets{0};
+  std::vector<int> token_ids;
+  std::vector<float> values;
+  for (auto t = 0; t < log_probs.rows(); t++) {
+    std::vector<int> order(log_probs.cols());
+    std::iota(order.begin(), order.end(), 0);
+    std::partial_sort(order.begin(), order.begin() + 2, order.end(),
+                      [&](int a, int b) {
+                        return log_probs(t, a) > log_probs(t, b);
+                      });
+    std::sort(order.begin(), order.begin() + 2);
+    for (auto k = 0; k < 2; k++) {
+      token_ids.push_back(order.at(k));
+      values.push_back(log_probs(t, order.at(k)));
+    }
+    frame_offsets.push_back(token_ids.size());
+  }
+  const Eigen::Map<const pyctcdecode::SparseLogProbs> sparse(
+      log_probs.rows(), log_probs.cols(), values.size(), frame_offsets.data(),
+      token_ids.data(), values.data());
+  const auto output_beam = decoder->decode_beams(sparse).at(0);
+  BOOST_CHECK_EQUAL(output_beam.text_, expected.text_);
+  BOOST_CHECK_CLOSE(output_beam.logit_score, expected.logit_score, 1e-3);
+
+  pyctcdecode::SparseLogProbs empty_frame = sparse;
+  empty_frame.prune([](int row, int, float) { return row != 4; });
+  BOOST_CHECK_THROW(decoder->decode_beams(empty_frame), std::runtime_error);
+  BOOST_CHECK_THROW(decoder->decode_beams(pyctcdecode::SparseLogProbs(
+                        log_probs.rows(), log_probs.cols() + 1)),
+                    std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(greedy_decode_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  const Eigen::MatrixXf log_probs = TEST_LOGIT;
+  std::srand(0);
+  const Eigen::MatrixXf noisy =
+      Eigen::MatrixXf::Random(200, TEST_LOGIT.cols()) * 4.0f;
+  // with a single beam and no language model the search follows the best path
+  for (const auto &input : std::vector<Eigen::MatrixXf>{
+           log_probs, log_probs.array().exp(), log_probs.array() + 3.0f,
+           noisy}) {
+    const auto expected = decoder->decode_beams(input, 1).at(0);
+    const pyctcdecode::RowMajorMatrixXf row_major = input;
+    for (const auto &output_beam :
+         {decoder->decode_greedy(input),
+          decoder->decode_greedy(pyctcdecode::logits_view(row_major))}) {
+      BOOST_CHECK_EQUAL(output_beam.text_, expected.text_);
+      BOOST_CHECK(output_beam.text_frames == expected.text_frames);
+      BOOST_CHECK_CLOSE(output_beam.logit_score, expected.logit_score, 1e-3);
+      BOOST_CHECK(!output_beam.last_lm_state.has_value());
+    }
+  }
+  BOOST_CHECK_EQUAL(decoder->decode_greedy(log_probs).text_,
+                    decoder->decode(log_probs));
+  BOOST_CHECK_THROW(decoder->decode_greedy(log_probs.leftCols(3)),
+                    std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(adaptive_beam_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  const Eigen::MatrixXf log_probs = TEST_LOGIT;
+  const auto expected = decoder->decode_beams(log_probs).at(0);
+
+  // a floor at the full width is the fixed width search
+  pyctcdecode::DecodeStats fixed_stats;
+  const auto fixed = decoder->decode_beams_adaptive(
+      log_probs, {pyctcdecode::DEFAULT_BEAM_WIDTH, 0.0, 1.0},
+      pyctcdecode::DEFAULT_BEAM_WIDTH, pyctcdecode::DEFAULT_PRUNE_LOGP,
+      pyctcdecode::DEFAULT_MIN_TOKEN_LOGP, pyctcdecode::DEFAULT_PRUNE_BEAMS, {},
+      pyctcdecode::DEFAULT_HOTWORD_WEIGHT, std::nullopt, &fixed_stats);
+  BOOST_CHECK_EQUAL(fixed.size(), decoder->decode_beams(log_probs).size());
+  BOOST_CHECK_EQUAL(fixed.at(0).text_, expected.text_);
+  BOOST_CHECK_EQUAL(fixed_stats.frames, log_probs.rows());
+
+  pyctcdecode::DecodeStats stats;
+  const auto adaptive = decoder->decode_beams_adaptive(
+      log_probs, {1, 0.05, 1.5}, pyctcdecode::DEFAULT_BEAM_WIDTH,
+      pyctcdecode::DEFAULT_PRUNE_LOGP, pyctcdecode::DEFAULT_MIN_TOKEN_LOGP,
+      pyctcdecode::DEFAULT_PRUNE_BEAMS, {}, pyctcdecode::DEFAULT_HOTWORD_WEIGHT,
+      std::nullopt, &stats);
+  BOOST_CHECK_EQUAL(adaptive.at(0).text_, expected.text_);
+  BOOST_CHECK_EQUAL(stats.frames, log_probs.rows());
+  BOOST_CHECK_LT(stats.active_beams, fixed_stats.active_beams);
+  BOOST_CHECK_GE(stats.mean_active_beams(), 1.0);
+
+  BOOST_CHECK_THROW(decoder->decode_beams_adaptive(log_probs, {0, 0.0, 1.0}),
+                    std::runtime_error);
+  BOOST_CHECK_THROW(decoder->decode_beams_adaptive(log_probs, {4, 1.0, 1.0}),
+                    std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(beam_pruning_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  std::srand(11);
+  const Eigen::MatrixXf logits =
+      Eigen::MatrixXf::Random(60, TEST_LOGIT.cols()) * 2.0f;
+  for (const auto beam_prune_logp :
+       {pyctcdecode::DEFAULT_PRUNE_LOGP, -1.0f,
+        -std::numeric_limits<float>::infinity()}) {
+    for (const auto beam_width : {1, 7, 100}) {
+      const auto output_beams =
+          decoder->decode_beams(logits, beam_width, beam_prune_logp, -20.0);
+      BOOST_CHECK_LE(output_beams.size(), beam_width);
+      BOOST_CHECK_GE(output_beams.size(), 1);
+      for (size_t i = 1; i < output_beams.size(); i++) {
+        BOOST_CHECK_GE(output_beams.at(i - 1).lm_score,
+                       output_beams.at(i).lm_score);
+        BOOST_CHECK_GE(output_beams.at(i).lm_score,
+                       output_beams.at(0).lm_score + beam_prune_logp);
+      }
+      // without a score beam the cap alone bounds the search
+      if (beam_width == 100 && std::isinf(beam_prune_logp)) {
+        BOOST_CHECK_EQUAL(output_beams.size(), 100);
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(prefix_search_test) {
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(
+      pyctcdecode::Alphabet::build_alphabet({"", "a"}));
+  // "a" is less likely than blank on both frames, yet aa, a_ and _a add up
+  // to 0.64 against 0.36 for the empty prefix
+  Eigen::MatrixXf probs(2, 2);
+  probs << 0.6, 0.4, 0.6, 0.4;
+  const auto output_beams = decoder->decode_beams_prefix(probs, 2);
+  BOOST_CHECK_EQUAL(output_beams.size(), 2);
+  BOOST_CHECK_EQUAL(output_beams.at(0).text_, "a");
+  BOOST_CHECK_CLOSE(output_beams.at(0).logit_score, std::log(0.64), 1e-3);
+  BOOST_CHECK_EQUAL(output_beams.at(1).text_, "");
+  BOOST_CHECK_CLOSE(output_beams.at(1).logit_score, std::log(0.36), 1e-3);
+  // a repeat only starts a new token after a blank
+  Eigen::MatrixXf repeat(3, 2);
+  repeat << 0.01, 0.99, 0.99, 0.01, 0.01, 0.99;
+  BOOST_CHECK_EQUAL(decoder->decode_beams_prefix(repeat).at(0).text_, "aa");
+
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  const Eigen::MatrixXf log_probs = TEST_LOGIT;
+  const auto expected = decoder->decode_beams(log_probs).at(0);
+  for (const auto beam_width : {2, pyctcdecode::DEFAULT_BEAM_WIDTH}) {
+    const auto prefix_beams =
+        decoder->decode_beams_prefix(log_probs, beam_width);
+    BOOST_CHECK_EQUAL(prefix_beams.at(0).text_, expected.text_);
+    BOOST_CHECK(prefix_beams.at(0).text_frames == expected.text_frames);
+    // every beam is a distinct prefix
+    std::set<std::string> texts;
+    for (const auto &output_beam : prefix_beams) {
+      BOOST_CHECK(texts.insert(output_beam.text_).second);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(bpe_alphabet_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(
+      {"<pad>", "▁he", "llo", "▁wor", "ld▁", "<unk>"});
+  BOOST_REQUIRE(alphabet->is_bpe());
+  BOOST_CHECK_EQUAL(alphabet->labels().at(0), "");
+  BOOST_CHECK_EQUAL(alphabet->labels().at(5), pyctcdecode::UNK_BPE_TOKEN);
+  const auto &pieces = alphabet->bpe_pieces();
+  BOOST_REQUIRE_EQUAL(pieces.size(), 6);
+  BOOST_CHECK_EQUAL(pieces.at(1).text, "he");
+  BOOST_CHECK(pieces.at(1).starts_word && !pieces.at(1).ends_word);
+  BOOST_CHECK(!pieces.at(2).starts_word && !pieces.at(2).ends_word);
+  BOOST_CHECK_EQUAL(pieces.at(4).text, "ld");
+  BOOST_CHECK(!pieces.at(4).starts_word && pieces.at(4).ends_word);
+  BOOST_CHECK_EQUAL(pieces.at(5).text, pyctcdecode::UNK_TOKEN);
+  // word pieces mark continuations instead of word starts
+  const auto wordpiece =
+      pyctcdecode::Alphabet::build_alphabet({"[PAD]", "he", "##llo"});
+  BOOST_CHECK(wordpiece->labels() ==
+              pyctcdecode::Labels({"", "▁he", "llo"}));
+
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  const auto frames_logits = [](const std::vector<int> &tokens) {
+    Eigen::MatrixXf logits =
+        Eigen::MatrixXf::Constant(tokens.size(), 6, -20.0);
+    for (size_t t = 0; t < tokens.size(); t++) {
+      logits(t, tokens[t]) = 0.0;
+    }
+    return logits;
+  };
+  const auto hello_world = frames_logits({1, 2, 0, 2, 3, 4});
+  BOOST_CHECK_EQUAL(decoder->decode_beams(hello_world).at(0).text_,
+                    "hellollo world");
+  BOOST_CHECK_EQUAL(decoder->decode_greedy(hello_world).text_,
+                    "hellollo world");
+  BOOST_CHECK_EQUAL(decoder->decode_beams_prefix(hello_world).at(0).text_,
+                    "hellollo world");
+  // "ld▁" closes its word, the next piece starts one
+  const auto closed = frames_logits({3, 4, 2});
+  BOOST_CHECK_EQUAL(decoder->decode_beams(closed).at(0).text_, "world llo");
+  BOOST_CHECK_EQUAL(decoder->decode_greedy(closed).text_, "world llo");
+  // each beam breaks after its own last piece, "ld▁" on one beam does not
+  // split "llo" from the next piece on another
+  auto split_decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(
+      pyctcdecode::Alphabet::build_alphabet(
+          {"<pad>", "▁he", "llo", "▁wor", "ld▁", "x"}));
+  Eigen::MatrixXf split_logits = Eigen::MatrixXf::Constant(3, 6, -20.0);
+  split_logits(0, 1) = 0.0;
+  split_logits(1, 2) = std::log(0.6f);
+  split_logits(1, 4) = std::log(0.4f);
+  split_logits(2, 5) = 0.0;
+  for (const auto &beams : {split_decoder->decode_beams(split_logits),
+                            split_decoder->decode_beams_prefix(split_logits)}) {
+    std::set<std::string> texts;
+    for (const auto &beam : beams) {
+      texts.insert(beam.text_);
+    }
+    BOOST_CHECK_EQUAL(beams.at(0).text_, "hellox");
+    BOOST_CHECK(texts.count("held x") == 1);
+    BOOST_CHECK(texts.count("hello x") == 0 && texts.count("heldx") == 0);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(lexicon_test) {
+  const auto lexicon =
+      pyctcdecode::Lexicon::build_lexicon({"ab", "ba", "abc", "b"});
+  BOOST_CHECK_EQUAL(lexicon->size(), 4);
+  BOOST_CHECK(lexicon->contains("ab"));
+  BOOST_CHECK(lexicon->contains("b"));
+  BOOST_CHECK(!lexicon->contains("a"));
+  BOOST_CHECK(!lexicon->contains("abcd"));
+  BOOST_CHECK(lexicon->is_prefix(""));
+  BOOST_CHECK(lexicon->is_prefix("a"));
+  BOOST_CHECK(!lexicon->is_prefix("c"));
+  const auto node = lexicon->step(pyctcdecode::Lexicon::ROOT, "a");
+  BOOST_CHECK(!lexicon->is_word(node));
+  BOOST_CHECK(lexicon->is_word(lexicon->step(node, "bc")));
+  BOOST_CHECK(lexicon->step(node, "c") == pyctcdecode::Lexicon::NO_NODE);
+  BOOST_CHECK_THROW(pyctcdecode::Lexicon({"a b"}), std::runtime_error);
+
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(
+      pyctcdecode::Alphabet::build_alphabet({"", " ", "a", "b", "c"}));
+  // "ac" is the best path, "ba" the best one made of lexicon words
+  Eigen::MatrixXf probs(2, 5);
+  probs << 0.001, 0.001, 0.597, 0.4, 0.001, 0.001, 0.001, 0.35, 0.048, 0.6;
+  BOOST_CHECK_EQUAL(decoder->decode_beams(probs).at(0).text_, "ac");
+  const auto closed = pyctcdecode::Lexicon::build_lexicon({"ab", "ba", "cab"});
+  const auto output_beams = decoder->decode_beams_lexicon(probs, closed);
+  BOOST_CHECK_EQUAL(output_beams.at(0).text_, "ba");
+  for (const auto &output_beam : output_beams) {
+    BOOST_CHECK(closed->contains(output_beam.text_));
+  }
+  BOOST_CHECK_THROW(decoder->decode_beams_lexicon(probs, nullptr),
+                    std::runtime_error);
+  // with no beam ending on a word the beams inside one are kept
+  const auto prefixes_only = pyctcdecode::Lexicon::build_lexicon({"bab"});
+  BOOST_CHECK_EQUAL(
+      decoder->decode_beams_lexicon(probs, prefixes_only).at(0).text_, "ba");
+  // the best path "acb" leaves the trie at the c, that frame reads as a blank
+  Eigen::MatrixXf off_trie(3, 5);
+  off_trie << 0.001, 0.001, 0.996, 0.001, 0.001, 0.001, 0.001, 0.001, 0.001,
+      0.996, 0.001, 0.001, 0.001, 0.996, 0.001;
+  const auto ab = pyctcdecode::Lexicon::build_lexicon({"ab"});
+  const auto off_trie_beams = decoder->decode_beams_lexicon(off_trie, ab);
+  BOOST_REQUIRE(!off_trie_beams.empty());
+  BOOST_CHECK_EQUAL(off_trie_beams.at(0).text_, "ab");
+}
+
+BOOST_AUTO_TEST_CASE(grammar_test) {
+  using pyctcdecode::Grammar;
+  // "b a" or a lone "a", states renumbered from the first line
+  const auto grammar = Grammar::parse_grammar("# two words\n"
+                                              "5 7 b\n"
+                                              "7 3 a  # then an a\n"
+                                              "5 3 a\n"
+                                              "\n"
+                                              "3\n");
+  BOOST_CHECK_EQUAL(grammar->n_states(), 3);
+  const auto after_b = grammar->next_state(Grammar::START, "b");
+  BOOST_CHECK(after_b != Grammar::NO_STATE);
+  BOOST_CHECK(!grammar->is_final(after_b));
+  BOOST_CHECK(grammar->is_final(grammar->next_state(after_b, "a")));
+  BOOST_CHECK(grammar->next_state(after_b, "b") == Grammar::NO_STATE);
+  BOOST_CHECK(grammar->words(Grammar::START).contains("a"));
+  // by trie node, as the decoder walks it
+  const auto &words = grammar->words(Grammar::START);
+  BOOST_CHECK_EQUAL(
+      grammar->next_state(Grammar::START,
+                          words.step(pyctcdecode::Lexicon::ROOT, "b")),
+      after_b);
+  BOOST_CHECK(grammar->next_state(Grammar::START, pyctcdecode::Lexicon::ROOT) ==
+              Grammar::NO_STATE);
+  BOOST_CHECK(grammar->next_state(Grammar::START,
+                                  pyctcdecode::Lexicon::NO_NODE) ==
+              Grammar::NO_STATE);
+  BOOST_CHECK_THROW(Grammar::parse_grammar("0 1"), std::runtime_error);
+  BOOST_CHECK_THROW(Grammar::parse_grammar("0 1 <eps>"), std::runtime_error);
+  BOOST_CHECK_THROW(Grammar::parse_grammar("0 1 a\n0 2 a"),
+                    std::runtime_error);
+  BOOST_CHECK_THROW(Grammar::parse_grammar("s 1 a"), std::runtime_error);
+  BOOST_CHECK_THROW(Grammar::parse_grammar("# nothing"), std::runtime_error);
+
+  const auto path =
+      std::filesystem::temp_directory_path() / "pyctcdecode_grammar_test.txt";
+  {
+    std::ofstream os(path);
+    os << "0 1 a\n1 2 b\n2\n";
+  }
+  const auto a_then_b = Grammar::load_grammar(path);
+  std::filesystem::remove(path);
+  BOOST_CHECK_THROW(Grammar::load_grammar(path), std::runtime_error);
+
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(
+      pyctcdecode::Alphabet::build_alphabet({"", " ", "a", "b"}));
+  Eigen::MatrixXf probs(3, 4);
+  probs << 0.001, 0.001, 0.398, 0.6, 0.002, 0.996, 0.001, 0.001, 0.001, 0.001,
+      0.6, 0.398;
+  BOOST_CHECK_EQUAL(decoder->decode_beams(probs).at(0).text_, "b a");
+  // the words are allowed in one order only
+  const auto output_beams = decoder->decode_beams_grammar(probs, a_then_b);
+  BOOST_CHECK_EQUAL(output_beams.at(0).text_, "a b");
+  for (const auto &output_beam : output_beams) {
+    BOOST_CHECK(output_beam.text_ == "a b" || output_beam.text_ == "a");
+  }
+  BOOST_CHECK_EQUAL(decoder->decode_beams_grammar(probs, grammar).at(0).text_,
+                    "b a");
+  // a lone "b" stops outside a final state
+  const Eigen::MatrixXf first_frame = probs.topRows(1);
+  BOOST_CHECK_EQUAL(decoder->decode_beams(first_frame).at(0).text_, "b");
+  BOOST_CHECK_EQUAL(
+      decoder->decode_beams_grammar(first_frame, grammar).at(0).text_, "a");
+  BOOST_CHECK_THROW(decoder->decode_beams_grammar(probs, nullptr),
+                    std::runtime_error);
+  // the best path "acb" leaves the word trie at the c, that frame reads as a
+  // blank
+  auto abc_decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(
+      pyctcdecode::Alphabet::build_alphabet({"", " ", "a", "b", "c"}));
+  Eigen::MatrixXf off_trie(3, 5);
+  off_trie << 0.001, 0.001, 0.996, 0.001, 0.001, 0.001, 0.001, 0.001, 0.001,
+      0.996, 0.001, 0.001, 0.001, 0.996, 0.001;
+  const auto off_trie_beams = abc_decoder->decode_beams_grammar(
+      off_trie, Grammar::parse_grammar("0 1 ab\n1\n"));
+  BOOST_REQUIRE(!off_trie_beams.empty());
+  BOOST_CHECK_EQUAL(off_trie_beams.at(0).text_, "ab");
+}
+
+BOOST_AUTO_TEST_CASE(kernels_test) {
+  // compared against double precision libm over lengths that exercise the
+  // vector tails
+  std::vector<float> x(67);
+  for (size_t i = 0; i < x.size(); ++i) {
+    x[i] = std::sin(0.7 * i) * 20.0f - 5.0f;
+  }
+  x[3] = -std::numeric_limits<float>::infinity();
+  for (auto level : {pyctcdecode::SimdLevel::SCALAR,
+                     pyctcdecode::SimdLevel::SSE4, pyctcdecode::SimdLevel::AVX2,
+                     pyctcdecode::SimdLevel::AVX512}) {
+    if (level > pyctcdecode::detect_simd_level()) {
+      BOOST_CHECK_THROW(pyctcdecode::simd_kernels(level), std::runtime_error);
+      continue;
+    }
+    const auto &kernels = pyctcdecode::simd_kernels(level);
+    for (size_t n : {1, 3, 4, 8, 17, 67}) {
+      double max = -std::numeric_limits<double>::infinity();
+      double sum = 0.0;
+      for (size_t i = 0; i < n; ++i) {
+        max = std::max(max, static_cast<double>(x[i]));
+      }
+      for (size_t i = 0; i < n; ++i) {
+        sum += std::exp(x[i] - max);
+      }
+      BOOST_CHECK_EQUAL(kernels.max(x.data(), n), max);
+      BOOST_CHECK_EQUAL(kernels.argmax(x.data(), n),
+                        std::max_element(x.begin(), x.begin() + n) -
+                            x.begin());
+      std::vector<uint32_t> selected(n);
+      std::vector<uint32_t> expected;
+      for (size_t i = 0; i < n; ++i) {
+        if (x[i] >= 2.5f) {
+          expected.push_back(i);
+        }
+      }
+      selected.resize(
+          kernels.select_above(x.data(), n, 2.5f, selected.data()));
+      BOOST_CHECK_EQUAL_COLLECTIONS(selected.begin(), selected.end(),
+                                    expected.begin(), expected.end());
+      BOOST_CHECK_CLOSE(kernels.sum_exp(x.data(), n, max), sum, 1e-4);
+      std::vector<float> out(n);
+      kernels.log_softmax(x.data(), n, out.data());
+      for (size_t i = 0; i < n; ++i) {
+        if (std::isinf(x[i])) {
+          BOOST_CHECK_EQUAL(out[i], x[i]);
+        } else {
+          BOOST_CHECK_SMALL(out[i] - (x[i] - max - std::log(sum)), 1e-4);
+        }
+      }
+    }
+    // underflow is exactly zero rather than the clamped exp
+    const float tiny[] = {0.0, -100.0, -1000.0};
+    BOOST_CHECK_EQUAL(kernels.sum_exp(tiny, 3, 0.0), 1.0f);
+    // ties resolve to the first token
+    const float tied[] = {1.0, 3.0, 0.0, 3.0, 3.0, 3.0, 3.0, 3.0, 3.0};
+    BOOST_CHECK_EQUAL(kernels.argmax(tied, 9), 1);
+    BOOST_CHECK_EQUAL(kernels.argmax(tied + 2, 7), 1);
+    // every fp16 and bf16 bit pattern widens as Eigen casts it, offset so the
+    // vector loops also run on unaligned input with a scalar tail
+    std::vector<uint16_t> bits(1 << 16);
+    std::iota(bits.begin(), bits.end(), 0);
+    std::vector<float> widened(bits.size() - 1);
+    size_t mismatches = 0;
+    kernels.half_to_float(bits.data() + 1, widened.size(), widened.data());
+    for (size_t i = 0; i < widened.size(); ++i) {
+      const auto expected = static_cast<float>(
+          Eigen::half(Eigen::half_impl::raw_uint16_to_half(bits[i + 1])));
+      mismatches += !(widened[i] == expected ||
+                      (std::isnan(widened[i]) && std::isnan(expected)));
+    }
+    kernels.bfloat16_to_float(bits.data() + 1, widened.size(),
+                              widened.data());
+    for (size_t i = 0; i < widened.size(); ++i) {
+      const auto expected = static_cast<float>(Eigen::bfloat16(
+          Eigen::bfloat16_impl::raw_uint16_to_bfloat16(bits[i + 1])));
+      mismatches += !(widened[i] == expected ||
+                      (std::isnan(widened[i]) && std::isnan(expected)));
+    }
+    BOOST_CHECK_EQUAL(mismatches, 0);
+
+    // a decoder on this level finds the same beams as the default one
+    const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+    pyctcdecode::BeamSearchDecoderCTC decoder(alphabet, std::nullopt, level);
+    pyctcdecode::BeamSearchDecoderCTC default_decoder(alphabet);
+    BOOST_CHECK(decoder.simd_level() == level);
+    BOOST_CHECK(default_decoder.simd_level() ==
+                pyctcdecode::detect_simd_level());
+    const auto beams = decoder.decode_beams(TEST_LOGIT);
+    const auto expected_beams = default_decoder.decode_beams(TEST_LOGIT);
+    BOOST_CHECK_EQUAL(beams.size(), expected_beams.size());
+    BOOST_CHECK_EQUAL(beams.at(0).text_, expected_beams.at(0).text_);
+    BOOST_CHECK_CLOSE(beams.at(0).logit_score, expected_beams.at(0).logit_score,
+                      1e-3);
+  }
+
+  const auto inf = std::numeric_limits<float>::infinity();
+  for (float d = 0.0; d < 20.0; d += 0.013) {
+    const auto expected =
+        static_cast<float>(std::log(std::exp(1.5) + std::exp(1.5 - d)));
+    BOOST_CHECK_SMALL(pyctcdecode::log_add(1.5, 1.5 - d) - expected,
+                      pyctcdecode::LOG_ADD_MAX_ERROR);
+    BOOST_CHECK_SMALL(pyctcdecode::log_add(1.5 - d, 1.5) - expected,
+                      pyctcdecode::LOG_ADD_MAX_ERROR);
+  }
+  // at beam score magnitudes the final addition rounds at the ulp of the
+  // result, on top of the table error
+  for (const float hi : {-200.0f, -37.25f}) {
+    const auto ulp = std::nextafter(std::abs(hi), 1e3f) - std::abs(hi);
+    for (float d = 0.0; d < 20.0; d += 0.013) {
+      const float lo = hi - d;
+      const auto expected =
+          static_cast<double>(hi) + std::log1p(std::exp(double(lo) - hi));
+      const double tolerance = pyctcdecode::LOG_ADD_MAX_ERROR + ulp;
+      BOOST_CHECK_SMALL(pyctcdecode::log_add(hi, lo) - expected, tolerance);
+      BOOST_CHECK_SMALL(pyctcdecode::log_add(lo, hi) - expected, tolerance);
+    }
+  }
+  BOOST_CHECK_EQUAL(pyctcdecode::log_add(-2.0, -inf), -2.0f);
+  BOOST_CHECK_EQUAL(pyctcdecode::log_add(-inf, -inf), -inf);
+  BOOST_CHECK_CLOSE(pyctcdecode::log_sum_exp(x.data(), x.size()),
+                    std::log(std::accumulate(x.begin(), x.end(), 0.0,
+                                             [](double acc, float v) {
+                                               return acc + std::exp(v);
+                                             })),
+                    1e-4);
+}
+
+BOOST_AUTO_TEST_CASE(logits_archive_test) {
+  const auto alphabet = pyctcdecode::Alphabet::build_alphabet(SAMPLE_LABELS);
+  auto decoder = std::make_unique<pyctcdecode::BeamSearchDecoderCTC>(alphabet);
+  const pyctcdecode::RowMajorMatrixXf logits = TEST_LOGIT;
+  const pyctcdecode::RowMajorMatrixXf short_logits = logits.topRows(7);
+  const auto expected = decoder->decode_beams(logits).at(0);
+  const auto expected_short = decoder->decode_beams(short_logits).at(0);
+  const auto dir = std::filesystem::temp_directory_path();
+
+  const auto archive_path = dir / "pyctcdecode_archive_test.ctcl";
+  pyctcdecode::LogitsArchive::write<float>(
+      archive_path, {{"full", pyctcdecode::logits_view(logits)},
+                     {"short", pyctcdecode::logits_view(short_logits)}});
+  const Eigen::Matrix<Eigen::half, Eigen::Dynamic, Eigen::Dynamic> half =
+      logits.cast<Eigen::half>();
+  const auto half_path = dir / "pyctcdecode_archive_test_half.ctcl";
+  pyctcdecode::LogitsArchive::write<Eigen::half>(
+      half_path, {{"half", pyctcdecode::logits_view(half)}});
+  {
+    const auto archive = pyctcdecode::LogitsArchive::open(archive_path);
+    BOOST_REQUIRE_EQUAL(archive.size(), 2);
+    BOOST_CHECK_EQUAL(archive.at(1).name, "short");
+    BOOST_CHECK_EQUAL(archive.at(1).n_frames, 7);
+    BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(archive.at(1).data) % 64, 0);
+    archive.prefetch(1);
+    BOOST_CHECK_EQUAL(
+        pyctcdecode::decode_entry(*decoder, archive.at(0)).at(0).text_,
+        expected.text_);
+    BOOST_CHECK_EQUAL(
+        pyctcdecode::decode_entry(*decoder, archive.at(1)).at(0).logit_score,
+        expected_short.logit_score);
+    BOOST_CHECK_THROW(archive.at(0).view<Eigen::half>(), std::runtime_error);
+    const auto half_archive = pyctcdecode::LogitsArchive::open(half_path);
+    BOOST_CHECK_EQUAL(
+        pyctcdecode::decode_entry(*decoder, half_archive.at(0)).at(0).text_,
+        expected.text_);
+  }
+
+  const auto npy_path = dir / "pyctcdecode_archive_test.npy";
+  const auto npz_path = dir / "pyctcdecode_archive_test.npz";
+  std::ofstream(npy_path, std::ios::binary) << npy_bytes(logits);
+  std::ofstream(npz_path, std::ios::binary)
+      << zip_bytes({{"full.npy", npy_bytes(logits)},
+                    {"short.npy", npy_bytes(short_logits)}});
+  {
+    const auto npy = pyctcdecode::LogitsArchive::open(npy_path);
+    BOOST_REQUIRE_EQUAL(npy.size(), 1);
+    BOOST_CHECK_EQUAL(npy.at(0).name, "pyctcdecode_archive_test");
+    BOOST_CHECK_EQUAL(
+        pyctcdecode::decode_entry(*decoder, npy.at(0)).at(0).text_,
+        expected.text_);
+    const auto npz = pyctcdecode::LogitsArchive::open(npz_path);
+    BOOST_REQUIRE_EQUAL(npz.size(), 2);
+    BOOST_CHECK_EQUAL(npz.at(1).name, "short");
+    BOOST_CHECK_EQUAL(
+        pyctcdecode::decode_entry(*decoder, npz.at(1)).at(0).logit_score,
+        expected_short.logit_score);
+    // full.npy data starts 166 bytes into the zip, past its local header, so
+    // the entry reads from an aligned copy rather than the mapping
+    BOOST_CHECK(npz.at(0).copy != nullptr);
+    BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(npz.at(0).data) %
+                          alignof(float),
+                      0);
+    BOOST_CHECK(npz.at(0).view<float>() == logits);
+    BOOST_CHECK_EQUAL(
+        pyctcdecode::decode_entry(*decoder, npz.at(0)).at(0).text_,
+        expected.text_);
+    npz.prefetch(0);
+  }
+
+  // headers claiming a shape the file cannot hold, or whose byte count
+  // overflows, are rejected before any entry points into the mapping
+  const auto patch_file = [](const std::filesystem::path &path, size_t offset,
+                             uint64_t value) {
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(offset);
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  for (const auto &[offset, value] :
+       std::vector<std::pair<size_t, uint64_t>>{{24, uint64_t(1) << 62},
+                                                {24, 0},
+                                                {32, uint64_t(1) << 63},
+                                                {32, 0}}) {
+    pyctcdecode::LogitsArchive::write<float>(
+        archive_path, {{"short", pyctcdecode::logits_view(short_logits)}});
+    patch_file(archive_path, offset, value);
+    BOOST_CHECK_THROW(pyctcdecode::LogitsArchive::open(archive_path),
+                      std::runtime_error);
+  }
+  const auto n_vocab = std::to_string(short_logits.cols());
+  const auto npy_with_shape = [&](const std::string &shape) {
+    auto bytes = npy_bytes(short_logits);
+    const std::string old_shape = "(7, " + n_vocab + ")";
+    bytes.replace(bytes.find(old_shape), old_shape.size(), shape);
+    // keep the header length by dropping padding
+    bytes.erase(bytes.find('\n') - (shape.size() - old_shape.size()),
+                shape.size() - old_shape.size());
+    return bytes;
+  };
+  for (const auto &shape : {"(-7, " + n_vocab + ")", "(7, -" + n_vocab + ")",
+                            "(4611686018427387904, " + n_vocab + ")"}) {
+    std::ofstream(npy_path, std::ios::binary) << npy_with_shape(shape);
+    BOOST_CHECK_THROW(pyctcdecode::LogitsArchive::open(npy_path),
+                      std::runtime_error);
+  }
+  // an npz member declaring more bytes than the file holds
+  auto npz = zip_bytes({{"big.npy", npy_with_shape("(100000, 1000)")}});
+  const uint32_t huge_size = 0x7fffffff;
+  const auto central = npz.find("PK\x01\x02");
+  npz.replace(central + 20, 4, reinterpret_cast<const char *>(&huge_size), 4);
+  npz.replace(central + 24, 4, reinterpret_cast<const char *>(&huge_size), 4);
+  std::ofstream(npz_path, std::ios::binary) << npz;
+  BOOST_CHECK_THROW(pyctcdecode::LogitsArchive::open(npz_path),
+                    std::runtime_error);
+
+  for (const auto &path : {archive_path, half_path, npy_path, npz_path}) {
+    std::filesystem::remove(path);
+  }
+  BOOST_CHECK_THROW(pyctcdecode::LogitsArchive::open(npy_path),
+                    std::runtime_error);
+}